@@ -3,10 +3,17 @@
 #ifdef _WIN32
 #include <malloc.h>
 #endif
+#include <xmmintrin.h>
 #include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 #include <iostream>
 
+#include "PageAllocator.h"
+
 /**
  * Allocator for aligned data.
  *
@@ -152,3 +159,100 @@ using avx_aligned = aligned_allocator<T, 32>;
 
 template<typename T>
 using cache_aligned = aligned_allocator<T, 64>;
+
+/**
+ * Tag for the constructors leaving the memory untouched, for a parallel first touch by the threads
+ * which are going to use it.
+ */
+struct uninitialized_t
+{
+	explicit uninitialized_t() = default;
+};
+
+inline constexpr uninitialized_t uninitialized{};
+
+/**
+ * Fixed size, value-initialized (or uninitialized) array of trivial items whose first element sits lead_bytes past
+ * a page boundary. Movable, not copyable. Pages come from waves::PageAllocator, so they are huge
+ * pages if asked for.
+ */
+template <typename T>
+class page_offset_buffer
+{
+	static_assert(std::is_trivially_destructible_v<T>);
+
+	T* _storage{ nullptr };
+	T* _begin{ nullptr };
+	std::size_t _size{ 0 };
+	std::size_t _allocated{ 0 };
+
+	void release() noexcept
+	{
+		waves::PageAllocator::deallocate(_storage);
+		_storage = _begin = nullptr;
+		_size = _allocated = 0;
+	}
+
+public:
+	// lead_bytes must be a multiple of sizeof(T)
+	page_offset_buffer(std::size_t size, std::size_t lead_bytes)
+		: _size{ size }
+		, _allocated{ size + lead_bytes / sizeof(T) }
+	{
+		_storage = static_cast<T*>(waves::PageAllocator::allocate(_allocated * sizeof(T)));
+		_begin = _storage + lead_bytes / sizeof(T);
+		std::uninitialized_value_construct_n(_begin, _size);
+	}
+
+	page_offset_buffer(std::size_t size, std::size_t lead_bytes, uninitialized_t)
+		: _size{ size }
+		, _allocated{ size + lead_bytes / sizeof(T) }
+	{
+		_storage = static_cast<T*>(waves::PageAllocator::allocate(_allocated * sizeof(T)));
+		_begin = _storage + lead_bytes / sizeof(T);
+	}
+
+	page_offset_buffer(page_offset_buffer&& other) noexcept
+		: _storage{ other._storage }
+		, _begin{ other._begin }
+		, _size{ other._size }
+		, _allocated{ other._allocated }
+	{
+		other._storage = other._begin = nullptr;
+		other._size = other._allocated = 0;
+	}
+
+	page_offset_buffer& operator=(page_offset_buffer&& other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			std::swap(_storage, other._storage);
+			std::swap(_begin, other._begin);
+			std::swap(_size, other._size);
+			std::swap(_allocated, other._allocated);
+		}
+		return *this;
+	}
+
+	page_offset_buffer(const page_offset_buffer&) = delete;
+	page_offset_buffer& operator=(const page_offset_buffer&) = delete;
+
+	~page_offset_buffer()
+	{
+		release();
+	}
+
+	T& operator[](std::size_t idx) noexcept { return _begin[idx]; }
+	const T& operator[](std::size_t idx) const noexcept { return _begin[idx]; }
+
+	T* data() noexcept { return _begin; }
+	const T* data() const noexcept { return _begin; }
+
+	T* begin() noexcept { return _begin; }
+	T* end() noexcept { return _begin + _size; }
+	const T* begin() const noexcept { return _begin; }
+	const T* end() const noexcept { return _begin + _size; }
+
+	std::size_t size() const noexcept { return _size; }
+};
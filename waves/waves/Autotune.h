@@ -0,0 +1,336 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "World.h"
+#include "PageAllocator.h"
+#include "RuntimeConfig.h"
+#include "ThreadGrid.h"
+
+namespace waves
+{
+	// The fastest setting found for one medium size
+	struct tuning_entry
+	{
+		MediumSize size{ 0, 0, 0 };
+		std::string kernel;
+		int threads{ 0 };
+		double gvoxels_per_second{ 0 };	// measured on the reduced grid, see Autotuner
+	};
+
+	//
+	// Per-host tuning profile, written by waves_headless --autotune and applied to the runtime_config on start up,
+	// to the settings the command line doesn't give. A text file named after the host, one line per tuned size:
+	//
+	//    tuned <w>x<h>x<d> <kernel> <threads> <Gvoxel/s>
+	//
+	class TuningProfile
+	{
+		std::vector<tuning_entry> _entries;
+
+	public:
+
+		static std::string host_name()
+		{
+			char name[256] = {};
+#if defined(_WIN32)
+			DWORD length = sizeof(name);
+			if (!::GetComputerNameA(name, &length))
+				return "unknown";
+#else
+			if (::gethostname(name, sizeof(name) - 1) != 0)
+				return "unknown";
+#endif
+			std::string ret{ name };
+			for (auto& c : ret)
+			{
+				if (c == '/' || c == '\\' || c == ':' || c == ' ')
+					c = '_';
+			}
+			return ret.empty() ? "unknown" : ret;
+		}
+
+		static std::string default_file_name()
+		{
+			return "waves_tuning_" + host_name() + ".txt";
+		}
+
+		// false if the file is missing or malformed, the profile is empty then
+		bool load(const std::string& file_name)
+		{
+			_entries.clear();
+
+			std::ifstream in{ file_name };
+			if (!in)
+				return false;
+
+			std::string line;
+			while (std::getline(in, line))
+			{
+				if (line.empty() || line[0] == '#')
+					continue;
+
+				std::istringstream fields{ line };
+				std::string token, size;
+				tuning_entry entry;
+				if (!(fields >> token >> size >> entry.kernel >> entry.threads >> entry.gvoxels_per_second) || token != "tuned"
+					|| !runtime_config::parse_size(size, entry.size) || entry.threads <= 0)
+				{
+					_entries.clear();
+					return false;
+				}
+
+				set(entry);
+			}
+
+			return true;
+		}
+
+		bool save(const std::string& file_name) const
+		{
+			std::ofstream out{ file_name };
+			if (!out)
+				return false;
+
+			out << "# waves tuning profile of " << host_name() << ", see waves_headless --autotune\n";
+			out << "# tuned <size> <kernel> <threads> <Gvoxel/s on the reduced grid>\n";
+			for (const auto& e : _entries)
+				out << "tuned " << e.size.width << "x" << e.size.height << "x" << e.size.depth << " " << e.kernel << " " << e.threads << " " << e.gvoxels_per_second << "\n";
+
+			return static_cast<bool>(out);
+		}
+
+		// replaces the entry of the same size
+		void set(const tuning_entry& entry)
+		{
+			auto existing = std::find_if(_entries.begin(), _entries.end(), [&](const auto& e) { return e.size == entry.size; });
+			if (existing != _entries.end())
+				*existing = entry;
+			else
+				_entries.push_back(entry);
+		}
+
+		// The entry of the size, or of the one with the closest x-y plane - the stencil streams whole planes,
+		// the depth only scales the work. nullptr if the profile is empty.
+		const tuning_entry* find(const MediumSize& size) const noexcept
+		{
+			const tuning_entry* ret = nullptr;
+			double best = 0;
+			for (const auto& e : _entries)
+			{
+				if (e.size == size)
+					return &e;
+
+				const double distance = std::abs(std::log(static_cast<double>(e.size.width) * e.size.height / (static_cast<double>(size.width) * size.height)));
+				if (ret == nullptr || distance < best)
+				{
+					ret = &e;
+					best = distance;
+				}
+			}
+			return ret;
+		}
+
+		const std::vector<tuning_entry>& entries() const noexcept
+		{
+			return _entries;
+		}
+	};
+
+	// Loads the profile named by the config (the per-host one by default) and applies the entry for the
+	// configured size; --threads and --kernel given on the command line win. The applied entry, if any.
+	inline std::optional<tuning_entry> apply_tuning_profile(runtime_config& config)
+	{
+		if (config.tuning_profile() == "off")
+			return std::nullopt;
+
+		TuningProfile profile;
+		if (!profile.load(config.tuning_profile().empty() ? TuningProfile::default_file_name() : config.tuning_profile()))
+			return std::nullopt;
+
+		const auto entry = profile.find(config.medium_size());
+		if (entry == nullptr)
+			return std::nullopt;
+
+		config.use_tuned(entry->kernel, entry->threads);
+		return *entry;
+	}
+
+	//
+	// Times short bursts of iterate() for every kernel variant and thread count on a reduced grid - the configured
+	// x-y plane, REDUCED_DEPTH planes deep - and stores the fastest into the tuning profile. The reduced grid runs
+	// on the compiled-in Medium when the configured size has one, like the real run. The worlds of one
+	// run share the scene, built once. --kernel or --threads given on the command line pin that setting.
+	//
+	class Autotuner
+	{
+		using clock = std::chrono::steady_clock;
+
+		const runtime_config& _config;
+
+	public:
+
+		static constexpr int REDUCED_DEPTH = 256;
+
+	private:
+
+		template <typename TList>
+		struct reduced_list;
+
+		template <typename... TSizes>
+		struct reduced_list<detail::WorldSizeList<TSizes...>>
+		{
+			using type = detail::WorldSizeList<detail::WorldSize<TSizes::size.width, TSizes::size.height, std::min(TSizes::size.depth, REDUCED_DEPTH)>...>;
+		};
+
+		// RegisteredWorldSizes cut down to REDUCED_DEPTH, only instantiated by the tuner
+		using ReducedWorldSizes = typename reduced_list<RegisteredWorldSizes>::type;
+
+	public:
+		static constexpr int WARMUP_ITERATIONS = 2;
+		static constexpr int BURST_ITERATIONS = 8;
+		static constexpr int BURSTS = 3;
+
+		Autotuner(const runtime_config& config)
+			: _config{ config }
+		{
+		}
+
+		static MediumSize reduced_size(const MediumSize& size) noexcept
+		{
+			return { size.width, size.height, std::min(size.depth, REDUCED_DEPTH) };
+		}
+
+		// powers of two up to the CPUs this process may run on, and the CPU count itself
+		static std::vector<int> thread_counts(int cpus)
+		{
+			std::vector<int> ret;
+			for (int n = 1; n < cpus; n *= 2)
+				ret.push_back(n);
+			ret.push_back(cpus);
+			return ret;
+		}
+
+		static std::vector<std::string> kernel_names()
+		{
+			using TMedium = RuntimeMedium<>;
+			std::vector<std::string> ret;
+			for (const auto& v : StencilKernel::variants<TMedium, TMedium::rebind<ItemStatic>>())
+				ret.push_back(v.name);
+			return ret;
+		}
+
+		int Run()
+		{
+			const auto size = _config.medium_size();
+			const auto reduced = reduced_size(size);
+			if (!BasicWorld<RuntimeMedium<>>::size_supported(reduced))
+			{
+				std::cerr << "The scene doesn't fit into " << size.width << "x" << size.height << "x" << size.depth << ", or the grid is over 2^31 voxels" << std::endl;
+				return 1;
+			}
+
+			const auto kernels = _config.kernel_given() ? std::vector<std::string>{ _config.kernel() } : kernel_names();
+			const auto threads = _config.threads_given() ? std::vector<int>{ _config.threads() } : thread_counts(static_cast<int>(ThreadGrid::AvailableCpus().size()));
+
+			std::cout << "Tuning for " << size.width << "x" << size.height << "x" << size.depth << " on " << TuningProfile::host_name()
+				<< ", timing on " << reduced.width << "x" << reduced.height << "x" << reduced.depth << std::endl;
+
+			PageAllocator::set_mode(_config.huge_page_mode());
+
+			scene_handle scene;
+			tuning_entry best{};
+			best.size = size;
+
+			for (int n : threads)
+			{
+				auto world = make_reduced_world(size, n, &scene);
+				if (!world || !world->initialize(_config.pattern_file()))
+				{
+					std::cerr << "Can't set up the world for tuning" << std::endl;
+					return 1;
+				}
+				world->set_reductions_every(_config.reductions_every());
+
+				for (const auto& kernel : kernels)
+				{
+					if (!world->set_kernel(kernel))
+					{
+						std::cerr << "Unknown kernel " << kernel << std::endl;
+						return 1;
+					}
+
+					const double rate = measure(*world);
+					std::cout << "  " << std::setw(10) << std::left << kernel << std::right << std::setw(4) << n << " threads: " << rate << " Gvoxel/s" << std::endl;
+
+					if (rate > best.gvoxels_per_second)
+						best = { size, kernel, n, rate };
+				}
+			}
+
+			const auto file_name = _config.tuning_profile().empty() || _config.tuning_profile() == "off" ? TuningProfile::default_file_name() : _config.tuning_profile();
+
+			TuningProfile profile;
+			profile.load(file_name);
+			profile.set(best);
+			if (!profile.save(file_name))
+			{
+				std::cerr << "Can't write " << file_name << std::endl;
+				return 1;
+			}
+
+			std::cout << "Fastest: kernel " << best.kernel << ", " << best.threads << " threads, " << best.gvoxels_per_second << " Gvoxel/s, saved to " << file_name << std::endl;
+			return 0;
+		}
+
+	private:
+
+		// the world the configured size would get from make_world(), REDUCED_DEPTH planes deep
+		std::unique_ptr<IWorld> make_reduced_world(const MediumSize& size, int num_threads, scene_handle* scene) const
+		{
+			const auto reduced = reduced_size(size);
+			if (!RegisteredWorldSizes::contains(size))
+				return make_world(reduced, num_threads, {}, scene, _config.boundary());
+
+			return ReducedWorldSizes::make(reduced, num_threads, {}, scene, _config.boundary());
+		}
+
+		// the best of BURSTS bursts, so a burst hit by another process doesn't decide
+		static double measure(IWorld& world)
+		{
+			for (int i = 0; i < WARMUP_ITERATIONS; ++i)
+				world.iterate();
+
+			const double voxels = static_cast<double>(world.width()) * world.height() * world.depth();
+
+			double best = 0;
+			for (int burst = 0; burst < BURSTS; ++burst)
+			{
+				const auto start = clock::now();
+				for (int i = 0; i < BURST_ITERATIONS; ++i)
+					world.iterate();
+				const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+				best = std::max(best, voxels * BURST_ITERATIONS / seconds / 1e9);
+			}
+			return best;
+		}
+	};
+}
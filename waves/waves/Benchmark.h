@@ -0,0 +1,724 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Medium.h"
+#include "PageAllocator.h"
+#include "PerfCounters.h"
+#include "Pml.h"
+#include "Random.h"
+#include "StencilKernel.h"
+#include "ThreadGrid.h"
+
+namespace waves::bench
+{
+	using grid_size = MediumSize;
+
+	struct bench_config
+	{
+		std::vector<grid_size> sizes{ { 128, 128, 128 } };
+		std::vector<int> threads{ 8 };
+		std::vector<float> fills{ 1.0f };
+		std::vector<std::string> kernels{ "reference" };
+
+		int warmup{ 5 };		// untimed iterations before the first repetition
+		int repetitions{ 10 };
+		int iterations{ 10 };	// iterations per timed repetition
+
+		size_t stream_mb{ 256 };	// per STREAM triad array, should be well above the LLC
+		std::string json_file{};	// empty - stdout
+		bool perf_counters{ false };
+		bool reductions{ false };	// run the kernels with the fused FieldReductions, where they have them
+		bool runtime_size{ false };	// RuntimeMedium even for the registered sizes, to see what the constant strides buy
+		std::vector<MediumLayout::padding> layouts{ MediumLayout::padding::padded };	// dense runs on RuntimeMedium
+		std::vector<huge_pages> page_modes{ huge_pages::transparent };
+		bool boundaries{ false };	// the absorbing boundary comparison instead of the kernels, see run_boundaries()
+
+		static const char* get_usage()
+		{
+			return
+				"Usage: waves_bench [options]\n"
+				"  --size WxHxD[,WxHxD...]   grid sizes (default 128x128x128), --list-sizes are compiled in, others run time sized\n"
+				"  --threads n[,n...]        thread counts (default 8)\n"
+				"  --fill r[,r...]           fraction of voxels with non-zero conductivity, 0..1 (default 1)\n"
+				"  --kernel name[,name...]   kernel variants (default reference), see --list-kernels\n"
+				"  --warmup n                untimed warm-up iterations (default 5)\n"
+				"  --reps n                  timed repetitions (default 10)\n"
+				"  --iters n                 iterations per repetition (default 10)\n"
+				"  --stream-mb n             size of each STREAM triad array in MB (default 256)\n"
+				"  --json <file>             write the JSON report to a file instead of stdout\n"
+				"  --perf                    add hardware counters per voxel (Linux perf_event_open)\n"
+				"  --reductions              time the steps with the fused field reductions\n"
+				"  --runtime-size            use the run time sized medium for the registered sizes too\n"
+				"  --layout l[,l...]         padded (default) or dense medium layout, dense is run time sized, see MediumLayout\n"
+				"  --huge-pages m[,m...]     off, thp (default) or hugetlb backing of the fields, see PageAllocator\n"
+				"  --boundaries              compare the reflection and cost of the sponge and PML boundaries instead\n"
+				"  --list-sizes, --list-kernels\n";
+		}
+
+		template <typename T, typename TParse>
+		static bool parse_list(const std::string& value, std::vector<T>& out, TParse&& parse)
+		{
+			out.clear();
+			std::istringstream str{ value };
+			std::string item;
+			while (std::getline(str, item, ','))
+			{
+				T v{};
+				if (!parse(item, v))
+					return false;
+				out.push_back(v);
+			}
+			return !out.empty();
+		}
+
+		bool parse_command_line(int argc, char** argv)
+		{
+			try
+			{
+				for (int idx = 1; idx < argc; ++idx)
+				{
+					const std::string arg{ argv[idx] };
+					const bool has_value = (idx + 1) < argc;
+
+					if (arg == "--size" && has_value)
+					{
+						if (!parse_list<grid_size>(argv[++idx], sizes, [](const std::string& s, grid_size& v)
+							{
+								return sscanf(s.c_str(), "%dx%dx%d", &v.width, &v.height, &v.depth) == 3;
+							}))
+							return false;
+					}
+					else if (arg == "--threads" && has_value)
+					{
+						if (!parse_list<int>(argv[++idx], threads, [](const std::string& s, int& v) { v = std::stoi(s); return v > 0; }))
+							return false;
+					}
+					else if (arg == "--fill" && has_value)
+					{
+						if (!parse_list<float>(argv[++idx], fills, [](const std::string& s, float& v) { v = std::stof(s); return v >= 0.0f && v <= 1.0f; }))
+							return false;
+					}
+					else if (arg == "--kernel" && has_value)
+					{
+						if (!parse_list<std::string>(argv[++idx], kernels, [](const std::string& s, std::string& v) { v = s; return true; }))
+							return false;
+					}
+					else if (arg == "--warmup" && has_value)
+						warmup = std::stoi(argv[++idx]);
+					else if (arg == "--reps" && has_value)
+						repetitions = std::max(1, std::stoi(argv[++idx]));
+					else if (arg == "--iters" && has_value)
+						iterations = std::max(1, std::stoi(argv[++idx]));
+					else if (arg == "--stream-mb" && has_value)
+						stream_mb = std::stoul(argv[++idx]);
+					else if (arg == "--json" && has_value)
+						json_file = argv[++idx];
+					else if (arg == "--perf")
+						perf_counters = true;
+					else if (arg == "--reductions")
+						reductions = true;
+					else if (arg == "--runtime-size")
+						runtime_size = true;
+					else if (arg == "--boundaries")
+						boundaries = true;
+					else if (arg == "--huge-pages" && has_value)
+					{
+						if (!parse_list<huge_pages>(argv[++idx], page_modes, [](const std::string& s, huge_pages& v) { return PageAllocator::parse(s, v); }))
+							return false;
+					}
+					else if (arg == "--layout" && has_value)
+					{
+						if (!parse_list<MediumLayout::padding>(argv[++idx], layouts, [](const std::string& s, MediumLayout::padding& v)
+							{
+								v = s == "dense" ? MediumLayout::padding::dense : MediumLayout::padding::padded;
+								return s == "dense" || s == "padded";
+							}))
+							return false;
+					}
+					else
+						return false;
+				}
+			}
+			catch (const std::exception&)
+			{
+				return false;
+			}
+
+			return true;
+		}
+	};
+
+	struct sample_stats
+	{
+		double min{ 0 };
+		double median{ 0 };
+		double mean{ 0 };
+		double max{ 0 };
+		double stddev{ 0 };
+
+		static sample_stats from(std::vector<double> samples)
+		{
+			sample_stats ret;
+			if (samples.empty())
+				return ret;
+
+			std::sort(samples.begin(), samples.end());
+			ret.min = samples.front();
+			ret.max = samples.back();
+			ret.median = samples.size() % 2 != 0
+				? samples[samples.size() / 2]
+				: (samples[samples.size() / 2 - 1] + samples[samples.size() / 2]) / 2.0;
+			ret.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+
+			double sq = 0.0;
+			for (auto s : samples)
+				sq += (s - ret.mean) * (s - ret.mean);
+			ret.stddev = samples.size() > 1 ? std::sqrt(sq / (samples.size() - 1)) : 0.0;
+
+			return ret;
+		}
+
+		void write_json(std::ostream& out) const
+		{
+			out << "{ \"min\": " << min << ", \"median\": " << median << ", \"mean\": " << mean
+				<< ", \"max\": " << max << ", \"stddev\": " << stddev << " }";
+		}
+	};
+
+	struct bench_result
+	{
+		grid_size size;
+		int threads;
+		float fill;
+		std::string kernel;
+		bool runtime_size;			// RuntimeMedium rather than a compiled-in Medium
+		MediumLayout::padding layout;
+		huge_pages page_mode;
+		double huge_page_fraction;	// of the field buffers, as obtained
+
+		double bytes_per_voxel;		// modelled DRAM traffic per voxel update
+		sample_stats gvoxels_per_second;
+		sample_stats seconds_per_iteration;
+
+		// ThreadGrid telemetry over the timed repetitions
+		double mean_imbalance{ 0 };
+		double grid_efficiency{ 0 };
+
+		PerfCounterReport perf{};
+
+		double gbytes_per_second() const noexcept
+		{
+			return gvoxels_per_second.median * bytes_per_voxel;
+		}
+	};
+
+	//
+	// Kernel variants which can be benchmarked, see StencilKernel::variants()
+	//
+	template <typename TMedium, typename TMediumStatic>
+	using kernel_variant = StencilKernelVariant<TMedium, TMediumStatic>;
+
+	template <typename TMedium, typename TMediumStatic>
+	std::vector<kernel_variant<TMedium, TMediumStatic>> kernel_variants()
+	{
+		return StencilKernel::variants<TMedium, TMediumStatic>();
+	}
+
+	//
+	// Grid sizes with a compiled-in Medium, each one is a separate template instantiation,
+	// the rest runs on RuntimeMedium
+	//
+	template <typename TFunc>
+	bool with_registered_size(const grid_size& size, TFunc&& func)
+	{
+		auto try_size = [&](auto tag) -> bool
+		{
+			using TMedium = typename decltype(tag)::type;
+			if (TMedium::width() != size.width || TMedium::height() != size.height || TMedium::depth() != size.depth)
+				return false;
+			func(tag);
+			return true;
+		};
+
+		return
+			try_size(std::type_identity<Medium<64, 64, 64>>{}) ||
+			try_size(std::type_identity<Medium<128, 128, 128>>{}) ||
+			try_size(std::type_identity<Medium<256, 256, 256>>{}) ||
+			try_size(std::type_identity<Medium<432, 256, 256>>{}) ||
+			try_size(std::type_identity<Medium<432, 768, 768>>{});
+	}
+
+	inline const char* registered_sizes()
+	{
+		return "64x64x64 128x128x128 256x256x256 432x256x256 432x768x768";
+	}
+
+	template <typename TMediumStatic>
+	void fill_static(TMediumStatic& statics, float fill, Random& random)
+	{
+		for (int z = 0; z < statics.depth(); ++z)
+		{
+			for (int y = 0; y < statics.height(); ++y)
+			{
+				for (int x = 0; x < statics.width(); ++x)
+				{
+					auto& item = statics.at(x, y, z);
+					item.conductivity = random.NextFloat() < fill ? 127 : 0;
+					item.velocity_bit = x >= statics.width() / 2 ? 1 : 0;
+				}
+			}
+		}
+	}
+
+	template <typename TMedium>
+	void fill_field(TMedium& medium, Random& random)
+	{
+		for (int z = 0; z < medium.depth(); ++z)
+		{
+			for (int y = 0; y < medium.height(); ++y)
+			{
+				for (int x = 0; x < medium.width(); ++x)
+				{
+					auto& item = medium.at(x, y, z);
+					item.location = random.NextFloat() * 1000.0f - 500.0f;
+					item.velocity = random.NextFloat() * 10.0f - 5.0f;
+				}
+			}
+		}
+	}
+
+	//
+	// STREAM triad a = b + s * c on the same thread grid, GB/s counted the STREAM way (24 bytes per element)
+	//
+	inline double stream_triad_gbytes_per_second(ThreadGrid& grid, size_t mb, int repetitions)
+	{
+		const size_t n = mb * 1024 * 1024 / sizeof(double);
+		std::vector<double> a(n), b(n, 1.0), c(n, 2.0);
+		const double s = 3.0;
+
+		double best = 0.0;
+		for (int rep = 0; rep < repetitions + 1; ++rep)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					const size_t from = n * thread_idx / num_threads;
+					const size_t to = n * (thread_idx + 1) / num_threads;
+					for (size_t i = from; i < to; ++i)
+						a[i] = b[i] + s * c[i];
+				});
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			if (rep > 0) // first one is the warm-up / page faulting pass
+				best = std::max(best, 3.0 * sizeof(double) * n / seconds / 1e9);
+		}
+
+		return best;
+	}
+
+	// a compiled-in Medium is always padded; zeroed on the grid, like World does
+	template <typename TMedium>
+	TMedium make_medium(const grid_size& size, MediumLayout::padding layout, ThreadGrid& grid)
+	{
+		auto ret = [&]()
+		{
+			if constexpr (TMedium::is_fixed_size)
+				return TMedium{ size, uninitialized };
+			else
+				return TMedium{ size, uninitialized, layout };
+		}();
+
+		StencilKernel::first_touch(ret, grid);
+		return ret;
+	}
+
+	template <typename TMedium>
+	bool run_one(const bench_config& cfg, const grid_size& size, MediumLayout::padding layout, int threads, float fill, ThreadGrid& grid, std::vector<bench_result>& results)
+	{
+		using TMediumStatic = typename TMedium::template rebind<ItemStatic>;
+
+		auto mediums = std::make_unique<std::array<TMedium, 2>>(std::array<TMedium, 2>{ make_medium<TMedium>(size, layout, grid), make_medium<TMedium>(size, layout, grid) });
+		auto statics = std::make_unique<TMediumStatic>(make_medium<TMediumStatic>(size, layout, grid));
+
+		Random random{};
+		fill_static(*statics, fill, random);
+
+		// the buffers are zeroed by make_medium(), so every page has been touched and THP got or didn't get them
+		const auto pages = PageAllocator::report();
+
+		const double voxels = static_cast<double>(size.width) * size.height * size.depth;
+
+		for (const auto& kernel_name : cfg.kernels)
+		{
+			const auto variants = kernel_variants<TMedium, TMediumStatic>();
+			auto variant = std::find_if(variants.begin(), variants.end(), [&](const auto& v) { return kernel_name == v.name; });
+			if (variant == variants.end())
+			{
+				std::cerr << "Unknown kernel " << kernel_name << std::endl;
+				return false;
+			}
+
+			fill_field((*mediums)[0], random);
+			fill_field((*mediums)[1], random);
+
+			if (cfg.reductions && variant->run_reducing == nullptr)
+			{
+				std::cerr << "Kernel " << kernel_name << " has no fused reductions" << std::endl;
+				return false;
+			}
+
+			FieldReductions reductions;
+			uint64_t iteration = 0;
+			auto step = [&]()
+			{
+				if (cfg.reductions)
+					variant->run_reducing((*mediums)[iteration % 2], (*mediums)[(iteration + 1) % 2], *statics, grid, reductions);
+				else
+					variant->run((*mediums)[iteration % 2], (*mediums)[(iteration + 1) % 2], *statics, grid);
+				++iteration;
+			};
+
+			for (int i = 0; i < cfg.warmup; ++i)
+				step();
+
+			grid.ResetStats();
+			ThreadGrid::StatsScope stats_scope{ grid };
+
+			std::vector<double> gvoxels;
+			std::vector<double> seconds_per_iter;
+
+			for (int rep = 0; rep < cfg.repetitions; ++rep)
+			{
+				const auto start = std::chrono::steady_clock::now();
+				for (int i = 0; i < cfg.iterations; ++i)
+					step();
+				const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				seconds_per_iter.push_back(seconds / cfg.iterations);
+				gvoxels.push_back(voxels * cfg.iterations / seconds / 1e9);
+			}
+
+			bench_result result{
+				size,
+				threads,
+				fill,
+				cfg.reductions ? kernel_name + "+reductions" : kernel_name,
+				!TMedium::is_fixed_size,
+				layout,
+				pages.mode,
+				pages.fraction(),
+				variant->bytes_per_voxel,
+				sample_stats::from(gvoxels),
+				sample_stats::from(seconds_per_iter)
+			};
+
+			const auto grid_stats = grid.Stats();
+			result.mean_imbalance = grid_stats.meanImbalance;
+			result.grid_efficiency = grid_stats.efficiency;
+			result.perf = PerfCounterReport::from(grid_stats.perf, voxels * cfg.iterations * cfg.repetitions);
+
+			if (cfg.perf_counters && !result.perf.available)
+				std::cerr << "Hardware counters unavailable: " << grid_stats.perfError << std::endl;
+
+			std::cerr << size.width << "x" << size.height << "x" << size.depth << (result.runtime_size ? " (run time sized)" : "")
+				<< (layout == MediumLayout::padding::dense ? " dense" : " padded")
+				<< " pages: " << PageAllocator::name(result.page_mode) << " " << result.huge_page_fraction * 100.0 << "% huge"
+				<< " threads: " << threads << " fill: " << fill << " kernel: " << result.kernel
+				<< " -> " << result.gvoxels_per_second.median << " Gvoxel/s, " << result.gbytes_per_second() << " GB/s"
+				<< ", imbalance " << result.mean_imbalance << ", grid efficiency " << result.grid_efficiency << std::endl;
+
+			results.push_back(result);
+		}
+
+		return true;
+	}
+
+	inline void write_json(std::ostream& out, const std::vector<bench_result>& results, const std::vector<std::pair<int, double>>& stream, const bench_config& cfg)
+	{
+		auto stream_for = [&](int threads)
+		{
+			for (const auto& [t, gbs] : stream)
+				if (t == threads)
+					return gbs;
+			return 0.0;
+		};
+
+		out << "{\n";
+		out << "  \"warmup\": " << cfg.warmup << ", \"repetitions\": " << cfg.repetitions << ", \"iterations\": " << cfg.iterations << ",\n";
+
+		out << "  \"stream_triad_gbytes_per_second\": {";
+		for (size_t i = 0; i < stream.size(); ++i)
+			out << (i == 0 ? " " : ", ") << "\"" << stream[i].first << "\": " << stream[i].second;
+		out << " },\n";
+
+		out << "  \"results\": [\n";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const auto& r = results[i];
+			const double stream_gbs = stream_for(r.threads);
+
+			out << "    {\n";
+			out << "      \"size\": \"" << r.size.width << "x" << r.size.height << "x" << r.size.depth << "\",\n";
+			out << "      \"threads\": " << r.threads << ", \"fill\": " << r.fill << ", \"kernel\": \"" << r.kernel << "\",\n";
+			out << "      \"runtime_size\": " << (r.runtime_size ? "true" : "false")
+				<< ", \"layout\": \"" << (r.layout == MediumLayout::padding::dense ? "dense" : "padded") << "\""
+				<< ", \"huge_pages\": \"" << PageAllocator::name(r.page_mode) << "\", \"huge_page_fraction\": " << r.huge_page_fraction << ",\n";
+			out << "      \"gvoxels_per_second\": "; r.gvoxels_per_second.write_json(out); out << ",\n";
+			out << "      \"seconds_per_iteration\": "; r.seconds_per_iteration.write_json(out); out << ",\n";
+			out << "      \"model_bytes_per_voxel\": " << r.bytes_per_voxel << ",\n";
+			out << "      \"effective_gbytes_per_second\": " << r.gbytes_per_second() << ",\n";
+			out << "      \"mean_imbalance\": " << r.mean_imbalance << ", \"grid_efficiency\": " << r.grid_efficiency << ",\n";
+			out << "      \"fraction_of_stream\": " << (stream_gbs > 0.0 ? r.gbytes_per_second() / stream_gbs : 0.0) << ",\n";
+			out << "      \"roofline_gvoxels_per_second\": " << stream_gbs / r.bytes_per_voxel;
+			if (r.perf.available)
+			{
+				out << ",\n      \"perf\": { \"ipc\": " << r.perf.ipc
+					<< ", \"l1d_misses_per_voxel\": " << r.perf.l1d_misses_per_voxel
+					<< ", \"llc_misses_per_voxel\": " << r.perf.llc_misses_per_voxel
+					<< ", \"dram_bytes_per_voxel\": " << r.perf.dram_bytes_per_voxel
+					<< ", \"packed_fp_fraction\": " << r.perf.packed_fp_fraction << " }";
+			}
+			out << "\n";
+			out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+		}
+		out << "  ]\n";
+		out << "}\n";
+	}
+
+	//
+	// Reflection off the absorbing boundaries: a Gaussian pulse in the middle of a uniform box, INTERIOR voxels
+	// across, the sponge or the PML shell on all six faces - against the same pulse in a reference box MARGIN
+	// voxels wider on every side, too wide for anything its walls reflect to be back within ITERATIONS. The
+	// reflection is the largest RMS difference over the interior at the checks, relative to the pulse's RMS at
+	// the start, the cost the time per step of the box.
+	//
+	struct boundary_result
+	{
+		boundary_kind kind;
+		int shell;					// voxels deep
+		grid_size size;
+		double updated_voxels;		// the ones with conductivity, the kernel skips the rest
+		double reflection;
+		sample_stats seconds_per_iteration;
+	};
+
+	class BoundaryTest
+	{
+	public:
+		static constexpr int INTERIOR = 48;
+		static constexpr int MARGIN = 40;
+		static constexpr int ITERATIONS = 720;
+		static constexpr int CHECK_EVERY = 40;
+		static constexpr float PULSE_SIGMA = 1.5f;	// most of the spectrum around the scene source's frequency
+		static constexpr float PULSE_AMPLITUDE = 500.0f;
+
+		// as the scene's, see BasicWorld::EDGE_THICKNESS and EDGE_SLOW_DOWN_FACTOR
+		static constexpr int SPONGE_THICKNESS = 10;
+		static constexpr float SPONGE_FACTOR = 0.98f;
+
+	private:
+		using TMedium = RuntimeMedium<>;
+		using TMediumStatic = TMedium::rebind<ItemStatic>;
+
+		ThreadGrid& _grid;
+		boundary_kind _kind;
+		int _shell;
+		int _margin;	// plain medium between the interior and the shell, the reference box's
+
+		std::unique_ptr<std::array<TMedium, 2>> _mediums;
+		std::unique_ptr<TMediumStatic> _statics;
+		std::unique_ptr<PmlBoundary> _pml;
+		uint64_t _iteration{ 0 };
+
+		// the interior starts here, a zero conductivity wall outside the shell
+		int first() const noexcept
+		{
+			return 1 + _shell + _margin;
+		}
+
+		// how deep p is into the shell on either side, <= 0 inside
+		float depth(float p) const noexcept
+		{
+			const float lower = _shell + 0.5f;
+			const float upper = _shell + 2.0f * _margin + INTERIOR + 0.5f;
+			return std::max(lower - p, p - upper);
+		}
+
+	public:
+		BoundaryTest(ThreadGrid& grid, boundary_kind kind, int shell, int margin = 0)
+			: _grid{ grid }
+			, _kind{ kind }
+			, _shell{ shell }
+			, _margin{ margin }
+		{
+			const int side = INTERIOR + 2 * (1 + _shell + _margin);
+			const grid_size size{ side, side, side };
+
+			_mediums = std::make_unique<std::array<TMedium, 2>>(std::array<TMedium, 2>{ make_medium<TMedium>(size, MediumLayout::padding::padded, grid), make_medium<TMedium>(size, MediumLayout::padding::padded, grid) });
+			_statics = std::make_unique<TMediumStatic>(make_medium<TMediumStatic>(size, MediumLayout::padding::padded, grid));
+
+			const float centre = (side - 1) / 2.0f;
+
+			for (int z = 0; z < side; ++z)
+			{
+				for (int y = 0; y < side; ++y)
+				{
+					for (int x = 0; x < side; ++x)
+					{
+						const bool wall = x == 0 || y == 0 || z == 0 || x == side - 1 || y == side - 1 || z == side - 1;
+
+						float conductivity = wall ? 0.0f : 127.0f;
+						if (_kind == boundary_kind::sponge)
+						{
+							for (float d : { depth(static_cast<float>(x)), depth(static_cast<float>(y)), depth(static_cast<float>(z)) })
+								conductivity *= d > 0 ? std::pow(SPONGE_FACTOR, d + 0.5f) : 1.0f;
+						}
+
+						_statics->at(x, y, z).conductivity = static_cast<uint8_t>(conductivity);
+						_statics->at(x, y, z).velocity_bit = 0;
+
+						const float r2 = (x - centre) * (x - centre) + (y - centre) * (y - centre) + (z - centre) * (z - centre);
+						(*_mediums)[0].at(x, y, z).location = PULSE_AMPLITUDE * std::exp(-r2 / (2.0f * PULSE_SIGMA * PULSE_SIGMA));
+					}
+				}
+			}
+
+			if (_kind == boundary_kind::pml)
+			{
+				auto profile = [&](float x, float y, float z)
+				{
+					return pml_damping{ PmlBoundary::damping(depth(x), _shell), PmlBoundary::damping(depth(y), _shell), PmlBoundary::damping(depth(z), _shell) };
+				};
+				_pml = std::make_unique<PmlBoundary>(*_statics, profile, grid, PmlBoundary::max_damping(static_cast<float>(_shell)));
+			}
+		}
+
+		void step() noexcept
+		{
+			auto& current = (*_mediums)[_iteration % 2];
+			auto& next = (*_mediums)[(_iteration + 1) % 2];
+
+			StencilKernel::run(current, next, *_statics, _grid);
+			if (_pml)
+				_pml->apply(current, next, *_statics, _grid);
+
+			++_iteration;
+		}
+
+		const TMedium& current() const noexcept
+		{
+			return (*_mediums)[_iteration % 2];
+		}
+
+		grid_size size() const noexcept
+		{
+			return { _statics->width(), _statics->height(), _statics->depth() };
+		}
+
+		double updated_voxels() const noexcept
+		{
+			double ret = 0;
+			for (int z = 0; z < _statics->depth(); ++z)
+				for (int y = 0; y < _statics->height(); ++y)
+					for (int x = 0; x < _statics->width(); ++x)
+						ret += _statics->at(x, y, z).conductivity != 0 ? 1 : 0;
+			return ret;
+		}
+
+		// sum over the interior of the squared location, or of its difference to the other test's
+		double interior_sq(const BoundaryTest* other = nullptr) const noexcept
+		{
+			double ret = 0;
+			for (int z = 0; z < INTERIOR; ++z)
+			{
+				for (int y = 0; y < INTERIOR; ++y)
+				{
+					for (int x = 0; x < INTERIOR; ++x)
+					{
+						double v = current().at(first() + x, first() + y, first() + z).location;
+						if (other != nullptr)
+							v -= other->current().at(other->first() + x, other->first() + y, other->first() + z).location;
+						ret += v * v;
+					}
+				}
+			}
+			return ret;
+		}
+	};
+
+	inline std::vector<boundary_result> run_boundaries(ThreadGrid& grid)
+	{
+		BoundaryTest reference{ grid, boundary_kind::sponge, BoundaryTest::SPONGE_THICKNESS, BoundaryTest::MARGIN };
+
+		std::vector<std::unique_ptr<BoundaryTest>> tests;
+		tests.push_back(std::make_unique<BoundaryTest>(grid, boundary_kind::sponge, BoundaryTest::SPONGE_THICKNESS));
+		tests.push_back(std::make_unique<BoundaryTest>(grid, boundary_kind::pml, PmlBoundary::THICKNESS));
+
+		const double pulse = std::sqrt(reference.interior_sq());
+
+		std::vector<double> reflection(tests.size(), 0.0);
+		std::vector<std::vector<double>> seconds(tests.size());
+
+		for (int check = 0; check < BoundaryTest::ITERATIONS / BoundaryTest::CHECK_EVERY; ++check)
+		{
+			for (int i = 0; i < BoundaryTest::CHECK_EVERY; ++i)
+				reference.step();
+
+			for (size_t t = 0; t < tests.size(); ++t)
+			{
+				const auto start = std::chrono::steady_clock::now();
+				for (int i = 0; i < BoundaryTest::CHECK_EVERY; ++i)
+					tests[t]->step();
+				seconds[t].push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / BoundaryTest::CHECK_EVERY);
+
+				reflection[t] = std::max(reflection[t], std::sqrt(tests[t]->interior_sq(&reference)) / pulse);
+			}
+		}
+
+		std::vector<boundary_result> ret;
+		for (size_t t = 0; t < tests.size(); ++t)
+		{
+			const auto kind = t == 0 ? boundary_kind::sponge : boundary_kind::pml;
+			const int shell = t == 0 ? BoundaryTest::SPONGE_THICKNESS : PmlBoundary::THICKNESS;
+			ret.push_back({ kind, shell, tests[t]->size(), tests[t]->updated_voxels(), reflection[t], sample_stats::from(seconds[t]) });
+
+			const auto& r = ret.back();
+			std::cerr << PmlBoundary::name(r.kind) << " " << r.shell << " deep, " << r.size.width << "x" << r.size.height << "x" << r.size.depth
+				<< ", " << r.updated_voxels << " voxels updated: reflection " << r.reflection << ", " << r.seconds_per_iteration.median * 1e3 << " ms per step" << std::endl;
+		}
+
+		return ret;
+	}
+
+	inline void write_json(std::ostream& out, const std::vector<boundary_result>& results, int threads)
+	{
+		out << "{\n";
+		out << "  \"threads\": " << threads << ", \"interior\": " << BoundaryTest::INTERIOR << ", \"iterations\": " << BoundaryTest::ITERATIONS << ",\n";
+		out << "  \"boundaries\": [\n";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const auto& r = results[i];
+			out << "    {\n";
+			out << "      \"boundary\": \"" << PmlBoundary::name(r.kind) << "\", \"shell\": " << r.shell << ",\n";
+			out << "      \"size\": \"" << r.size.width << "x" << r.size.height << "x" << r.size.depth << "\", \"updated_voxels\": " << r.updated_voxels << ",\n";
+			out << "      \"reflection\": " << r.reflection << ",\n";
+			out << "      \"seconds_per_iteration\": "; r.seconds_per_iteration.write_json(out); out << "\n";
+			out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+		}
+		out << "  ]\n";
+		out << "}\n";
+	}
+}
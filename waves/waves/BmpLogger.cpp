@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "BmpLogger.h"
+#include "Trace.h"
 #include <sstream>
 #include <iomanip>
 #include <stdint.h>
@@ -112,6 +113,21 @@ void BmpLogger::onNewFrame()
 {
 	// Capture the actual pixels 
 	glReadPixels(0, 0, _vpWidth, _vpHeight, GL_RGBA, GL_UNSIGNED_BYTE, &_pixels[0]);
+	writeFrame();
+}
+
+void BmpLogger::onRenderedFrame(const unsigned char* rgba, int width, int height)
+{
+	if (width != _vpWidth || height != _vpHeight)
+		onViewportResize(width, height);
+
+	::memcpy(_pixels.data(), rgba, width * height * 4);
+	writeFrame();
+}
+
+void BmpLogger::writeFrame()
+{
+	WAVES_TRACE_SCOPE("bmp_encode");
 
 	// todo: format the name with leading zeroes
 	std::ostringstream str;
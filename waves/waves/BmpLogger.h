@@ -13,6 +13,8 @@ class BmpLogger : public IImageLogger
 
 	uint64_t _nextSeq{ 0 };
 
+	void writeFrame();
+
 public:
 	BmpLogger(const std::string& logFolder);
 
@@ -20,6 +22,7 @@ public:
 
 	void onViewportResize(int widht, int height) override;
 	void onNewFrame() override;
+	void onRenderedFrame(const unsigned char* rgba, int width, int height) override;
 
 };
 
@@ -0,0 +1,524 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "IWorld.h"
+#include "RankTransport.h"
+#include "World.h"
+
+namespace waves
+{
+	//
+	// The scene of BasicWorld split in z between the ranks of a RankTransport - processes on one machine
+	// or on several. Each rank holds its own planes and one halo plane on either side, and gets the location
+	// of the halo planes from its neighbours after every step. The planes next to the halos are computed
+	// first and sent while the rest is computed, the halos are waited for only after that.
+	//
+	// Each rank accumulates the exposures of its own planes, they are gathered to rank 0 which saves them.
+	// render_slice() and the reductions (every set_reductions_every() steps, as StencilKernel::reduce() does
+	// them) are collective too, so every rank has to call iterate(),
+	// render_slice() and start_taking_picture() in the same order. The slices end up on rank 0.
+	//
+	class DistributedWorld : public IWorld
+	{
+	public:
+		using TScene = BasicWorld<RuntimeMedium<>>;
+
+		using TLocalMedium = RuntimeMedium<Item>;
+		using TLocalStatic = TLocalMedium::rebind<ItemStatic>;
+
+		using TSrcPictureMedium = TLocalMedium::plane_stack<TScene::SRC_PICTURE_PLANES, float>;
+		using TPictureMedium = TLocalMedium::plane_stack<TScene::PICTURE_PLANES, float>;
+
+		using TKernelVariant = StencilKernelVariant<TLocalMedium, TLocalStatic>;
+
+		// every rank needs a plane of its own, and its share with the halo planes has to be addressable
+		static constexpr bool size_supported(const MediumSize& size, int ranks) noexcept
+		{
+			return TScene::scene_fits(size) && ranks > 0 && size.depth >= ranks
+				&& MediumLayout::offsets_fit({ size.width, size.height, (size.depth + ranks - 1) / ranks + 2 });
+		}
+
+		// a halo plane of locations, the gathered exposure or slice, the reductions
+		static RankTransportLimits transport_limits(const MediumSize& size) noexcept
+		{
+			const auto padded = MediumLayout::padding::padded;
+			const int picture_row = MediumLayout::row_stride(TScene::PICTURE_PLANES, padded);
+			const size_t picture_bytes = static_cast<size_t>(MediumLayout::plane_stride(picture_row, size.height, padded)) * size.depth * sizeof(float);
+			const size_t slice_bytes = static_cast<size_t>(size.width) * size.height * sizeof(uint32_t);
+
+			return { static_cast<size_t>(size.width) * size.height * sizeof(float), std::max(picture_bytes, slice_bytes), static_cast<size_t>(size.width) + 1 };
+		}
+
+	private:
+		const MediumSize _size;
+		RankTransport& _transport;
+
+		// planes z_from..z_to of the scene are local planes 1..planes, local 0 and planes + 1 are the halos
+		int _z_from;
+		int _z_to;
+		int _planes;
+
+		ThreadGrid _grid;
+
+		TLocalStatic _static;
+		std::array<TLocalMedium, 2> _mediums;
+
+		std::vector<float> _send[2];
+		std::vector<float> _receive[2];
+
+		TScene::TMediumPatternStatic _pattern{};
+		bool _initialized{ false };
+
+		TSrcPictureMedium _src_picture;
+		TPictureMedium _picture;
+		std::unique_ptr<TPictureMedium> _gathered_picture;		// rank 0 only
+		std::unique_ptr<TSrcPictureMedium> _gathered_src_picture;
+
+		std::vector<uint32_t> _rgba;
+
+		uint64_t _iteration{ 0 };
+
+		uint64_t elapsed_cpu_clocks{ 0 };
+
+		TKernelVariant _kernel{ StencilKernel::variants<TLocalMedium, TLocalStatic>().front() };
+
+		uint64_t _reductions_every{ 0 };
+		FieldReductions _reductions{};
+
+		Profiler _profiler;
+		const size_t _phase_fill{ _profiler.add_phase("fill") };
+		const size_t _phase_boundary{ _profiler.add_phase("boundary") };
+		const size_t _phase_interior{ _profiler.add_phase("interior") };
+		const size_t _phase_halo_wait{ _profiler.add_phase("halo_wait") };
+		const size_t _phase_exposure{ _profiler.add_phase("exposure") };
+		const size_t _phase_reductions{ _profiler.add_phase("reductions") };
+		const size_t _phase_save_pictures{ _profiler.add_phase("save_pictures") };
+		const size_t _counter_iterations{ _profiler.add_counter("iterations") };
+		const size_t _counter_halo_bytes{ _profiler.add_counter("halo_bytes") };
+		const size_t _counter_pictures{ _profiler.add_counter("pictures") };
+
+		std::string _pictures_folder;
+		uint64_t _picture_exposing_until{ 0 };
+		ExposureConvergence _convergence;
+
+		static int slab_from(const MediumSize& size, const RankTransport& transport) noexcept
+		{
+			int from, to;
+			StencilKernel::slab_for(size.depth, transport.rank(), transport.ranks(), from, to);
+			return from;
+		}
+
+		static int slab_to(const MediumSize& size, const RankTransport& transport) noexcept
+		{
+			int from, to;
+			StencilKernel::slab_for(size.depth, transport.rank(), transport.ranks(), from, to);
+			return to;
+		}
+
+		bool has_lower() const noexcept { return _transport.rank() > 0; }
+		bool has_upper() const noexcept { return _transport.rank() + 1 < _transport.ranks(); }
+
+		void pack(const TLocalMedium& medium, int z, std::vector<float>& out) const noexcept
+		{
+			for (int y = 0; y < _size.height; ++y)
+			{
+				float* dst = out.data() + static_cast<size_t>(y) * _size.width;
+				for (int x = 0; x < _size.width; ++x)
+					dst[x] = medium.at(x, y, z).location;
+			}
+		}
+
+		void unpack(const std::vector<float>& in, TLocalMedium& medium, int z) const noexcept
+		{
+			for (int y = 0; y < _size.height; ++y)
+			{
+				const float* src = in.data() + static_cast<size_t>(y) * _size.width;
+				for (int x = 0; x < _size.width; ++x)
+					medium.at(x, y, z).location = src[x];
+			}
+		}
+
+		void build_statics() noexcept
+		{
+			_grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					StencilKernel::slab_for(_planes, thread_idx, num_threads, from, to);
+
+					for (int z = from + 1; z < to + 1; ++z)
+					{
+						for (int y = 0; y < _size.height; ++y)
+						{
+							for (int x = 0; x < _size.width; ++x)
+								_static.at(x, y, z) = TScene::scene_voxel(_size, x, y, _z_from + z - 1);
+						}
+					}
+				}
+				);
+		}
+
+		void expose(const TLocalMedium& current) noexcept
+		{
+			for (int z = 0; z < _planes; ++z)
+			{
+				for (int y = 0; y < _size.height; ++y)
+				{
+					for (int x = 0; x < _src_picture.width(); ++x)
+						_src_picture.at(x, y, z) += ::powf(current.at(x + TScene::PIC_SRC_BASE, y, z + 1).location, 2.0f);
+
+					for (int x = 0; x < _picture.width(); ++x)
+						_picture.at(x, y, z) += ::powf(current.at(x + TScene::PIC_BASE, y, z + 1).location, 2.0f);
+				}
+			}
+		}
+
+		// of the state the step starts from, its halo planes are the ones received after the previous step
+		void reduce(const TLocalMedium& current)
+		{
+			std::vector<FieldReductions> partials(_grid.NumThreads());
+			for (auto& partial : partials)
+				partial.reset(_size.width, _size.height * _size.depth);
+
+			_grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					StencilKernel::slab_for(_planes, thread_idx, num_threads, from, to);
+					StencilKernel::reduce_slab(current, _static, from + 1, to + 1, partials[thread_idx]);
+				}
+				);
+
+			_reductions.reset(_size.width, _size.height * _size.depth);
+			for (const auto& partial : partials)
+				_reductions.combine(partial);
+
+			// sums: the energy and the planes, one call; the max on its own
+			std::vector<double> sums(_reductions.plane_sq_location);
+			sums.push_back(_reductions.energy);
+			_transport.all_reduce(sums.data(), sums.size(), reduce_op::sum);
+
+			double max_abs_location = _reductions.max_abs_location;
+			_transport.all_reduce(&max_abs_location, 1, reduce_op::max);
+
+			_reductions.energy = sums.back();
+			sums.pop_back();
+			_reductions.plane_sq_location = sums;
+			_reductions.max_abs_location = static_cast<float>(max_abs_location);
+			_reductions.iteration = _iteration;
+		}
+
+	public:
+		// size must pass size_supported() for transport.ranks()
+		DistributedWorld(const MediumSize& size, RankTransport& transport, int num_threads = TScene::DEFAULT_NUM_THREADS)
+			: _size{ size }
+			, _transport{ transport }
+			, _z_from{ slab_from(size, transport) }
+			, _z_to{ slab_to(size, transport) }
+			, _planes{ _z_to - _z_from }
+			, _grid{ num_threads }
+			, _static{ MediumSize{ size.width, size.height, _planes + 2 }, uninitialized }
+			, _mediums{ {
+				TLocalMedium{ MediumSize{ size.width, size.height, _planes + 2 }, uninitialized },
+				TLocalMedium{ MediumSize{ size.width, size.height, _planes + 2 }, uninitialized } } }
+			, _src_picture{ MediumSize{ size.width, size.height, _planes }, TScene::SRC_PICTURE_PLANES }
+			, _picture{ MediumSize{ size.width, size.height, _planes }, TScene::PICTURE_PLANES }
+		{
+			StencilKernel::first_touch(_static, _grid);
+			StencilKernel::first_touch(_mediums[0], _grid);
+			StencilKernel::first_touch(_mediums[1], _grid);
+
+			build_statics();
+
+			for (int side = 0; side < 2; ++side)
+			{
+				_send[side].resize(static_cast<size_t>(size.width) * size.height);
+				_receive[side].resize(static_cast<size_t>(size.width) * size.height);
+			}
+
+			if (transport.rank() == 0)
+			{
+				_gathered_picture = std::make_unique<TPictureMedium>(size, TScene::PICTURE_PLANES);
+				_gathered_src_picture = std::make_unique<TSrcPictureMedium>(size, TScene::SRC_PICTURE_PLANES);
+			}
+		}
+
+		int rank() const noexcept { return _transport.rank(); }
+		int ranks() const noexcept { return _transport.ranks(); }
+
+		// the scene planes of this rank
+		int z_from() const noexcept { return _z_from; }
+		int z_to() const noexcept { return _z_to; }
+
+		bool initialized() const noexcept override
+		{
+			return _initialized;
+		}
+
+		bool initialize(const std::string& pattern_file_name) override
+		{
+			_initialized = true;
+			return TScene::load_pattern(_pattern, pattern_file_name);
+		}
+
+		// With an empty folder the exposure is only kept in memory, on rank 0
+		void start_taking_picture(const std::string& folder, uint64_t exposition) override
+		{
+			_picture.fill(0.0f);
+			_pictures_folder = folder;
+			_picture_exposing_until = _iteration + exposition + 1;
+			_convergence.start(exposition + 2, _picture, _z_from);
+		}
+
+		bool taking_picture() const noexcept override
+		{
+			return _picture_exposing_until != 0;
+		}
+
+		void set_exposure_tolerance(double tolerance) noexcept override
+		{
+			_convergence.set_tolerance(tolerance);
+		}
+
+		int num_threads() const noexcept override
+		{
+			return _grid.NumThreads();
+		}
+
+		bool set_kernel(const std::string& name) override
+		{
+			for (const auto& variant : StencilKernel::variants<TLocalMedium, TLocalStatic>())
+			{
+				if (name == variant.name)
+				{
+					_kernel = variant;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		const char* kernel_name() const noexcept override
+		{
+			return _kernel.name;
+		}
+
+		// the boundary planes go ahead of the interior with run_planes(), which has no multi-rate form
+		bool set_multirate(bool on) override
+		{
+			return !on;
+		}
+
+		void set_reductions_every(uint64_t n) noexcept override
+		{
+			_reductions_every = n;
+		}
+
+		const FieldReductions& reductions() const noexcept override
+		{
+			return _reductions;
+		}
+
+		// of this rank
+		ThreadGridStats grid_stats() override
+		{
+			return _grid.Stats();
+		}
+
+		void enable_perf_counters() noexcept override
+		{
+			_grid.EnablePerfCounters();
+		}
+
+		PerfCounterReport perf_report() override
+		{
+			const double voxels = static_cast<double>(_size.width) * _size.height * _planes;
+			return PerfCounterReport::from(_grid.Stats().perf, voxels * static_cast<double>(_iteration));
+		}
+
+		bool iterate() noexcept override
+		{
+			auto& current = _mediums[_iteration % 2];
+			auto& next = _mediums[(_iteration + 1) % 2];
+
+			{
+				ScopedTimer t{ _profiler, _phase_fill };
+				TScene::fill(current, _pattern, _size, _z_from - 1, TScene::SOURCE_X, (_iteration % 70) > 35);
+			}
+
+			const uint64_t start = __rdtsc();
+
+			{
+				ScopedTimer t{ _profiler, _phase_boundary };
+
+				{
+					ThreadGrid::StatsScope s{ _grid };
+					_kernel.run_planes(current, next, _static, _grid, 1, 2);
+					if (_planes > 1)
+						_kernel.run_planes(current, next, _static, _grid, _planes, _planes + 1);
+				}
+
+				const size_t bytes = _send[0].size() * sizeof(float);
+				if (has_lower())
+				{
+					pack(next, 1, _send[0]);
+					_transport.start_send(rank() - 1, _send[0].data(), bytes);
+					_transport.start_receive(rank() - 1, _receive[0].data(), bytes);
+				}
+				if (has_upper())
+				{
+					pack(next, _planes, _send[1]);
+					_transport.start_send(rank() + 1, _send[1].data(), bytes);
+					_transport.start_receive(rank() + 1, _receive[1].data(), bytes);
+				}
+			}
+
+			{
+				ScopedTimer t{ _profiler, _phase_interior };
+				ThreadGrid::StatsScope s{ _grid };
+				if (_planes > 2)
+					_kernel.run_planes(current, next, _static, _grid, 2, _planes);
+			}
+
+			const uint64_t end = __rdtsc();
+
+			{
+				ScopedTimer t{ _profiler, _phase_halo_wait };
+				_transport.wait_all();
+
+				if (has_lower())
+					unpack(_receive[0], next, 0);
+				if (has_upper())
+					unpack(_receive[1], next, _planes + 1);
+
+				_profiler.count(_counter_halo_bytes, (has_lower() + has_upper()) * _receive[0].size() * sizeof(float));
+			}
+
+			if (_reductions_every != 0 && _iteration % _reductions_every == 0)
+			{
+				ScopedTimer t{ _profiler, _phase_reductions };
+				reduce(current);
+			}
+
+			if (_picture_exposing_until != 0)
+			{
+				{
+					ScopedTimer t{ _profiler, _phase_exposure };
+					expose(current);
+				}
+
+				_convergence.add_frames(1);
+				if (_convergence.due())
+				{
+					auto& sums = _convergence.plane_sums(_picture, _z_from);
+					_transport.all_reduce(sums.data(), sums.size(), reduce_op::sum);
+
+					if (_convergence.converged(sums))
+					{
+						// the rest of the exposure would only repeat the same picture
+						_convergence.finish(_picture);
+						_convergence.finish(_src_picture);
+						_picture_exposing_until = _iteration;
+					}
+				}
+
+				if (_picture_exposing_until == _iteration)
+				{
+					_picture_exposing_until = 0;
+
+					ScopedTimer ts{ _profiler, _phase_save_pictures };
+
+					_transport.gather(_picture.data.data(), _picture.data.size() * sizeof(float),
+						_gathered_picture ? _gathered_picture->data.data() : nullptr);
+					_transport.gather(_src_picture.data.data(), _src_picture.data.size() * sizeof(float),
+						_gathered_src_picture ? _gathered_src_picture->data.data() : nullptr);
+
+					if (rank() == 0 && !_pictures_folder.empty())
+					{
+						TScene::save_pictures(*_gathered_picture, _pictures_folder, TScene::PIC_BASE);
+						TScene::save_pictures(*_gathered_src_picture, _pictures_folder, TScene::PIC_SRC_BASE);
+						_profiler.count(_counter_pictures);
+					}
+				}
+			}
+
+			elapsed_cpu_clocks += end - start;
+
+			_iteration++;
+			_profiler.count(_counter_iterations);
+			return true;
+		}
+
+		uint64_t current_iteration() const noexcept override
+		{
+			return _iteration;
+		}
+
+		// fill, boundary (the planes next to the halos and the sends), interior, halo_wait, reductions, exposure, save_pictures
+		Profiler& profiler() noexcept override
+		{
+			return _profiler;
+		}
+
+		MediumSize size() const noexcept override { return _size; }
+
+		// rank 0 only, after the exposure has completed
+		const TPictureMedium* exposure() const noexcept { return _gathered_picture.get(); }
+		const TSrcPictureMedium* source_exposure() const noexcept { return _gathered_src_picture.get(); }
+
+		using IWorld::render_slice;
+
+		// Collective: the rank holding plane z renders it, rgba is filled on rank 0
+		void render_slice(uint32_t* rgba, int z) noexcept override
+		{
+			const bool mine = z >= _z_from && z < _z_to;
+			if (mine)
+				SliceRenderer::render(_mediums[_iteration % 2], z - _z_from + 1, _rgba, _grid);
+
+			_transport.gather(_rgba.data(), mine ? _rgba.size() * sizeof(uint32_t) : 0, rgba);
+		}
+
+		// of this rank's stencil, per voxel of the whole scene
+		const std::tuple<uint64_t, uint64_t> get_clocks_per_iter() override
+		{
+			if (_iteration == 0)
+				return { 0, 0 };
+
+			const uint64_t clocks_per_iter{ elapsed_cpu_clocks / _iteration };
+			const uint64_t clocks_per_iter_per_voxel{ clocks_per_iter / (static_cast<uint64_t>(_size.depth) * _size.width * _size.height) };
+
+			return { clocks_per_iter, clocks_per_iter_per_voxel };
+		}
+	};
+
+	// nullptr for a single process, see RuntimeConfig --ranks / --mpi; throws std::runtime_error if the ranks can't be started
+	inline std::unique_ptr<RankTransport> make_rank_transport(int ranks, bool mpi, const MediumSize& size, [[maybe_unused]] int* argc, [[maybe_unused]] char*** argv)
+	{
+#if defined(WAVES_MPI)
+		if (mpi)
+			return std::make_unique<MpiTransport>(argc, argv);
+#else
+		if (mpi)
+			throw std::runtime_error("--mpi needs a WAVES_MPI build");
+#endif
+
+		if (ranks <= 1)
+			return nullptr;
+
+#if defined(__linux__)
+		auto ret = std::make_unique<SharedMemoryTransport>(ranks, DistributedWorld::transport_limits(size));
+		ret->launch();
+		return ret;
+#else
+		throw std::runtime_error("--ranks is only supported on Linux, use --mpi");
+#endif
+	}
+}
@@ -0,0 +1,634 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "IWorld.h"
+#include "World.h"
+
+namespace waves
+{
+	// One voxel of N independent simulations, lane m is ensemble member m - an AVX2 vector covers 8 of them
+	template <int N>
+	struct EnsembleItem
+	{
+		float location[N];
+		float velocity[N];
+	};
+
+	// Member lane of an ensemble medium, as BasicWorld::fill() sees a medium
+	template <typename TMedium>
+	class EnsembleLane
+	{
+		TMedium& _medium;
+		int _lane;
+
+	public:
+		struct Ref
+		{
+			float& location;
+			float& velocity;
+		};
+
+		EnsembleLane(TMedium& medium, int lane) : _medium{ medium }, _lane{ lane } {}
+
+		int depth() const noexcept { return _medium.depth(); }
+
+		Ref at(int x, int y, int z) noexcept
+		{
+			auto& item = _medium.at(x, y, z);
+			return { item.location[_lane], item.velocity[_lane] };
+		}
+	};
+
+	//
+	// StencilKernel's update of all the members of an ensemble at once. The static item and the factors
+	// derived from it are loaded once per voxel for all of them, the members' fields are loaded as vectors.
+	// The arithmetic of each member is StencilKernel::run_slab()'s, in the same order.
+	//
+	// From 8 members on an item is a whole number of cache lines, so next is written with non-temporal
+	// stores, as in StencilKernel::run_slab_streaming() - the items are 32-byte aligned in either layout.
+	//
+	struct EnsembleKernel
+	{
+#pragma warning(push)
+#pragma warning(disable:26451)
+		// With REDUCE, partial gets the FieldReductions of the state it starts from, over all the lanes - the lanes at rest add nothing
+		template <int N, bool REDUCE = false, typename TMedium, typename TMediumStatic>
+		static void run_slab(const TMedium& current, TMedium& next, const TMediumStatic& statics, int z_from, int z_to, FieldReductions* partial = nullptr) noexcept
+		{
+			double energy = 0.0;
+			float max_abs_location = 0.0f;
+			double* plane_sq = REDUCE ? partial->plane_sq_location.data() : nullptr;
+
+			const int xd_neighbour = current.offset_for(-1, 0, 0) - current.offset_for(0, 0, 0);
+			const int xu_neighbour = current.offset_for(1, 0, 0) - current.offset_for(0, 0, 0);
+
+			const int yd_neighbour = current.offset_for(0, -1, 0) - current.offset_for(0, 0, 0);
+			const int yu_neighbour = current.offset_for(0, 1, 0) - current.offset_for(0, 0, 0);
+
+			const int zd_neighbour = current.offset_for(0, 0, -1) - current.offset_for(0, 0, 0);
+			const int zu_neighbour = current.offset_for(0, 0, 1) - current.offset_for(0, 0, 0);
+
+#if defined(AVX2)
+			const __m256 sixth = _mm256_set1_ps(1.0f / 6.0f);
+			const __m256 damping = _mm256_set1_ps(0.99999f);
+			const __m256 dt = _mm256_set1_ps(StencilKernel::LOC_FACTOR);
+			const __m256 half = _mm256_set1_ps(0.5f);
+			const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+			__m256 max_abs = _mm256_setzero_ps();
+#endif
+
+			for (int z = z_from; z < z_to; ++z)
+			{
+				for (int y = 0; y < current.height(); ++y)
+				{
+					float row_energy = 0.0f;
+#if defined(AVX2)
+					__m256 row_energy_v = _mm256_setzero_ps();
+#endif
+
+					const int row = current.offset_for(0, y, z);
+
+					for (int x = 0; x < current.width(); ++x)
+					{
+						const int offset = row + x;
+						const auto item_static = statics.data[offset];
+
+						if (item_static.conductivity == 0)
+							continue;
+
+						const float velocity_factor = item_static.velocity_bit ? StencilKernel::VEL_FACTOR2 : StencilKernel::VEL_FACTOR1;
+						const float conductivity_factor = static_cast<float>(item_static.conductivity) / 127.0f;
+
+						const auto& item = current.data[offset];
+						const auto& xd = current.data[offset + xd_neighbour];
+						const auto& xu = current.data[offset + xu_neighbour];
+						const auto& yd = current.data[offset + yd_neighbour];
+						const auto& yu = current.data[offset + yu_neighbour];
+						const auto& zd = current.data[offset + zd_neighbour];
+						const auto& zu = current.data[offset + zu_neighbour];
+
+						auto& out = next.data[offset];
+
+						int m = 0;
+						float voxel_sq = 0.0f;
+
+#if defined(AVX2)
+						const __m256 vf = _mm256_set1_ps(velocity_factor);
+						const __m256 cf = _mm256_set1_ps(conductivity_factor);
+
+						__m256 voxel_sq_v = _mm256_setzero_ps();
+
+						for (; m + 8 <= N; m += 8)
+						{
+							__m256 total = _mm256_add_ps(_mm256_loadu_ps(xd.location + m), _mm256_loadu_ps(xu.location + m));
+							total = _mm256_add_ps(total, _mm256_loadu_ps(yd.location + m));
+							total = _mm256_add_ps(total, _mm256_loadu_ps(yu.location + m));
+							total = _mm256_add_ps(total, _mm256_loadu_ps(zd.location + m));
+							total = _mm256_add_ps(total, _mm256_loadu_ps(zu.location + m));
+
+							const __m256 location = _mm256_loadu_ps(item.location + m);
+							const __m256 delta_x = _mm256_sub_ps(location, _mm256_mul_ps(total, sixth));
+
+							const __m256 old_velocity = _mm256_loadu_ps(item.velocity + m);
+							__m256 velocity = _mm256_sub_ps(old_velocity, _mm256_mul_ps(vf, delta_x));
+							velocity = _mm256_mul_ps(_mm256_mul_ps(velocity, cf), damping);
+
+							const __m256 new_location = _mm256_add_ps(location, _mm256_mul_ps(velocity, dt));
+
+							_mm256_stream_ps(out.velocity + m, velocity);
+							_mm256_stream_ps(out.location + m, new_location);
+
+							if constexpr (REDUCE)
+							{
+								const __m256 potential = _mm256_mul_ps(vf, _mm256_mul_ps(delta_x, delta_x));
+								row_energy_v = _mm256_add_ps(row_energy_v, _mm256_mul_ps(half, _mm256_add_ps(_mm256_mul_ps(old_velocity, old_velocity), potential)));
+								max_abs = _mm256_max_ps(max_abs, _mm256_and_ps(location, abs_mask));
+								voxel_sq_v = _mm256_add_ps(voxel_sq_v, _mm256_mul_ps(location, location));
+							}
+						}
+
+						if constexpr (REDUCE)
+							voxel_sq = horizontal_sum(voxel_sq_v);
+#endif
+
+						for (; m < N; ++m)
+						{
+							const float neigh_total = xd.location[m] + xu.location[m] + yd.location[m] + yu.location[m] + zd.location[m] + zu.location[m];
+							const float delta_x = item.location[m] - neigh_total * (1.0f / 6.0f);
+
+							const float new_velocity = (item.velocity[m] - velocity_factor * delta_x) * conductivity_factor * 0.99999f;
+							const float new_location = item.location[m] + new_velocity * StencilKernel::LOC_FACTOR;
+
+							out.velocity[m] = new_velocity;
+							out.location[m] = new_location;
+
+							if constexpr (REDUCE)
+							{
+								row_energy += 0.5f * (item.velocity[m] * item.velocity[m] + velocity_factor * delta_x * delta_x);
+								max_abs_location = std::max(max_abs_location, std::abs(item.location[m]));
+								voxel_sq += item.location[m] * item.location[m];
+							}
+						}
+
+						if constexpr (REDUCE)
+							plane_sq[x] += voxel_sq;
+					}
+
+					if constexpr (REDUCE)
+					{
+#if defined(AVX2)
+						row_energy += horizontal_sum(row_energy_v);
+#endif
+						energy += row_energy;
+					}
+				}
+			}
+
+#if defined(AVX2)
+			_mm_sfence();
+#endif
+
+			if constexpr (REDUCE)
+			{
+#if defined(AVX2)
+				alignas(32) float lanes[8];
+				_mm256_store_ps(lanes, max_abs);
+				for (float lane : lanes)
+					max_abs_location = std::max(max_abs_location, lane);
+#endif
+				partial->energy = energy;
+				partial->max_abs_location = max_abs_location;
+			}
+		}
+#pragma warning(pop)
+
+#if defined(AVX2)
+		static float horizontal_sum(__m256 v) noexcept
+		{
+			__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+			sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+			sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+			return _mm_cvtss_f32(sum);
+		}
+#endif
+
+		template <int N, typename TMedium, typename TMediumStatic>
+		static void run(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid) noexcept
+		{
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					StencilKernel::slab_for(current.depth(), thread_idx, num_threads, from, to);
+					run_slab<N>(current, next, statics, from, to);
+				}
+				);
+		}
+
+		// run(), the FieldReductions of the state it starts from are combined at the GridRun barrier, each voxel counts once per member
+		template <int N, typename TMedium, typename TMediumStatic>
+		static void run_reducing(const TMedium& current, TMedium& next, const TMediumStatic& statics, int members, ThreadGrid& grid, FieldReductions& out)
+		{
+			const int plane_voxels = current.height() * current.depth() * members;
+
+			std::vector<FieldReductions> partials(grid.NumThreads());
+			for (auto& partial : partials)
+				partial.reset(current.width(), plane_voxels);
+
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					StencilKernel::slab_for(current.depth(), thread_idx, num_threads, from, to);
+					run_slab<N, true>(current, next, statics, from, to, &partials[thread_idx]);
+				}
+				);
+
+			out.reset(current.width(), plane_voxels);
+			for (const auto& partial : partials)
+				out.combine(partial);
+		}
+	};
+
+	//
+	// The scene of BasicWorld with several patterns sent through it at once, one simulation per pattern.
+	// They share the static medium and the work on it, their fields are interleaved per voxel (see
+	// EnsembleItem), so a step of the ensemble costs far less than a step of each member on its own.
+	// Up to N members, the unused lanes stay at rest.
+	//
+	// Each member gets its own exposure, in <folder>/member_<m>. The reductions are over all the members,
+	// render_slice() shows member 0.
+	//
+	template <int N>
+	class EnsembleWorld : public IWorld
+	{
+	public:
+		using TScene = BasicWorld<RuntimeMedium<>>;
+
+		using TMedium = RuntimeMedium<EnsembleItem<N>>;
+		using TMediumStatic = typename TMedium::template rebind<ItemStatic>;
+		static_assert(std::is_same_v<TMediumStatic, TScene::TMediumStatic>);
+
+		using TSrcPictureMedium = typename TMedium::template plane_stack<TScene::SRC_PICTURE_PLANES, float>;
+		using TPictureMedium = typename TMedium::template plane_stack<TScene::PICTURE_PLANES, float>;
+
+		static constexpr int LANES = N;
+
+		static constexpr bool size_supported(const MediumSize& size) noexcept
+		{
+			return TScene::size_supported(size);
+		}
+
+	private:
+		bool _initialized{ false };
+
+		const MediumSize _size;
+		const std::vector<std::string> _pattern_files;
+		const int _members;
+
+		ThreadGrid _grid;
+
+		TMediumStatic _static;
+		std::array<TMedium, 2> _mediums;
+
+		std::vector<TScene::TMediumPatternStatic> _patterns;
+		std::vector<TSrcPictureMedium> _src_pictures;
+		std::vector<TPictureMedium> _pictures;
+
+		RuntimeMedium<Item> _slice;		// member 0 of one plane, for render_slice()
+
+		uint64_t _iteration{ 0 };
+
+		uint64_t elapsed_cpu_clocks{ 0 };
+
+		uint64_t _reductions_every{ 0 };
+		FieldReductions _reductions{};
+
+		Profiler _profiler;
+		const size_t _phase_fill{ _profiler.add_phase("fill") };
+		const size_t _phase_stencil{ _profiler.add_phase("stencil") };
+		const size_t _phase_exposure{ _profiler.add_phase("exposure") };
+		const size_t _phase_save_pictures{ _profiler.add_phase("save_pictures") };
+		const size_t _counter_iterations{ _profiler.add_counter("iterations") };
+		const size_t _counter_member_iterations{ _profiler.add_counter("member_iterations") };
+		const size_t _counter_pictures{ _profiler.add_counter("pictures") };
+
+		std::string _pictures_folder;
+		uint64_t _picture_exposing_until{ 0 };
+		std::vector<ExposureConvergence> _convergence;	// per member, the exposure ends once all of them have converged
+
+		void expose(const TMedium& current) noexcept
+		{
+			_grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					StencilKernel::slab_for(_size.depth, thread_idx, num_threads, from, to);
+
+					for (int z = from; z < to; ++z)
+					{
+						for (int y = 0; y < _size.height; ++y)
+						{
+							for (int x = 0; x < TScene::SRC_PICTURE_PLANES; ++x)
+							{
+								const auto& item = current.at(x + TScene::PIC_SRC_BASE, y, z);
+								for (int m = 0; m < _members; ++m)
+									_src_pictures[m].at(x, y, z) += ::powf(item.location[m], 2.0f);
+							}
+
+							for (int x = 0; x < TScene::PICTURE_PLANES; ++x)
+							{
+								const auto& item = current.at(x + TScene::PIC_BASE, y, z);
+								for (int m = 0; m < _members; ++m)
+									_pictures[m].at(x, y, z) += ::powf(item.location[m], 2.0f);
+							}
+						}
+					}
+				}
+				);
+		}
+
+	public:
+		// one member per pattern file, at most N of them; an empty name is the default round pattern
+		EnsembleWorld(const MediumSize& size, const std::vector<std::string>& pattern_files, int num_threads = TScene::DEFAULT_NUM_THREADS)
+			: _size{ size }
+			, _pattern_files{ pattern_files }
+			, _members{ static_cast<int>(pattern_files.size()) }
+			, _grid{ num_threads }
+			, _static{ size, uninitialized }
+			, _mediums{ { TMedium{ size, uninitialized }, TMedium{ size, uninitialized } } }
+			, _patterns(pattern_files.size())
+			, _slice{ MediumSize{ size.width, size.height, 1 } }
+			, _convergence(pattern_files.size())
+		{
+			StencilKernel::first_touch(_static, _grid);
+			StencilKernel::first_touch(_mediums[0], _grid);
+			StencilKernel::first_touch(_mediums[1], _grid);
+
+			TScene::load_scene(_static, _grid);
+
+			_src_pictures.reserve(_members);
+			_pictures.reserve(_members);
+			for (int m = 0; m < _members; ++m)
+			{
+				_src_pictures.emplace_back(size, TScene::SRC_PICTURE_PLANES);
+				_pictures.emplace_back(size, TScene::PICTURE_PLANES);
+			}
+		}
+
+		int members() const noexcept { return _members; }
+
+		bool initialized() const noexcept override
+		{
+			return _initialized;
+		}
+
+		// The members' patterns come with the constructor, the name is ignored; false if any of them can't be used
+		bool initialize(const std::string&) override
+		{
+			_initialized = true;
+
+			bool ok = true;
+			for (int m = 0; m < _members; ++m)
+				ok = TScene::load_pattern(_patterns[m], _pattern_files[m]) && ok;
+			return ok;
+		}
+
+		// With an empty folder the exposures are only kept in memory
+		void start_taking_picture(const std::string& folder, uint64_t exposition) override
+		{
+			for (auto& picture : _pictures)
+				picture.fill(0.0f);
+
+			_pictures_folder = folder;
+			_picture_exposing_until = _iteration + exposition + 1;
+			for (size_t m = 0; m < _convergence.size(); ++m)
+				_convergence[m].start(exposition + 2, _pictures[m]);
+		}
+
+		bool taking_picture() const noexcept override
+		{
+			return _picture_exposing_until != 0;
+		}
+
+		void set_exposure_tolerance(double tolerance) noexcept override
+		{
+			for (auto& convergence : _convergence)
+				convergence.set_tolerance(tolerance);
+		}
+
+		int num_threads() const noexcept override
+		{
+			return _grid.NumThreads();
+		}
+
+		// the ensemble has a kernel of its own, any of the reference kernel's names selects it
+		bool set_kernel(const std::string& name) override
+		{
+			return name == "reference" || name == kernel_name();
+		}
+
+		const char* kernel_name() const noexcept override
+		{
+			return "ensemble";
+		}
+
+		// the ensemble kernel steps every member at the full rate
+		bool set_multirate(bool on) override
+		{
+			return !on;
+		}
+
+		void set_reductions_every(uint64_t n) noexcept override
+		{
+			_reductions_every = n;
+		}
+
+		const FieldReductions& reductions() const noexcept override
+		{
+			return _reductions;
+		}
+
+		ThreadGridStats grid_stats() override
+		{
+			return _grid.Stats();
+		}
+
+		void enable_perf_counters() noexcept override
+		{
+			_grid.EnablePerfCounters();
+		}
+
+		// per member voxel update
+		PerfCounterReport perf_report() override
+		{
+			const double voxels = static_cast<double>(_size.width) * _size.height * _size.depth;
+			return PerfCounterReport::from(_grid.Stats().perf, voxels * _members * static_cast<double>(_iteration));
+		}
+
+		bool iterate() noexcept override
+		{
+			auto& current = _mediums[_iteration % 2];
+			auto& next = _mediums[(_iteration + 1) % 2];
+
+			{
+				ScopedTimer t{ _profiler, _phase_fill };
+
+				for (int m = 0; m < _members; ++m)
+				{
+					EnsembleLane<TMedium> lane{ current, m };
+					TScene::fill(lane, _patterns[m], _size, 0, TScene::SOURCE_X, (_iteration % 70) > 35);
+				}
+			}
+
+			const uint64_t start = __rdtsc();
+
+			{
+				ScopedTimer t{ _profiler, _phase_stencil };
+				ThreadGrid::StatsScope s{ _grid };
+
+				if (_reductions_every != 0 && _iteration % _reductions_every == 0)
+				{
+					EnsembleKernel::run_reducing<N>(current, next, _static, _members, _grid, _reductions);
+					_reductions.iteration = _iteration;
+				}
+				else
+				{
+					EnsembleKernel::run<N>(current, next, _static, _grid);
+				}
+			}
+
+			const uint64_t end = __rdtsc();
+
+			if (_picture_exposing_until != 0)
+			{
+				{
+					ScopedTimer t{ _profiler, _phase_exposure };
+					expose(current);
+				}
+
+				for (auto& convergence : _convergence)
+					convergence.add_frames(1);
+
+				if (_members > 0 && _convergence[0].due())
+				{
+					bool converged = true;
+					for (int m = 0; m < _members; ++m)
+						converged = _convergence[m].converged(_convergence[m].plane_sums(_pictures[m])) && converged;
+
+					if (converged)
+					{
+						// the rest of the exposure would only repeat the same pictures
+						for (int m = 0; m < _members; ++m)
+						{
+							_convergence[m].finish(_pictures[m]);
+							_convergence[m].finish(_src_pictures[m]);
+						}
+						_picture_exposing_until = _iteration;
+					}
+				}
+
+				if (_picture_exposing_until == _iteration)
+				{
+					_picture_exposing_until = 0;
+
+					if (!_pictures_folder.empty())
+					{
+						ScopedTimer ts{ _profiler, _phase_save_pictures };
+						for (int m = 0; m < _members; ++m)
+						{
+							const auto folder = _pictures_folder + "/member_" + std::to_string(m);
+							TScene::save_pictures(_pictures[m], folder, TScene::PIC_BASE);
+							TScene::save_pictures(_src_pictures[m], folder, TScene::PIC_SRC_BASE);
+							_profiler.count(_counter_pictures);
+						}
+					}
+				}
+			}
+
+			elapsed_cpu_clocks += end - start;
+
+			_iteration++;
+			_profiler.count(_counter_iterations);
+			_profiler.count(_counter_member_iterations, _members);
+			return true;
+		}
+
+		uint64_t current_iteration() const noexcept override
+		{
+			return _iteration;
+		}
+
+		// fill, stencil, exposure, save_pictures
+		Profiler& profiler() noexcept override
+		{
+			return _profiler;
+		}
+
+		MediumSize size() const noexcept override { return _size; }
+
+		const TPictureMedium& exposure(int member) const noexcept { return _pictures[member]; }
+		const TSrcPictureMedium& source_exposure(int member) const noexcept { return _src_pictures[member]; }
+
+		using IWorld::render_slice;
+
+		void render_slice(uint32_t* rgba, int z) noexcept override
+		{
+			const auto& current = _mediums[_iteration % 2];
+			for (int y = 0; y < _size.height; ++y)
+			{
+				for (int x = 0; x < _size.width; ++x)
+				{
+					const auto& item = current.at(x, y, z);
+					_slice.at(x, y, 0) = { item.location[0], item.velocity[0] };
+				}
+			}
+
+			SliceRenderer::render(_slice, 0, rgba, _grid);
+		}
+
+		// per ensemble step - all the members
+		const std::tuple<uint64_t, uint64_t> get_clocks_per_iter() override
+		{
+			if (_iteration == 0)
+				return { 0, 0 };
+
+			const uint64_t clocks_per_iter{ elapsed_cpu_clocks / _iteration };
+			const uint64_t clocks_per_iter_per_voxel{ clocks_per_iter / (static_cast<uint64_t>(_size.depth) * _size.width * _size.height) };
+
+			return { clocks_per_iter, clocks_per_iter_per_voxel };
+		}
+	};
+
+	static constexpr int MAX_ENSEMBLE_MEMBERS = 32;
+
+	// The narrowest ensemble the patterns fit into; nullptr if the scene doesn't fit or there are more than MAX_ENSEMBLE_MEMBERS patterns
+	inline std::unique_ptr<IWorld> make_ensemble_world(const MediumSize& size, const std::vector<std::string>& pattern_files, int num_threads)
+	{
+		const size_t members = pattern_files.size();
+		if (members == 0 || !EnsembleWorld<4>::size_supported(size))
+			return nullptr;
+
+		if (members <= 4)
+			return std::make_unique<EnsembleWorld<4>>(size, pattern_files, num_threads);
+		if (members <= 8)
+			return std::make_unique<EnsembleWorld<8>>(size, pattern_files, num_threads);
+		if (members <= 16)
+			return std::make_unique<EnsembleWorld<16>>(size, pattern_files, num_threads);
+		if (members <= MAX_ENSEMBLE_MEMBERS)
+			return std::make_unique<EnsembleWorld<MAX_ENSEMBLE_MEMBERS>>(size, pattern_files, num_threads);
+
+		return nullptr;
+	}
+}
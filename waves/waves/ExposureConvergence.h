@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace waves
+{
+	//
+	// Ends an exposure early once the picture has stopped changing. Every SOURCE_PERIOD frames - a full period of
+	// the source, fill() flips its sign every 35 iterations - the picture is sampled every STRIDE voxels in y and z,
+	// divided by the frames so far and compared plane by plane with the previous sample:
+	//
+	//    change = max over the planes of |sample - previous| / max(|sample|, NEGLIGIBLE_PLANE * |brightest plane's sample|)
+	//
+	// and the exposure has converged once the change stays below the tolerance for CONSECUTIVE periods in a row.
+	// A plane the wave is only reaching holds it up, planes far dimmer than the brightest one don't.
+	//
+	// The samples sit on a grid in scene z and the sums add up plane by plane, so a world split in z
+	// all-reduces plane_sums() before converged() and decides the same as a single one.
+	//
+	class ExposureConvergence
+	{
+	public:
+		static constexpr uint64_t SOURCE_PERIOD = 70;
+		static constexpr int STRIDE = 8;
+		static constexpr double NEGLIGIBLE_PLANE = 0.01;
+		static constexpr int CONSECUTIVE = 2;
+
+	private:
+		double _tolerance{ 0 };	// 0 - off, the exposures run for their whole length
+
+		uint64_t _planned{ 0 };
+		uint64_t _frames{ 0 };
+		uint64_t _next_check{ SOURCE_PERIOD };
+		int _below{ 0 };
+		double _change{ 1.0 };
+
+		std::vector<float> _sample;
+		std::vector<float> _previous;
+		std::vector<double> _sums;
+
+		template <typename TPicture>
+		static size_t sample_count(const TPicture& picture, int z_base) noexcept
+		{
+			const int z_first = (STRIDE - z_base % STRIDE) % STRIDE;
+			const size_t ys = (picture.height() + STRIDE - 1) / STRIDE;
+			const size_t zs = picture.depth() > z_first ? (picture.depth() - z_first + STRIDE - 1) / STRIDE : 0;
+			return static_cast<size_t>(picture.width()) * ys * zs;
+		}
+
+	public:
+		void set_tolerance(double tolerance) noexcept
+		{
+			_tolerance = tolerance;
+		}
+
+		double tolerance() const noexcept { return _tolerance; }
+
+		bool enabled() const noexcept { return _tolerance > 0; }
+
+		// A new exposure into picture, of planned_frames frames if it doesn't converge. Sizes the sample buffers,
+		// so the checks during the run don't allocate
+		template <typename TPicture>
+		void start(uint64_t planned_frames, const TPicture& picture, int z_base = 0)
+		{
+			_planned = planned_frames;
+			_frames = 0;
+			_next_check = SOURCE_PERIOD;
+			_below = 0;
+			_change = 1.0;
+			_sample.clear();
+			_previous.clear();
+
+			const size_t samples = sample_count(picture, z_base);
+			_sample.reserve(samples);
+			_previous.reserve(samples);
+			_sums.reserve(2 * static_cast<size_t>(picture.width()));
+		}
+
+		void add_frames(uint64_t n) noexcept
+		{
+			_frames += n;
+		}
+
+		uint64_t frames() const noexcept { return _frames; }
+
+		// the change measured by the last check
+		double change() const noexcept { return _change; }
+
+		// once per SOURCE_PERIOD frames, with a tolerance set
+		bool due() const noexcept
+		{
+			return enabled() && _frames >= _next_check;
+		}
+
+		// Samples the picture given to start() - its plane z is plane z_base + z of the scene - and returns per picture
+		// plane the sum of the squared change since the previous sample and the sum of the squared sample.
+		// The result is overwritten by the next call.
+		template <typename TPicture>
+		std::vector<double>& plane_sums(const TPicture& picture, int z_base = 0)
+		{
+			_previous.swap(_sample);
+			_sample.clear();
+
+			const float per_frame = 1.0f / static_cast<float>(std::max<uint64_t>(_frames, 1));
+			const int z_first = (STRIDE - z_base % STRIDE) % STRIDE;
+
+			auto& ret = _sums;
+			ret.assign(2 * static_cast<size_t>(picture.width()), 0.0);
+			size_t idx = 0;
+
+			for (int x = 0; x < picture.width(); ++x)
+			{
+				for (int y = 0; y < picture.height(); y += STRIDE)
+				{
+					for (int z = z_first; z < picture.depth(); z += STRIDE, ++idx)
+					{
+						const float value = picture.at(x, y, z) * per_frame;
+						const float previous = idx < _previous.size() ? _previous[idx] : 0.0f;
+
+						ret[2 * x] += static_cast<double>(value - previous) * (value - previous);
+						ret[2 * x + 1] += static_cast<double>(value) * value;
+						_sample.push_back(value);
+					}
+				}
+			}
+
+			return ret;
+		}
+
+		// Takes the - possibly all-reduced - plane_sums() of the due check, true once the exposure has converged
+		bool converged(const std::vector<double>& sums) noexcept
+		{
+			_next_check = (_frames / SOURCE_PERIOD + 1) * SOURCE_PERIOD;
+
+			double brightest = 0;
+			for (size_t p = 0; p + 1 < sums.size(); p += 2)
+				brightest = std::max(brightest, sums[p + 1]);
+
+			if (brightest == 0)
+			{
+				_below = 0;
+				return false;
+			}
+
+			double change = 0;
+			for (size_t p = 0; p + 1 < sums.size(); p += 2)
+				change = std::max(change, std::sqrt(sums[p] / std::max(sums[p + 1], NEGLIGIBLE_PLANE * NEGLIGIBLE_PLANE * brightest)));
+
+			_change = change;
+			_below = change < _tolerance ? _below + 1 : 0;
+			return _below >= CONSECUTIVE;
+		}
+
+		// Brings a picture which has converged before its planned length to the brightness it would have had
+		template <typename TPicture>
+		void finish(TPicture& picture) const noexcept
+		{
+			if (_frames == 0 || _frames >= _planned)
+				return;
+
+			const float scale = static_cast<float>(_planned) / static_cast<float>(_frames);
+			for (auto& value : picture.data)
+				value *= scale;
+		}
+	};
+}
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "World.h"
+
+//
+// Golden-result regression checks for the stencil kernels.
+//
+// The reference kernel is run on a reduced scene (TGoldenWorld, same geometry, cropped to 304x256x256)
+// with the bundled samples/pattern_*.png, the field statistics at a few checkpoints and the statistics
+// of one exposure are stored in a text file. Any kernel variant has to reproduce them within the
+// relative tolerance declared in that file:
+//
+//    waves_headless --golden-write samples/golden_reference.txt
+//    waves_headless --golden-check samples/golden_reference.txt --kernel <name>
+//
+// The wave needs ~2500 steps to cross the lens and reach the picture planes (x >= PIC_BASE), so the
+// cases run 3000 steps and expose from 2480 on. A file with an empty exposure is rejected.
+//
+// A multirate case is written single rate, then checked with set_multirate(true) (whichever the kernel)
+// against those results, within the looser tolerance it declares: the half-rate lens isn't exact.
+// A case may also select the PML boundary in place of the sponge.
+//
+// The per-voxel update doesn't depend on the thread count, so the numbers don't either.
+//
+namespace waves::golden
+{
+	using TGoldenWorld = BasicWorld<Medium<304, 256, 256>>;
+
+	static constexpr double DEFAULT_TOLERANCE_REL = 1e-4;
+	// multirate against single rate: up to ~4.5% per band around the front in the lens, <1% on the exposure
+	static constexpr double MULTIRATE_TOLERANCE_REL = 0.1;
+
+	// sum x^2 is also kept per band of x planes, to catch errors local to a part of the scene
+	static constexpr int BAND_WIDTH = 16;
+
+	// all non-negative, so a relative comparison is meaningful
+	struct field_stats
+	{
+		uint64_t iteration{ 0 };
+		double sum_abs_location{ 0 };
+		double sum_sq_location{ 0 };
+		double sum_sq_velocity{ 0 };
+		double max_abs_location{ 0 };
+		std::vector<double> band_sq_location;
+	};
+
+	struct exposure_stats
+	{
+		double sum{ 0 };
+		double max{ 0 };
+		double src_sum{ 0 };
+		double src_max{ 0 };
+	};
+
+	struct golden_case
+	{
+		std::string pattern;		// file name in the samples folder
+		uint64_t steps{ 0 };
+		uint64_t checkpoint_every{ 0 };
+		uint64_t exposure_start{ 0 };
+		uint64_t exposure_length{ 0 };
+		boundary_kind boundary{ boundary_kind::sponge };
+		bool multirate{ false };
+		double multirate_tolerance_rel{ 0 };
+
+		std::vector<field_stats> checkpoints;
+		exposure_stats exposure;
+
+		// false if the wave hasn't reached the picture planes during the exposure, nothing to compare then
+		bool exposure_covered() const noexcept { return exposure.sum > 0 && exposure.max > 0; }
+	};
+
+	struct golden_file
+	{
+		double tolerance_rel{ DEFAULT_TOLERANCE_REL };
+		std::vector<golden_case> cases;
+
+		static golden_file default_cases()
+		{
+			golden_file ret;
+			ret.cases.push_back({ .pattern = "pattern_cross.png", .steps = 3000, .checkpoint_every = 500, .exposure_start = 2480, .exposure_length = 500, .checkpoints = {}, .exposure = {} });
+			ret.cases.push_back({ .pattern = "pattern_five.png", .steps = 3000, .checkpoint_every = 500, .exposure_start = 2480, .exposure_length = 500, .checkpoints = {}, .exposure = {} });
+			ret.cases.push_back({ .pattern = "pattern_cross.png", .steps = 3000, .checkpoint_every = 500, .exposure_start = 2480, .exposure_length = 500, .multirate = true, .multirate_tolerance_rel = MULTIRATE_TOLERANCE_REL, .checkpoints = {}, .exposure = {} });
+			ret.cases.push_back({ .pattern = "pattern_five.png", .steps = 3000, .checkpoint_every = 500, .exposure_start = 2480, .exposure_length = 500, .boundary = boundary_kind::pml, .checkpoints = {}, .exposure = {} });
+			return ret;
+		}
+
+		bool write(const std::string& file_name) const
+		{
+			std::ofstream out{ file_name };
+			if (!out)
+				return false;
+
+			out << "# waves golden results, reference kernel, "
+				<< TGoldenWorld::TMedium::width() << "x" << TGoldenWorld::TMedium::height() << "x" << TGoldenWorld::TMedium::depth() << "\n";
+			out << "# checkpoint <iteration> <sum |x|> <sum x^2> <sum v^2> <max |x|> <n bands> <sum x^2 per " << BAND_WIDTH << " x planes>...\n";
+			out << "# boundary sponge|pml - sponge if omitted\n";
+			out << "# multirate <tolerance_rel> - checked multirate against the single rate results below\n";
+			out << "# exposure <sum> <max> <source sum> <source max>\n";
+			out << "tolerance_rel " << tolerance_rel << "\n";
+
+			out << std::setprecision(17);
+			for (const auto& c : cases)
+			{
+				out << "case " << c.pattern << " " << c.steps << " " << c.checkpoint_every << " " << c.exposure_start << " " << c.exposure_length << "\n";
+				if (c.boundary != boundary_kind::sponge)
+					out << "boundary " << PmlBoundary::name(c.boundary) << "\n";
+				if (c.multirate)
+					out << "multirate " << std::setprecision(6) << c.multirate_tolerance_rel << std::setprecision(17) << "\n";
+				for (const auto& s : c.checkpoints)
+				{
+					out << "checkpoint " << s.iteration << " " << s.sum_abs_location << " " << s.sum_sq_location << " " << s.sum_sq_velocity << " " << s.max_abs_location;
+					out << " " << s.band_sq_location.size();
+					for (auto band : s.band_sq_location)
+						out << " " << band;
+					out << "\n";
+				}
+				out << "exposure " << c.exposure.sum << " " << c.exposure.max << " " << c.exposure.src_sum << " " << c.exposure.src_max << "\n";
+				out << "end\n";
+			}
+
+			return static_cast<bool>(out);
+		}
+
+		bool read(const std::string& file_name)
+		{
+			std::ifstream in{ file_name };
+			if (!in)
+				return false;
+
+			cases.clear();
+
+			std::string token;
+			while (in >> token)
+			{
+				if (token[0] == '#')
+				{
+					std::getline(in, token);
+				}
+				else if (token == "tolerance_rel")
+				{
+					in >> tolerance_rel;
+				}
+				else if (token == "case")
+				{
+					golden_case c;
+					in >> c.pattern >> c.steps >> c.checkpoint_every >> c.exposure_start >> c.exposure_length;
+					cases.push_back(c);
+				}
+				else if (token == "boundary" && !cases.empty())
+				{
+					in >> token;
+					if (!PmlBoundary::parse(token, cases.back().boundary))
+						return false;
+				}
+				else if (token == "multirate" && !cases.empty())
+				{
+					cases.back().multirate = true;
+					in >> cases.back().multirate_tolerance_rel;
+				}
+				else if (token == "checkpoint" && !cases.empty())
+				{
+					field_stats s;
+					size_t bands = 0;
+					in >> s.iteration >> s.sum_abs_location >> s.sum_sq_location >> s.sum_sq_velocity >> s.max_abs_location >> bands;
+					s.band_sq_location.resize(std::min<size_t>(bands, 4096));
+					for (auto& band : s.band_sq_location)
+						in >> band;
+					cases.back().checkpoints.push_back(s);
+				}
+				else if (token == "exposure" && !cases.empty())
+				{
+					auto& e = cases.back().exposure;
+					in >> e.sum >> e.max >> e.src_sum >> e.src_max;
+				}
+				else if (token != "end")
+				{
+					return false;
+				}
+
+				if (!in)
+					return false;
+			}
+
+			return !cases.empty() && std::all_of(cases.begin(), cases.end(), [](const golden_case& c) { return c.exposure_covered(); });
+		}
+	};
+
+	template <typename TMedium>
+	field_stats measure(const TMedium& medium, uint64_t iteration)
+	{
+		field_stats ret;
+		ret.iteration = iteration;
+		ret.band_sq_location.resize((medium.width() + BAND_WIDTH - 1) / BAND_WIDTH);
+
+		for (int z = 0; z < medium.depth(); ++z)
+		{
+			for (int y = 0; y < medium.height(); ++y)
+			{
+				for (int x = 0; x < medium.width(); ++x)
+				{
+					const auto& item = medium.at(x, y, z);
+					const double location = item.location;
+					const double velocity = item.velocity;
+
+					ret.sum_abs_location += std::abs(location);
+					ret.sum_sq_location += location * location;
+					ret.band_sq_location[x / BAND_WIDTH] += location * location;
+					ret.sum_sq_velocity += velocity * velocity;
+					ret.max_abs_location = std::max(ret.max_abs_location, std::abs(location));
+				}
+			}
+		}
+
+		return ret;
+	}
+
+	template <typename TPicture>
+	void measure_picture(const TPicture& picture, double& sum, double& max)
+	{
+		sum = 0;
+		max = 0;
+		for (int x = 0; x < picture.width(); ++x)
+		{
+			for (int y = 0; y < picture.height(); ++y)
+			{
+				for (int z = 0; z < picture.depth(); ++z)
+				{
+					sum += picture.at(x, y, z);
+					max = std::max(max, static_cast<double>(picture.at(x, y, z)));
+				}
+			}
+		}
+	}
+
+	// Runs the case with the given kernel (or multirate), filling in its checkpoints and exposure
+	inline bool run_case(golden_case& c, const std::string& samples_folder, const std::string& kernel, int threads, bool multirate)
+	{
+		auto world = std::make_unique<TGoldenWorld>(TGoldenWorld::TMedium::size(), threads, std::vector<int>{}, scene_handle{}, c.boundary);
+
+		if (!world->set_kernel(kernel))
+		{
+			std::cerr << "Unknown kernel " << kernel << std::endl;
+			return false;
+		}
+
+		if (multirate && !world->set_multirate(true))
+		{
+			std::cerr << "The golden world can't run " << c.pattern << " multirate" << std::endl;
+			return false;
+		}
+
+		const auto pattern = (std::filesystem::path(samples_folder) / c.pattern).string();
+		if (!world->initialize(pattern))
+		{
+			std::cerr << "Can't use the pattern " << pattern << std::endl;
+			return false;
+		}
+
+		c.checkpoints.clear();
+
+		while (world->current_iteration() < c.steps)
+		{
+			if (world->current_iteration() == c.exposure_start)
+				world->start_taking_picture("", c.exposure_length);
+
+			world->iterate();
+
+			if (c.checkpoint_every != 0 && world->current_iteration() % c.checkpoint_every == 0)
+				c.checkpoints.push_back(measure(world->get_data(), world->current_iteration()));
+		}
+
+		if (world->taking_picture())
+		{
+			std::cerr << "The exposure of " << c.pattern << " doesn't complete within " << c.steps << " steps" << std::endl;
+			return false;
+		}
+
+		measure_picture(world->exposure(), c.exposure.sum, c.exposure.max);
+		measure_picture(world->source_exposure(), c.exposure.src_sum, c.exposure.src_max);
+		return true;
+	}
+
+	// floor: differences below it are ignored, for values which are negligible next to the total
+	inline bool within(double expected, double actual, double tolerance_rel, double floor = 0.0) noexcept
+	{
+		return std::abs(expected - actual) <= std::max(floor, tolerance_rel * std::max(std::abs(expected), std::abs(actual)));
+	}
+
+	// Prints every value out of tolerance, returns true if there are none
+	inline bool compare(const golden_case& expected, const golden_case& actual, double tolerance_rel, std::ostream& out)
+	{
+		bool ok = true;
+
+		auto check = [&](const char* what, uint64_t iteration, double e, double a, double floor = 0.0)
+		{
+			if (within(e, a, tolerance_rel, floor))
+				return;
+
+			ok = false;
+			out << "  " << expected.pattern << " @" << iteration << " " << what << ": expected " << std::setprecision(17) << e
+				<< ", got " << a << " (rel. error " << std::setprecision(3) << std::abs(e - a) / std::max(std::abs(e), std::abs(a)) << ")" << std::endl;
+		};
+
+		if (!expected.exposure_covered())
+		{
+			out << "  " << expected.pattern << ": the expected exposure is empty, the case doesn't reach the picture planes" << std::endl;
+			return false;
+		}
+
+		if (expected.checkpoints.size() != actual.checkpoints.size())
+		{
+			out << "  " << expected.pattern << ": " << expected.checkpoints.size() << " checkpoints expected, got " << actual.checkpoints.size() << std::endl;
+			return false;
+		}
+
+		for (size_t i = 0; i < expected.checkpoints.size(); ++i)
+		{
+			const auto& e = expected.checkpoints[i];
+			const auto& a = actual.checkpoints[i];
+
+			check("sum |x|", e.iteration, e.sum_abs_location, a.sum_abs_location);
+			check("sum x^2", e.iteration, e.sum_sq_location, a.sum_sq_location);
+			check("sum v^2", e.iteration, e.sum_sq_velocity, a.sum_sq_velocity);
+			check("max |x|", e.iteration, e.max_abs_location, a.max_abs_location);
+
+			if (e.band_sq_location.size() != a.band_sq_location.size())
+			{
+				ok = false;
+				out << "  " << expected.pattern << " @" << e.iteration << ": band count differs" << std::endl;
+				continue;
+			}
+
+			for (size_t band = 0; band < e.band_sq_location.size(); ++band)
+			{
+				const std::string what = "sum x^2, x " + std::to_string(band * BAND_WIDTH) + ".." + std::to_string((band + 1) * BAND_WIDTH - 1);
+				check(what.c_str(), e.iteration, e.band_sq_location[band], a.band_sq_location[band], tolerance_rel * 1e-9 * e.sum_sq_location);
+			}
+		}
+
+		const uint64_t exposure_end = expected.exposure_start + expected.exposure_length;
+		check("exposure sum", exposure_end, expected.exposure.sum, actual.exposure.sum);
+		check("exposure max", exposure_end, expected.exposure.max, actual.exposure.max);
+		check("source exposure sum", exposure_end, expected.exposure.src_sum, actual.exposure.src_sum);
+		check("source exposure max", exposure_end, expected.exposure.src_max, actual.exposure.src_max);
+
+		return ok;
+	}
+
+	// --golden-write: runs the default cases with the given kernel (normally the reference) and stores them
+	inline int write_golden(const std::string& file_name, const std::string& samples_folder, const std::string& kernel, int threads)
+	{
+		auto golden = golden_file::default_cases();
+
+		for (auto& c : golden.cases)
+		{
+			// multirate cases too: they are checked against the single rate results
+			std::cout << "Running " << c.pattern << " for " << c.steps << " steps, " << PmlBoundary::name(c.boundary) << ", kernel " << kernel << "..." << std::endl;
+			if (!run_case(c, samples_folder, kernel, threads, false))
+				return 2;
+
+			if (!c.exposure_covered())
+			{
+				std::cerr << "The exposure of " << c.pattern << " is empty, the wave doesn't reach the picture planes within " << c.steps << " steps" << std::endl;
+				return 2;
+			}
+		}
+
+		if (!golden.write(file_name))
+		{
+			std::cerr << "Can't write " << file_name << std::endl;
+			return 1;
+		}
+
+		std::cout << "Golden results written to " << file_name << std::endl;
+		return 0;
+	}
+
+	// --golden-check: re-runs every case of the file with the given kernel, returns non-zero on any mismatch
+	inline int check_golden(const std::string& file_name, const std::string& samples_folder, const std::string& kernel, int threads)
+	{
+		golden_file golden;
+		if (!golden.read(file_name))
+		{
+			std::cerr << "Can't read golden results from " << file_name << " (or a case has an empty exposure)" << std::endl;
+			return 1;
+		}
+
+		bool ok = true;
+		for (const auto& expected : golden.cases)
+		{
+			const double tolerance_rel = expected.multirate ? expected.multirate_tolerance_rel : golden.tolerance_rel;
+
+			std::cout << "Checking " << expected.pattern << " for " << expected.steps << " steps, " << PmlBoundary::name(expected.boundary) << ", "
+				<< (expected.multirate ? "multirate" : "kernel " + kernel) << ", tolerance " << tolerance_rel << "..." << std::endl;
+
+			golden_case actual = expected;
+			if (!run_case(actual, samples_folder, kernel, threads, expected.multirate))
+				return 2;
+
+			if (!compare(expected, actual, tolerance_rel, std::cout))
+				ok = false;
+		}
+
+		std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+		return ok ? 0 : 3;
+	}
+}
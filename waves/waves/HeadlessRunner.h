@@ -0,0 +1,511 @@
+#pragma once
+
+#include <memory>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "World.h"
+#include "DistributedWorld.h"
+#include "Ensemble.h"
+#include "OutOfCore.h"
+#include "PageAllocator.h"
+#include "RuntimeConfig.h"
+#include "PngLogger.h"
+#include "Profiler.h"
+#include "Trace.h"
+
+namespace waves
+{
+	//
+	// Batch front end around World (or OutOfCoreWorld with --out-of-core, DistributedWorld with a RankTransport,
+	// EnsembleWorld with --ensemble):
+	// no window, no message loop, no dialogs. Everything comes from runtime_config, everything goes to
+	// config.output_folder() - from rank 0 only, the other ranks just take part in the collective calls:
+	//   stats.csv              - one row every config.stats_every() iterations
+	//   profile.csv            - per-phase latencies since the start, same cadence, one row per phase
+	//   perf.csv               - hardware counters of the stencil per voxel since the start, if config.perf_counters()
+	//   plane_rms.csv          - RMS of x per x plane from the latest reductions, same cadence as stats.csv
+	//   config.trace_file()    - Chrome trace timeline of the run, in WAVES_TRACE builds
+	//   exposure_<start>/NNN.png - pictures for every scheduled exposure, in member_<m>/ for every member of an ensemble
+	//   slices/NNNNNNNN.png    - mid slice snapshots, if config.slice_every() != 0
+	//
+	class HeadlessRunner
+	{
+		using clock = std::chrono::steady_clock;
+
+		runtime_config& _config;
+		RankTransport* _transport;
+		std::unique_ptr<IWorld> _world;
+
+		std::filesystem::path _output;
+		FILE* _stats{ nullptr };
+		FILE* _profile{ nullptr };
+		FILE* _perf{ nullptr };
+		FILE* _planes{ nullptr };
+
+		Profiler _profiler;
+		const size_t _phase_save_slice{ _profiler.add_phase("save_slice") };
+
+		std::unique_ptr<PngLogger> _sliceLogger;
+		std::vector<uint32_t> _slice;
+
+		clock::time_point _start;
+		uint64_t _exposures_from{ 0 }; // the exposures starting before are already taken care of
+
+		std::ostream _null{ nullptr };
+
+		bool root() const noexcept
+		{
+			return _transport == nullptr || _transport->rank() == 0;
+		}
+
+		// std::cout on rank 0, nowhere on the others
+		std::ostream& out() noexcept
+		{
+			return root() ? std::cout : _null;
+		}
+
+	public:
+		// transport - the ranks to split the scene between, nullptr for a single process
+		HeadlessRunner(runtime_config& config, RankTransport* transport = nullptr)
+			: _config{ config }
+			, _transport{ transport }
+			, _output{ config.output_folder() }
+		{
+		}
+
+		~HeadlessRunner()
+		{
+			if (_stats != nullptr)
+				fclose(_stats);
+			if (_profile != nullptr)
+				fclose(_profile);
+			if (_perf != nullptr)
+				fclose(_perf);
+			if (_planes != nullptr)
+				fclose(_planes);
+		}
+
+		int Run()
+		{
+			int ret = Setup();
+
+			// every rank has to get to the loop, or none of them
+			if (_transport != nullptr)
+			{
+				double worst = ret;
+				_transport->all_reduce(&worst, 1, reduce_op::max);
+				ret = static_cast<int>(worst);
+			}
+
+			if (ret != 0)
+				return ret;
+
+			_start = clock::now();
+			auto last_report_time = _start;
+			uint64_t last_report_iteration = 0;
+
+			// an out-of-core world advances by whole passes, so the cadences are checked for being reached, not hit
+			while (_world->current_iteration() < _config.iterations())
+			{
+				startScheduledExposures();
+
+				const uint64_t previous = _world->current_iteration();
+				const bool exposing = _world->taking_picture();
+				if (!_world->iterate())
+					break;
+
+				const uint64_t iteration = _world->current_iteration();
+
+				if (exposing && !_world->taking_picture())
+					out() << "Exposure done at " << iteration << std::endl;
+
+				if (_config.slice_every() != 0 && reached(previous, iteration, _config.slice_every()))
+					saveSlice();
+
+				if (_config.stats_every() != 0 && reached(previous, iteration, _config.stats_every()))
+				{
+					const auto now = clock::now();
+					writeStats(iteration, now, last_report_time, last_report_iteration);
+					last_report_time = now;
+					last_report_iteration = iteration;
+				}
+
+				if (_config.exposure_tolerance() > 0 && exposuresDone())
+				{
+					out() << "All the exposures are done, ending the run" << std::endl;
+					break;
+				}
+			}
+
+			writeStats(_world->current_iteration(), clock::now(), _start, 0);
+
+			_world->profiler().print(out());
+			_profiler.print(out());
+			printGridStats();
+			printPerf();
+
+			if (Tracer::instance().enabled())
+			{
+				Tracer::instance().stop();
+				if (!Tracer::instance().write_chrome_json(_config.trace_file()))
+					std::cerr << "Can't write the trace to " << _config.trace_file() << std::endl;
+			}
+
+			if (_world->taking_picture() && root())
+				std::cerr << "Warning: the run ended before the last exposure completed, it was not saved" << std::endl;
+
+			out() << "Done, " << _world->current_iteration() << " iterations" << std::endl;
+			return 0;
+		}
+
+	private:
+		// Everything up to the first iteration, 0 or the exit code
+		int Setup()
+		{
+			std::error_code ec;
+			if (root())
+				std::filesystem::create_directories(_output, ec);
+			if (ec)
+			{
+				std::cerr << "Can't create output folder " << _output.string() << ": " << ec.message() << std::endl;
+				return 1;
+			}
+
+			if (!_config.trace_file().empty())
+			{
+				if (Tracer::compiled_in())
+					Tracer::instance().start();
+				else
+					std::cerr << "Warning: --trace ignored, built without WAVES_TRACE" << std::endl;
+			}
+			WAVES_TRACE_THREAD_NAME("main");
+
+			const auto size = _config.medium_size();
+			const auto& out_of_core = _config.out_of_core_folder();
+			out() << "Building the scene, " << size.width << "x" << size.height << "x" << size.depth;
+			if (!out_of_core.empty())
+				out() << " out of core in " << out_of_core << ", " << _config.slab_planes() << " planes per slab, " << _config.steps_per_pass() << " steps per pass";
+			else if (!_config.ensemble_patterns().empty())
+				out() << " ensemble of " << _config.ensemble_patterns().size() << " patterns";
+			else if (_transport != nullptr)
+				out() << " split in z between " << _transport->ranks() << " ranks (" << _transport->name() << ")";
+			else if (!RegisteredWorldSizes::contains(size))
+				out() << " (run time sized medium)";
+			out() << ", " << PmlBoundary::name(_config.boundary()) << " boundary, " << _config.threads() << " threads..." << std::endl;
+
+			if (_config.boundary() != boundary_kind::sponge && (!out_of_core.empty() || !_config.ensemble_patterns().empty() || _transport != nullptr))
+			{
+				std::cerr << "--boundary " << PmlBoundary::name(_config.boundary()) << " doesn't combine with --out-of-core, --ensemble or --ranks / --mpi" << std::endl;
+				return 1;
+			}
+
+			PageAllocator::set_mode(_config.huge_page_mode());
+			const auto build_start = clock::now();
+			if (!_config.ensemble_patterns().empty())
+			{
+				if (!out_of_core.empty() || _transport != nullptr)
+				{
+					std::cerr << "--ensemble doesn't combine with --out-of-core or --ranks / --mpi" << std::endl;
+					return 1;
+				}
+
+				if (_config.ensemble_patterns().size() > MAX_ENSEMBLE_MEMBERS)
+				{
+					std::cerr << "At most " << MAX_ENSEMBLE_MEMBERS << " --ensemble patterns, run the rest as another ensemble" << std::endl;
+					return 1;
+				}
+
+				_world = make_ensemble_world(size, _config.ensemble_patterns(), _config.threads());
+			}
+			else if (_transport != nullptr)
+			{
+				if (!out_of_core.empty())
+				{
+					std::cerr << "--out-of-core doesn't combine with --ranks / --mpi" << std::endl;
+					return 1;
+				}
+
+				if (DistributedWorld::size_supported(size, _transport->ranks()))
+					_world = std::make_unique<DistributedWorld>(size, *_transport, _config.threads());
+			}
+			else if (!out_of_core.empty())
+			{
+				try
+				{
+					std::filesystem::create_directories(out_of_core);
+					_world = make_out_of_core_world(size, out_of_core, _config.slab_planes(), _config.steps_per_pass(), _config.threads());
+				}
+				catch (const std::exception& e)
+				{
+					std::cerr << "Can't set up the out-of-core fields: " << e.what() << std::endl;
+					return 1;
+				}
+			}
+			else
+			{
+				_world = make_world(size, _config.threads(), {}, nullptr, _config.boundary());
+			}
+			if (!_world)
+			{
+				std::cerr << "The scene doesn't fit into " << size.width << "x" << size.height << "x" << size.depth << ", or the grid is over 2^31 voxels" << std::endl;
+				return 1;
+			}
+			out() << "Built in " << std::chrono::duration<double>(clock::now() - build_start).count() << "s, ";
+			PageAllocator::report().print(out());
+			out() << std::endl;
+			_world->set_reductions_every(_config.reductions_every());
+			_world->set_exposure_tolerance(_config.exposure_tolerance());
+
+			if (!_world->set_kernel(_config.kernel()))
+			{
+				std::cerr << "Unknown kernel " << _config.kernel() << std::endl;
+				return 1;
+			}
+
+			if (!_world->set_multirate(_config.multirate()))
+			{
+				std::cerr << "--multirate needs an in-memory single-pattern world with the sponge boundary" << std::endl;
+				return 1;
+			}
+
+			if (!_world->initialize(_config.pattern_file()))
+			{
+				const std::string pattern = _config.ensemble_patterns().empty() ? "the pattern " + _config.pattern_file() : "one of the --ensemble patterns";
+				std::cerr << "Can't use " << pattern << ", expected 240x240 png" << std::endl;
+				return 2;
+			}
+
+			if (_config.perf_counters())
+				_world->enable_perf_counters();
+
+			if (!root())
+				return 0;
+
+			_stats = fopen((_output / "stats.csv").string().c_str(), "w");
+			if (_stats == nullptr)
+			{
+				std::cerr << "Can't create " << (_output / "stats.csv").string() << std::endl;
+				return 1;
+			}
+			fprintf(_stats, "iteration,wall_seconds,iterations_per_second,clocks_per_iter,clocks_per_iter_per_voxel,gvoxels_per_second,mean_imbalance,grid_efficiency,reductions_iteration,energy,max_abs_location,huge_page_fraction\n");
+
+			if (_config.reductions_every() != 0)
+			{
+				_planes = fopen((_output / "plane_rms.csv").string().c_str(), "w");
+				if (_planes == nullptr)
+				{
+					std::cerr << "Can't create " << (_output / "plane_rms.csv").string() << std::endl;
+					return 1;
+				}
+
+				fprintf(_planes, "iteration");
+				for (int x = 0; x < _world->width(); ++x)
+					fprintf(_planes, ",x%d", x);
+				fprintf(_planes, "\n");
+			}
+
+			_profile = fopen((_output / "profile.csv").string().c_str(), "w");
+			if (_profile == nullptr)
+			{
+				std::cerr << "Can't create " << (_output / "profile.csv").string() << std::endl;
+				return 1;
+			}
+			fprintf(_profile, "iteration,phase,count,p50_ns,p99_ns,max_ns,mean_ns\n");
+
+			if (_config.perf_counters())
+			{
+				_perf = fopen((_output / "perf.csv").string().c_str(), "w");
+				if (_perf == nullptr)
+				{
+					std::cerr << "Can't create " << (_output / "perf.csv").string() << std::endl;
+					return 1;
+				}
+				fprintf(_perf, "iteration,ipc,l1d_misses_per_voxel,llc_misses_per_voxel,dram_bytes_per_voxel,packed_fp_fraction\n");
+			}
+
+			if (_config.slice_every() != 0)
+				_sliceLogger = std::make_unique<PngLogger>((_output / "slices").string());
+
+			return 0;
+		}
+
+		// a multiple of every in (previous, iteration]
+		static bool reached(uint64_t previous, uint64_t iteration, uint64_t every) noexcept
+		{
+			return iteration / every != previous / every;
+		}
+
+		void startScheduledExposures()
+		{
+			const uint64_t iteration = _world->current_iteration();
+
+			for (const auto& exposure : _config.exposures())
+			{
+				if (exposure.start < _exposures_from || exposure.start > iteration)
+					continue;
+
+				if (_world->taking_picture() && root())
+					std::cerr << "Warning: exposure at " << iteration << " overrides the one still in progress" << std::endl;
+
+				const auto folder = (_output / ("exposure_" + std::to_string(exposure.start))).string();
+				out() << "Exposure started at " << iteration << " for " << exposure.length << " iterations -> " << folder << std::endl;
+
+				_world->start_taking_picture(folder, exposure.length);
+			}
+
+			_exposures_from = iteration + 1;
+		}
+
+		// every scheduled exposure has started and the last one is saved - there's nothing left to wait for
+		bool exposuresDone() const noexcept
+		{
+			if (_config.exposures().empty() || _world->taking_picture())
+				return false;
+
+			for (const auto& exposure : _config.exposures())
+			{
+				if (exposure.start >= _exposures_from)
+					return false;
+			}
+			return true;
+		}
+
+		void saveSlice()
+		{
+			ScopedTimer t{ _profiler, _phase_save_slice };
+
+			_world->render_slice(_slice); // collective, on every rank
+			if (!_sliceLogger)
+				return;
+
+			_sliceLogger->onRenderedFrame(
+				reinterpret_cast<const unsigned char*>(_slice.data()),
+				_world->width(),
+				_world->height());
+		}
+
+		void writeStats(uint64_t iteration, clock::time_point now, clock::time_point since, uint64_t since_iteration)
+		{
+			if (!root())
+				return;
+
+			const double wall = std::chrono::duration<double>(now - _start).count();
+			const double interval = std::chrono::duration<double>(now - since).count();
+			const double iters = static_cast<double>(iteration - since_iteration);
+
+			const double ips = interval > 0.0 ? iters / interval : 0.0;
+			const double voxels = static_cast<double>(_world->width()) * _world->height() * _world->depth();
+
+			auto [pp, ppv] = _world->get_clocks_per_iter();
+			const auto grid = _world->grid_stats();
+			const auto& field = _world->reductions();
+			const auto pages = PageAllocator::report();
+
+			fprintf(_stats, "%llu,%.3f,%.3f,%llu,%llu,%.3f,%.3f,%.3f,%llu,%.6g,%.6g,%.4f\n",
+				static_cast<unsigned long long>(iteration), wall, ips,
+				static_cast<unsigned long long>(pp), static_cast<unsigned long long>(ppv),
+				ips * voxels / 1e9, grid.meanImbalance, grid.efficiency,
+				static_cast<unsigned long long>(field.iteration), field.energy, static_cast<double>(field.max_abs_location), pages.fraction());
+			fflush(_stats);
+
+			std::cout << "iter: " << iteration << " " << ips << " iter/s " << (ips * voxels / 1e9) << " Gvoxel/s" << std::endl;
+
+			writeProfile(iteration);
+			writePerf(iteration);
+			writePlanes();
+		}
+
+		void writePlanes()
+		{
+			const auto& field = _world->reductions();
+			if (_planes == nullptr || field.plane_sq_location.empty())
+				return;
+
+			fprintf(_planes, "%llu", static_cast<unsigned long long>(field.iteration));
+			for (int x = 0; x < static_cast<int>(field.plane_sq_location.size()); ++x)
+				fprintf(_planes, ",%.6g", field.plane_rms(x));
+			fprintf(_planes, "\n");
+			fflush(_planes);
+		}
+
+		void writePerf(uint64_t iteration)
+		{
+			if (_perf == nullptr)
+				return;
+
+			const auto perf = _world->perf_report();
+			if (!perf.available)
+				return;
+
+			fprintf(_perf, "%llu,%.3f,%.4f,%.4f,%.3f,%.3f\n",
+				static_cast<unsigned long long>(iteration), perf.ipc, perf.l1d_misses_per_voxel,
+				perf.llc_misses_per_voxel, perf.dram_bytes_per_voxel, perf.packed_fp_fraction);
+			fflush(_perf);
+		}
+
+		void printPerf()
+		{
+			if (!_config.perf_counters() || !root())
+				return;
+
+			const auto perf = _world->perf_report();
+			if (!perf.available)
+			{
+				const auto error = _world->grid_stats().perfError;
+				std::cout << "perf: counters unavailable" << (error.empty() ? "" : ", ") << error << std::endl;
+				return;
+			}
+
+			std::cout << "perf: ipc " << perf.ipc
+				<< ", l1d misses/voxel " << perf.l1d_misses_per_voxel
+				<< ", llc misses/voxel " << perf.llc_misses_per_voxel
+				<< ", dram bytes/voxel " << perf.dram_bytes_per_voxel;
+			if (perf.packed_fp_fraction >= 0)
+				std::cout << ", packed fp " << perf.packed_fp_fraction * 100.0 << "%";
+			std::cout << std::endl;
+		}
+
+		void printGridStats()
+		{
+			if (!root())
+				return;
+
+			const auto grid = _world->grid_stats();
+
+			std::cout << "grid: " << grid.runs << " runs, imbalance mean " << grid.meanImbalance
+				<< " max " << grid.maxImbalance << ", efficiency " << grid.efficiency * 100.0 << "%" << std::endl;
+
+			for (size_t i = 0; i < grid.workers.size(); ++i)
+			{
+				const auto& w = grid.workers[i];
+				std::cout << "  thread " << i
+					<< ": compute " << w.computeNs / 1e6 << "ms"
+					<< ", task wait " << w.taskWaitNs / 1e6 << "ms"
+					<< ", barrier wait " << w.barrierWaitNs / 1e6 << "ms"
+					<< ", slowest run " << w.maxComputeNs / 1e6 << "ms" << std::endl;
+			}
+		}
+
+		void writeProfile(uint64_t iteration)
+		{
+			for (const Profiler* profiler : { &_world->profiler(), &_profiler })
+			{
+				for (const auto& p : profiler->phases())
+				{
+					fprintf(_profile, "%llu,%s,%llu,%llu,%llu,%llu,%llu\n",
+						static_cast<unsigned long long>(iteration), p.name.c_str(),
+						static_cast<unsigned long long>(p.count),
+						static_cast<unsigned long long>(p.p50_ns), static_cast<unsigned long long>(p.p99_ns),
+						static_cast<unsigned long long>(p.max_ns), static_cast<unsigned long long>(p.mean_ns));
+				}
+			}
+			fflush(_profile);
+		}
+	};
+}
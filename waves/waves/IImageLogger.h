@@ -9,4 +9,10 @@ public:
 
 	virtual void onViewportResize(int widht, int height) = 0;
 	virtual void onNewFrame() = 0;
+
+	// A frame produced without GL (e.g. by SliceRenderer), RGBA, rows are bottom-up like glReadPixels
+	virtual void onRenderedFrame(const unsigned char* rgba, int width, int height) = 0;
+
+	// Recording stopped: flush whatever is buffered, the next frame starts a new file
+	virtual void stop() {}
 };
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Medium.h"
+#include "PerfCounters.h"
+#include "Profiler.h"
+#include "StencilKernel.h"
+#include "ThreadGrid.h"
+
+namespace waves
+{
+	//
+	// A world of any size, as the UI and the headless runner see it - see BasicWorld for the details
+	// and make_world() for how the size picks the implementation, OutOfCoreWorld for the fields kept in files.
+	//
+	class IWorld
+	{
+	public:
+		virtual ~IWorld() {}
+
+		virtual bool initialized() const noexcept = 0;
+		virtual bool initialize(const std::string& pattern_file_name) = 0;
+
+		// one step - or several, an OutOfCoreWorld advances by whole passes
+		virtual bool iterate() noexcept = 0;
+		virtual uint64_t current_iteration() const noexcept = 0;
+
+		virtual void start_taking_picture(const std::string& folder, uint64_t exposition) = 0;
+		virtual bool taking_picture() const noexcept = 0;
+
+		// with a tolerance > 0 an exposure ends as soon as its picture has converged, see ExposureConvergence
+		virtual void set_exposure_tolerance(double tolerance) noexcept = 0;
+
+		virtual int num_threads() const noexcept = 0;
+
+		virtual bool set_kernel(const std::string& name) = 0;
+		virtual const char* kernel_name() const noexcept = 0;
+
+		// the VEL_FACTOR2 material at half the rate, see StencilKernel::run_multirate; false if the world can't
+		virtual bool set_multirate(bool on) = 0;
+
+		virtual void set_reductions_every(uint64_t n) noexcept = 0;
+		virtual const FieldReductions& reductions() const noexcept = 0;
+
+		virtual ThreadGridStats grid_stats() = 0;
+		virtual void enable_perf_counters() noexcept = 0;
+		virtual PerfCounterReport perf_report() = 0;
+
+		virtual Profiler& profiler() noexcept = 0;
+
+		virtual MediumSize size() const noexcept = 0;
+
+		int width() const noexcept { return size().width; }
+		int height() const noexcept { return size().height; }
+		int depth() const noexcept { return size().depth; }
+
+		// rgba must hold width() * height() pixels
+		virtual void render_slice(uint32_t* rgba, int z) noexcept = 0;
+
+		void render_slice(std::vector<uint32_t>& rgba, int z) noexcept
+		{
+			rgba.resize(static_cast<size_t>(width()) * height());
+			render_slice(rgba.data(), z);
+		}
+
+		void render_slice(std::vector<uint32_t>& rgba) noexcept
+		{
+			render_slice(rgba, depth() / 2);
+		}
+
+		virtual const std::tuple<uint64_t, uint64_t> get_clocks_per_iter() = 0;
+	};
+}
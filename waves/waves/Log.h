@@ -2,12 +2,13 @@
 
 #include <cstdio>
 #include <chrono>
+#include <atomic>		// std::atomic_uint32_t, MSVC gets it through <chrono>, gcc doesn't
 
 class logger
 {
 	static inline FILE* _logfile{ nullptr };
 
-	static inline std::chrono::steady_clock::time_point _start_time;
+	static inline std::chrono::high_resolution_clock::time_point _start_time;
 
 	static inline std::atomic_uint32_t _spin_lock{ 0 };
 
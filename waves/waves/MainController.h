@@ -7,6 +7,8 @@
 #include <atomic>
 #include <mutex>
 #include <chrono>
+#include <sstream>
+#include <iomanip>
 
 #include <Commdlg.h>
 #include <Windows.h> // file dialogs 
@@ -16,8 +18,13 @@
 #include "World.h"
 #include "WorldView.h"
 #include "RuntimeConfig.h"
+#include "TripleBuffer.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "PageAllocator.h"
 #include "IImageLogger.h"
 #include "PngLogger.h"
+#include "Y4mLogger.h"
 
 namespace waves
 {
@@ -56,20 +63,36 @@ namespace waves
     class MainController : public IMainController
     {
 	public:
-		using TWorld = World;
 		using TWorldView = WorldView;
 
 	private:
 		runtime_config& config;
 
-        TWorld world;
+        std::unique_ptr<IWorld> world;
         std::mutex worldLock;
         TWorldView _worldView;
 
 
 		WorldViewDetails viewDetails;
 
+		// simulation thread publishes, UI thread consumes, neither waits for the other
+		TripleBuffer<WorldViewSnapshot> _snapshots;
+
 		std::unique_ptr<IImageLogger> _imageLogger;
+		std::vector<uint32_t> _recordedFrame;
+
+		Profiler _profiler;
+		const size_t _phase_lock_wait{ _profiler.add_phase("world_lock_wait") };
+		const size_t _phase_publish{ _profiler.add_phase("publish_snapshot") };
+		const size_t _phase_record{ _profiler.add_phase("record_frame") };
+		const size_t _phase_draw{ _profiler.add_phase("draw") };
+		const size_t _counter_snapshots{ _profiler.add_counter("snapshots") };
+		const size_t _counter_frames{ _profiler.add_counter("frames_drawn") };
+
+		// PageAllocator::report() reads smaps, so it's only refreshed every HUGE_PAGES_REFRESH iterations
+		static constexpr uint64_t HUGE_PAGES_REFRESH = 1000;
+		std::string _hugePages;
+		uint64_t _hugePagesAt{ 0 };
 
 		//int iterationPerSeconds{ 0 };
 		//long currentStep{ 0 };
@@ -96,9 +119,37 @@ namespace waves
         MainController(runtime_config& cfg)
             : config(cfg)
 			, viewDetails { 1, true }
-			, world{ }
-			, _worldView{ world }
+			, world{ createWorld(cfg) }
+        {
+			if (config.perf_counters())
+				world->enable_perf_counters();
+
+			world->set_reductions_every(config.reductions_every());
+			world->set_exposure_tolerance(config.exposure_tolerance());
+
+			if (!world->set_kernel(config.kernel()))
+				::MessageBox(NULL, L"Unknown --kernel, using the reference one", L"waves", MB_OK);
+
+			if (!world->set_multirate(config.multirate()))
+				::MessageBox(NULL, L"--multirate doesn't combine with the PML boundary, stepping at the full rate", L"waves", MB_OK);
+
+			if (!config.trace_file().empty() && Tracer::compiled_in())
+				Tracer::instance().start();
+			WAVES_TRACE_THREAD_NAME("ui");
+        }
+
+        // the configured size, or the default one if the scene doesn't fit into it
+        static std::unique_ptr<IWorld> createWorld(const runtime_config& cfg)
         {
+			PageAllocator::set_mode(cfg.huge_page_mode());
+
+			auto ret = make_world(cfg.medium_size(), cfg.threads(), {}, nullptr, cfg.boundary());
+			if (!ret)
+			{
+				::MessageBox(NULL, L"The scene doesn't fit into --size, using the default size", L"waves", MB_OK);
+				ret = make_world(DEFAULT_MEDIUM_SIZE, cfg.threads(), {}, nullptr, cfg.boundary());
+			}
+			return ret;
         }
 
         ~MainController()
@@ -106,6 +157,12 @@ namespace waves
             terminate = true;
             if (calcThread.joinable())
                 calcThread.join();
+
+			if (Tracer::instance().enabled())
+			{
+				Tracer::instance().stop();
+				Tracer::instance().write_chrome_json(config.trace_file());
+			}
         }
 
         void Start() override
@@ -120,6 +177,8 @@ namespace waves
 
         void CalcThread()
         {
+			WAVES_TRACE_THREAD_NAME("calc");
+
             auto lastUIUpdate = std::chrono::high_resolution_clock::now();
 			int64_t last_update_at{ 0 };
 
@@ -132,18 +191,13 @@ namespace waves
             {
 				while (appPaused && !terminate)
 				{
+					WAVES_TRACE_SCOPE("paused");
 					::Sleep(100);
-					uiNeedsUpdate = true;
-					::SendMessage(hWND, WM_USER, 0, 0);
-					while (uiNeedsUpdate && !terminate)
-					{
-						// Keep yeild-ing the thread while UI thread is doing the painting job, 
-						// this is to avoid the white lock situation
-						std::this_thread::yield();
-					}
+					std::lock_guard<std::mutex> l(worldLock);
+					publishSnapshot();
 				}
 
-				if (!appPaused && !world.initialized())
+				if (!appPaused && !world->initialized())
 				{
 					initializeWorld();
 				}
@@ -151,32 +205,28 @@ namespace waves
 				auto now = std::chrono::high_resolution_clock::now();
 				std::chrono::duration<double> sinceLastUpdate = std::chrono::duration_cast<std::chrono::duration<double>>(now - lastUIUpdate);
 
-				if (sinceLastUpdate.count() > 1.0 / 30 || recording)
+				if (sinceLastUpdate.count() > 1.0 / 30)
 				{						
 					lastUIUpdate = now;
-					last_update_at = world.current_iteration();
-
-					auto [pp, ppv] = world.get_clocks_per_iter();
-					viewDetails.clocks_per_iter = pp;
-					viewDetails.clocks_per_iter_per_voxel = ppv;
-					viewDetails.iteration = world.current_iteration();
+					last_update_at = world->current_iteration();
 
-					uiNeedsUpdate = true;
-					::SendMessage(hWND, WM_USER, 0, 0);
-					while (uiNeedsUpdate && !terminate)
-					{
-						// Keep yeild-ing the thread while UI thread is doing the painting job, 
-						// this is to avoid the white lock situation
-						std::this_thread::yield();
-					}
+					std::lock_guard<std::mutex> l(worldLock);
+					publishSnapshot();
 				}
 
+				const auto lock_requested = Profiler::clock::now();
                 std::lock_guard<std::mutex> l(worldLock);
+				_profiler.record(_phase_lock_wait, lock_requested, Profiler::clock::now());
                 
-				if (!world.iterate())
+				if (!world->iterate())
 				{
 					terminate = true;
 				}
+
+				if (recording)
+				{
+					recordFrame();
+				}
             }
         }
 
@@ -184,8 +234,101 @@ namespace waves
 		{
 			_vpWidth = width;
 			_vpHeight = height;
-			if (_imageLogger)
-				_imageLogger->onViewportResize(width, height);
+		}
+
+		// Runs on the calc thread: captures the slice and stats, hands them over to the UI without waiting for it
+		void publishSnapshot()
+		{
+			ScopedTimer t{ _profiler, _phase_publish };
+
+			auto& snapshot = _snapshots.back();
+
+			world->render_slice(snapshot.slice);
+			snapshot.width = world->width();
+			snapshot.height = world->height();
+
+			auto [pp, ppv] = world->get_clocks_per_iter();
+			snapshot.clocks_per_iter = pp;
+			snapshot.clocks_per_iter_per_voxel = ppv;
+			snapshot.iteration = world->current_iteration();
+
+			snapshot.profile.clear();
+			for (const Profiler* profiler : { &world->profiler(), &_profiler })
+			{
+				std::ostringstream out;
+				profiler->print(out);
+
+				std::istringstream in{ out.str() };
+				for (std::string line; std::getline(in, line); )
+					snapshot.profile.push_back(line);
+			}
+
+			const auto& field = world->reductions();
+			if (config.reductions_every() != 0 && !field.plane_sq_location.empty())
+			{
+				int peak = 0;
+				for (int x = 1; x < static_cast<int>(field.plane_sq_location.size()); ++x)
+				{
+					if (field.plane_sq_location[x] > field.plane_sq_location[peak])
+						peak = x;
+				}
+
+				std::ostringstream fl;
+				fl << std::setprecision(4) << "field @" << field.iteration << ": energy=" << field.energy
+					<< " max|x|=" << field.max_abs_location << " peak rms=" << field.plane_rms(peak) << " at x=" << peak;
+				snapshot.profile.push_back(fl.str());
+			}
+
+			if (_hugePages.empty() || snapshot.iteration >= _hugePagesAt + HUGE_PAGES_REFRESH)
+			{
+				std::ostringstream hl;
+				PageAllocator::report().print(hl);
+				_hugePages = hl.str();
+				_hugePagesAt = snapshot.iteration;
+			}
+			snapshot.profile.push_back(_hugePages);
+
+			const auto grid = world->grid_stats();
+			std::ostringstream gl;
+			gl << std::fixed << std::setprecision(2) << "grid: imbalance mean=" << grid.meanImbalance
+				<< " max=" << grid.maxImbalance << " efficiency=" << std::setprecision(1) << grid.efficiency * 100.0 << "%";
+			snapshot.profile.push_back(gl.str());
+
+			if (config.perf_counters())
+			{
+				const auto perf = world->perf_report();
+
+				std::ostringstream pl;
+				if (perf.available)
+				{
+					pl << std::setprecision(3) << "perf: ipc=" << perf.ipc << " l1d/voxel=" << perf.l1d_misses_per_voxel
+						<< " llc/voxel=" << perf.llc_misses_per_voxel << " dram B/voxel=" << perf.dram_bytes_per_voxel;
+				}
+				else
+				{
+					pl << "perf: " << (grid.perfError.empty() ? "no samples yet" : grid.perfError);
+				}
+				snapshot.profile.push_back(pl.str());
+			}
+
+			_snapshots.publish();
+			_profiler.count(_counter_snapshots);
+
+			uiNeedsUpdate = true;
+			::PostMessage(hWND, WM_USER, 0, 0);
+		}
+
+		// Frames are rendered straight from the medium on the CPU, no GL read back involved
+		void recordFrame()
+		{
+			ScopedTimer t{ _profiler, _phase_record };
+
+			world->render_slice(_recordedFrame);
+
+			_imageLogger->onRenderedFrame(
+				reinterpret_cast<const unsigned char*>(_recordedFrame.data()),
+				world->width(),
+				world->height());
 		}
 
 		void initializeWorld()
@@ -210,16 +353,19 @@ namespace waves
 				if (nc > 0 && nc < MAX_PATH * 4)
 				{
 					std::string fileName{ mbsFile };
-					world.initialize(fileName);
+					if (!world->initialize(fileName))
+					{
+						::MessageBox(NULL, L"Can't use the pattern! Expected 240x240 png", L"Re-think what you are doing! :)", MB_OK);
+					}
 				}
 				else 
 				{
-					world.initialize("");
+					world->initialize("");
 				}
 			}
 			else
 			{
-				world.initialize("");
+				world->initialize("");
 			}
 		}
 
@@ -248,7 +394,7 @@ namespace waves
 
 			std::lock_guard<std::mutex> l(worldLock);
 
-			world.start_taking_picture(mbsFolder, 128);
+			world->start_taking_picture(mbsFolder, 128);
 		}
 
 		void onToggleScreenRecording()
@@ -273,13 +419,35 @@ namespace waves
 					size_t nc = ::wcstombs(mbsFolder, file, MAX_PATH * 4 - 1);
 					if (nc > 0 && nc < MAX_PATH * 4)
 					{
-						_imageLogger = std::make_unique<PngLogger>(mbsFolder);
-						_imageLogger->onViewportResize(_vpWidth, _vpHeight);
+						_imageLogger = makeImageLogger(mbsFolder);
 					}
 				}
 			}
 
-			recording = !recording && _imageLogger;
+			if (recording)
+			{
+				recording = false;
+
+				// the calc thread records under the world lock, so the stream is idle here
+				std::lock_guard<std::mutex> l(worldLock);
+				_imageLogger->stop();
+				return;
+			}
+
+			recording = _imageLogger != nullptr;
+		}
+
+		std::unique_ptr<IImageLogger> makeImageLogger(const std::string& folder)
+		{
+			switch (config.recording_format())
+			{
+			case record_format::png:
+				return std::make_unique<PngLogger>(folder);
+			case record_format::delta_rle:
+				return std::make_unique<Y4mLogger>(folder, Y4mLogger::Format::DeltaRle);
+			default:
+				return std::make_unique<Y4mLogger>(folder, Y4mLogger::Format::Y4m);
+			}
 		}
 
 		void OnKeyboard(WPARAM wParam) override
@@ -343,15 +511,15 @@ namespace waves
 
         void DrawWorld() override
         {
-            std::lock_guard<std::mutex> l(worldLock);
-			viewDetails.paused = appPaused;
-            _worldView.UpdateFrom(world, viewDetails, recording);
+            // no world lock here - the view only ever sees the latest published snapshot
+			ScopedTimer t{ _profiler, _phase_draw };
+			_profiler.count(_counter_frames);
+
             uiNeedsUpdate = false;
+            _snapshots.consume();
 
-			if (_imageLogger && recording && !appPaused)
-			{
-				_imageLogger->onNewFrame();
-			}
+			viewDetails.paused = appPaused;
+            _worldView.UpdateFrom(_snapshots.front(), viewDetails, recording);
         }
 
         bool IsUINeedsUpdate() const override { return uiNeedsUpdate; }
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace waves
+{
+	//
+	// A scratch file mapped read/write as a whole, zero filled on creation and deleted when done with.
+	// It's the backing store of OutOfCoreWorld: the page cache does the actual I/O, will_need() and
+	// done_with() only tell the kernel which part is coming next and which part can go, so the resident
+	// size stays bounded by what the caller keeps touching. Throws std::runtime_error if it can't be created.
+	//
+	class MappedFile
+	{
+		std::string _path;
+		char* _data{ nullptr };
+		size_t _bytes{ 0 };
+
+#if defined(_WIN32)
+		HANDLE _file{ INVALID_HANDLE_VALUE };
+		HANDLE _mapping{ nullptr };
+#else
+		static constexpr size_t PAGE = 4096;
+#endif
+
+		void close() noexcept
+		{
+#if defined(_WIN32)
+			if (_data != nullptr)
+				::UnmapViewOfFile(_data);
+			if (_mapping != nullptr)
+				::CloseHandle(_mapping);
+			if (_file != INVALID_HANDLE_VALUE)
+				::CloseHandle(_file);
+			_mapping = nullptr;
+			_file = INVALID_HANDLE_VALUE;
+#else
+			if (_data != nullptr)
+				::munmap(_data, _bytes);
+#endif
+			if (!_path.empty())
+				std::remove(_path.c_str());
+
+			_data = nullptr;
+			_path.clear();
+		}
+
+	public:
+		MappedFile(const std::string& path, size_t bytes)
+			: _path{ path }
+			, _bytes{ bytes }
+		{
+#if defined(_WIN32)
+			_file = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (_file == INVALID_HANDLE_VALUE)
+				throw std::runtime_error("Can't create " + path);
+
+			LARGE_INTEGER size;
+			size.QuadPart = static_cast<LONGLONG>(bytes);
+			_mapping = ::CreateFileMappingA(_file, nullptr, PAGE_READWRITE, size.HighPart, size.LowPart, nullptr);
+			if (_mapping != nullptr)
+				_data = static_cast<char*>(::MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes));
+
+			if (_data == nullptr)
+			{
+				close();
+				throw std::runtime_error("Can't map " + path + ", " + std::to_string(bytes) + " bytes");
+			}
+#else
+			const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+			if (fd < 0)
+				throw std::runtime_error("Can't create " + path + ": " + strerror(errno));
+
+			void* p = MAP_FAILED;
+			std::string error;
+			if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+				error = std::string{ "can't extend to " } + std::to_string(bytes) + " bytes: " + strerror(errno);
+			else if ((p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+				error = std::string{ "can't map: " } + strerror(errno);
+
+			::close(fd); // the mapping keeps the file open
+
+			if (p == MAP_FAILED)
+			{
+				std::remove(path.c_str());
+				throw std::runtime_error(path + ": " + error);
+			}
+
+			_data = static_cast<char*>(p);
+#endif
+		}
+
+		MappedFile(MappedFile&& other) noexcept
+			: _path{ std::move(other._path) }
+			, _data{ std::exchange(other._data, nullptr) }
+			, _bytes{ other._bytes }
+#if defined(_WIN32)
+			, _file{ std::exchange(other._file, INVALID_HANDLE_VALUE) }
+			, _mapping{ std::exchange(other._mapping, nullptr) }
+#endif
+		{
+			other._path.clear();
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		MappedFile& operator=(MappedFile&&) = delete;
+
+		~MappedFile()
+		{
+			close();
+		}
+
+		char* data() noexcept { return _data; }
+		const char* data() const noexcept { return _data; }
+		size_t size() const noexcept { return _bytes; }
+		const std::string& path() const noexcept { return _path; }
+
+		// Starts reading the range in, without waiting for it
+		void will_need(size_t offset, size_t bytes) noexcept
+		{
+#if defined(_WIN32)
+			WIN32_MEMORY_RANGE_ENTRY range{ _data + offset, bytes };
+			::PrefetchVirtualMemory(::GetCurrentProcess(), 1, &range, 0);
+#else
+			const size_t from = offset / PAGE * PAGE;
+			::madvise(_data + from, offset + bytes - from, MADV_WILLNEED);
+#endif
+		}
+
+		// Starts writing the range back and drops it from the process, the next access faults it in again.
+		// On Windows the working set is trimmed by the system, only the write-back is started there.
+		void done_with(size_t offset, size_t bytes) noexcept
+		{
+#if defined(_WIN32)
+			::FlushViewOfFile(_data + offset, bytes);
+#else
+			const size_t from = offset / PAGE * PAGE;
+			::msync(_data + from, offset + bytes - from, MS_ASYNC);
+			::madvise(_data + from, offset + bytes - from, MADV_DONTNEED);
+#endif
+		}
+	};
+}
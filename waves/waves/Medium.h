@@ -1,6 +1,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
+
+#include "Allocators.h"
 
 namespace waves
 {
@@ -17,6 +21,106 @@ namespace waves
 	};
 	static_assert(sizeof(ItemStatic) == 1);
 
+	struct MediumSize
+	{
+		int width;
+		int height;
+		int depth;
+
+		bool operator==(const MediumSize&) const = default;
+	};
+
+	//
+	// Where the items of a medium go in memory. A stencil step streams seven loads (x, x +- 1, y +- 1,
+	// z +- 1) from one medium and a store into another at the same offset. Addresses a multiple of 4 KiB
+	// apart share their L1 set, and a load after a store with the same low 12 address bits waits for
+	// it (4K aliasing) - which is what power-of-two sizes and page aligned allocations give by default.
+	//
+	// The padded layout therefore
+	//  - pads rows and planes to whole cache lines, clear of 4 KiB multiples,
+	//  - starts every allocation at its own colour, COLOUR_STEP bytes past the previous one modulo a page,
+	//    and keeps the strides clear of +-COLOUR_STEP as well, for the current/next pair,
+	//  - puts voxel x = 0 of every row on a cache line boundary (for Item).
+	//
+	// Strides are counted in items, but laid out for sizeof(Item), so all the rebinds of a medium share
+	// their offsets - which also means they have to be constructed with the same padding. Wider items,
+	// whole cache lines (EnsembleItem), stay line aligned, the strides' distance from 4 KiB multiples is
+	// only worked out for Item.
+	//
+	struct MediumLayout
+	{
+		enum class padding
+		{
+			dense,		// as allocated before: rows and planes back to back, page aligned
+			padded
+		};
+
+		static constexpr int64_t LINE_BYTES = 64;
+		static constexpr int64_t PAGE_BYTES = 4096;
+		static constexpr int64_t MIN_PAGE_DISTANCE = 4 * LINE_BYTES;
+		static constexpr int64_t COLOUR_STEP = 5 * LINE_BYTES;
+
+		static constexpr int64_t STRIDE_ITEM_BYTES = sizeof(Item);
+		static constexpr int LINE_ITEMS = static_cast<int>(LINE_BYTES / STRIDE_ITEM_BYTES);
+
+		static constexpr bool clear_of_pages(int64_t stride_items) noexcept
+		{
+			for (int64_t colour = -COLOUR_STEP; colour <= COLOUR_STEP; colour += COLOUR_STEP)
+			{
+				const int64_t in_page = (stride_items * STRIDE_ITEM_BYTES + colour + PAGE_BYTES) % PAGE_BYTES;
+				if (std::min(in_page, PAGE_BYTES - in_page) < MIN_PAGE_DISTANCE)
+					return false;
+			}
+			return true;
+		}
+
+		static constexpr int64_t pad(int64_t items, padding p) noexcept
+		{
+			if (p == padding::dense)
+				return items;
+
+			items = (items + LINE_ITEMS - 1) / LINE_ITEMS * LINE_ITEMS;
+			while (!clear_of_pages(items))
+				items += LINE_ITEMS;
+			return items;
+		}
+
+		static constexpr int row_stride(int alloc_width, padding p) noexcept
+		{
+			return static_cast<int>(pad(alloc_width, p));
+		}
+
+		static constexpr int plane_stride(int row_stride, int alloc_height, padding p) noexcept
+		{
+			return static_cast<int>(pad(static_cast<int64_t>(row_stride) * alloc_height, p));
+		}
+
+		// The offsets are ints: the padded medium of the size, guards included, has to stay within INT_MAX items
+		static constexpr bool offsets_fit(const MediumSize& size, int guard = 4) noexcept
+		{
+			const int64_t row = pad(static_cast<int64_t>(size.width) + 2 * guard, padding::padded);
+			const int64_t plane = pad(row * (static_cast<int64_t>(size.height) + 2 * guard), padding::padded);
+			return plane * (static_cast<int64_t>(size.depth) + 2 * guard) <= INT32_MAX;
+		}
+
+		// offset of the first item from the page boundary, a new colour with every call
+		template <typename TItem>
+		static size_t lead_bytes(int w_guard, padding p) noexcept
+		{
+			static_assert(LINE_BYTES % sizeof(TItem) == 0 || sizeof(TItem) % LINE_BYTES == 0);
+
+			if (p == padding::dense)
+				return 0;
+
+			static std::atomic<uint64_t> next_colour{ 0 };
+			const uint64_t colour = next_colour.fetch_add(1, std::memory_order_relaxed);
+
+			const size_t guard_bytes = (w_guard * sizeof(TItem)) % LINE_BYTES;
+			const size_t align_x0 = guard_bytes != 0 ? LINE_BYTES - guard_bytes : 0;
+			return static_cast<size_t>(colour * COLOUR_STEP % PAGE_BYTES) + align_x0;
+		}
+	};
+
 	template <int W, int H, int D, typename TItem=Item, int GUARD_SIZE = 4, bool skip_assert=false>
 	struct Medium
 	{
@@ -34,20 +138,49 @@ namespace waves
 		static constexpr int alloc_height = H + 2 * H_GUARD;
 		static constexpr int alloc_depth = D + 2 * D_GUARD;
 
-		std::vector<TItem> data;
+		static constexpr int row_stride = MediumLayout::row_stride(alloc_width, MediumLayout::padding::padded);
+		static constexpr int plane_stride = MediumLayout::plane_stride(row_stride, alloc_height, MediumLayout::padding::padded);
+
+		static constexpr bool is_fixed_size = true;
+
+		// same size, other item type
+		template <typename TOther>
+		using rebind = Medium<W, H, D, TOther, GUARD_SIZE, skip_assert>;
+
+		// a stack of PW planes of H x D with no guards, for the picture buffers
+		template <int PW, typename TOther>
+		using plane_stack = Medium<PW, H, D, TOther, 0, true>;
+
+		page_offset_buffer<TItem> data;
+
+		Medium() : Medium(size(), uninitialized)
+		{
+			fill(TItem{});
+		}
+
+		// for code written against both Medium and RuntimeMedium, the size must match
+		explicit Medium(const MediumSize&) : Medium()
+		{
+		}
 
-		Medium() : data(alloc_width * alloc_height * alloc_depth)
+		Medium(const MediumSize&, int) : Medium()
 		{
+		}
 
+		// the items are left unset, see StencilKernel::first_touch()
+		Medium(const MediumSize&, uninitialized_t)
+			: data(static_cast<size_t>(plane_stride) * alloc_depth, MediumLayout::lead_bytes<TItem>(W_GUARD, MediumLayout::padding::padded), uninitialized)
+		{
 		}
 
 		static constexpr int width() noexcept { return W; }
 		static constexpr int height() noexcept { return H; }
 		static constexpr int depth() noexcept { return D; }
+		static constexpr MediumSize size() noexcept { return { W, H, D }; }
 
 		constexpr static int offset_for(int x, int y, int z) noexcept
 		{
-			return (z + D_GUARD) * alloc_width * alloc_depth + (y + H_GUARD) * alloc_width + (x + W_GUARD);
+			return (z + D_GUARD) * plane_stride + (y + H_GUARD) * row_stride + (x + W_GUARD);
 			//return (x + W_GUARD)* alloc_width* alloc_depth + (y + H_GUARD) * alloc_depth + z + D_GUARD;
 		}
 
@@ -67,4 +200,95 @@ namespace waves
 		}
 	};
 
+	//
+	// Same layout as Medium, but the size is only known at run time. The kernels and the scene code are
+	// written against both, a Medium gets its strides folded into constants, this one pays for loading
+	// them - so the common sizes are instantiated as a Medium (see make_world) and this one takes the rest.
+	//
+	template <typename TItem = Item, int GUARD_SIZE = 4>
+	struct RuntimeMedium
+	{
+		static constexpr int W_GUARD = GUARD_SIZE;
+		static constexpr int H_GUARD = GUARD_SIZE;
+		static constexpr int D_GUARD = GUARD_SIZE;
+
+		static constexpr bool is_fixed_size = false;
+
+		template <typename TOther>
+		using rebind = RuntimeMedium<TOther, GUARD_SIZE>;
+
+		// the plane count is a run time value as well, see RuntimeMedium(const MediumSize&, int)
+		template <int PW, typename TOther>
+		using plane_stack = RuntimeMedium<TOther, 0>;
+
+	private:
+		int _width;
+		int _height;
+		int _depth;
+		MediumLayout::padding _padding;
+
+	public:
+		int alloc_width;
+		int alloc_height;
+		int alloc_depth;
+
+		int row_stride;
+		int plane_stride;
+
+		page_offset_buffer<TItem> data;
+
+		// the padding is only selectable here to measure what it buys, see waves_bench --layout
+		explicit RuntimeMedium(const MediumSize& size, MediumLayout::padding padding = MediumLayout::padding::padded)
+			: RuntimeMedium(size, uninitialized, padding)
+		{
+			fill(TItem{});
+		}
+
+		// the items are left unset, see StencilKernel::first_touch()
+		RuntimeMedium(const MediumSize& size, uninitialized_t, MediumLayout::padding padding = MediumLayout::padding::padded)
+			: _width{ size.width }
+			, _height{ size.height }
+			, _depth{ size.depth }
+			, _padding{ padding }
+			, alloc_width{ size.width + 2 * W_GUARD }
+			, alloc_height{ size.height + 2 * H_GUARD }
+			, alloc_depth{ size.depth + 2 * D_GUARD }
+			, row_stride{ MediumLayout::row_stride(alloc_width, padding) }
+			, plane_stride{ MediumLayout::plane_stride(row_stride, alloc_height, padding) }
+			, data(static_cast<size_t>(plane_stride) * alloc_depth, MediumLayout::lead_bytes<TItem>(W_GUARD, padding), uninitialized)
+		{
+		}
+
+		// planes x size.height x size.depth, matching plane_stack
+		RuntimeMedium(const MediumSize& size, int planes, MediumLayout::padding padding = MediumLayout::padding::padded)
+			: RuntimeMedium(MediumSize{ planes, size.height, size.depth }, padding)
+		{
+		}
+
+		int width() const noexcept { return _width; }
+		int height() const noexcept { return _height; }
+		int depth() const noexcept { return _depth; }
+		MediumSize size() const noexcept { return { _width, _height, _depth }; }
+		MediumLayout::padding padding() const noexcept { return _padding; }
+
+		int offset_for(int x, int y, int z) const noexcept
+		{
+			return (z + D_GUARD) * plane_stride + (y + H_GUARD) * row_stride + (x + W_GUARD);
+		}
+
+		const auto& at(int x, int y, int z) const
+		{
+			return data[offset_for(x, y, z)];
+		}
+
+		auto& at(int x, int y, int z)
+		{
+			return data[offset_for(x, y, z)];
+		}
+
+		void fill(TItem&& value)
+		{
+			std::fill(data.begin(), data.end(), value);
+		}
+	};
 }
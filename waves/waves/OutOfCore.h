@@ -0,0 +1,555 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "IWorld.h"
+#include "MappedFile.h"
+#include "World.h"
+
+namespace waves
+{
+	//
+	// The scene of BasicWorld for sizes whose fields don't fit in memory. The two fields and the statics
+	// live in MappedFiles in a scratch folder (local NVMe), every pass streams them through a window of
+	// z-planes and writes the result to the other field file.
+	//
+	// A pass advances steps_per_pass steps at once: the window of a slab of slab_planes planes is loaded
+	// with steps_per_pass halo planes on either side, every step leaves one more halo plane on either side
+	// out of date, and after the last one the slab's own planes are exactly what BasicWorld would have.
+	// The halos are recomputed by both neighbouring slabs - (slab_planes + 2 * steps_per_pass) / slab_planes
+	// times the voxel updates of the in-memory steps, for one read and one write of the fields per pass.
+	// The next window is read on a separate thread while the current one is computed.
+	//
+	// Resident: three windows (the computed one, its pair for the other half of the step, the one being read)
+	// and the pictures; the file pages are dropped from the process as soon as the pass is done with them.
+	//
+	// iterate() runs a whole pass, current_iteration() advances by steps_per_pass. Exposures start and end
+	// at pass boundaries. The reductions are of the state the pass's last step at a multiple of set_reductions_every()
+	// starts from, done by StencilKernel::reduce_slab() while its window is resident.
+	//
+	class OutOfCoreWorld : public IWorld
+	{
+	public:
+		using TScene = BasicWorld<RuntimeMedium<>>;
+
+		using TWindow = RuntimeMedium<Item>;
+		using TWindowStatic = TWindow::rebind<ItemStatic>;
+
+		using TSrcPictureMedium = TWindow::plane_stack<TScene::SRC_PICTURE_PLANES, float>;
+		using TPictureMedium = TWindow::plane_stack<TScene::PICTURE_PLANES, float>;
+
+		using TKernelVariant = StencilKernelVariant<TWindow, TWindowStatic>;
+
+		static constexpr int DEFAULT_SLAB_PLANES = 32;
+		static constexpr int DEFAULT_STEPS_PER_PASS = 4;
+
+		// only the windows and the pictures are mediums, the fields are addressed in size_t
+		static constexpr bool size_supported(const MediumSize& size, int slab_planes = DEFAULT_SLAB_PLANES, int steps_per_pass = DEFAULT_STEPS_PER_PASS) noexcept
+		{
+			return TScene::scene_fits(size)
+				&& MediumLayout::offsets_fit({ size.width, size.height, std::clamp(slab_planes, 1, size.depth) + 2 * std::max(1, steps_per_pass) })
+				&& MediumLayout::offsets_fit({ TScene::PICTURE_PLANES, size.height, size.depth });
+		}
+
+	private:
+		struct Window
+		{
+			TWindow items;
+			TWindowStatic statics;
+		};
+
+		const MediumSize _size;
+		const int _slab_planes;
+		const int _steps_per_pass;
+
+		ThreadGrid _grid;
+
+		// z, y, x without guards or padding
+		MappedFile _statics_file;
+		std::array<MappedFile, 2> _field_files;
+		int _current_file{ 0 };
+
+		std::array<Window, 2> _windows;	// computed, being read in
+		TWindow _pair;
+		TWindow _slice;					// one plane, for render_slice()
+
+		TScene::TMediumPatternStatic _pattern{};
+		bool _initialized{ false };
+
+		TSrcPictureMedium _src_picture;
+		TPictureMedium _picture;
+
+		uint64_t _iteration{ 0 };
+
+		uint64_t elapsed_cpu_clocks{ 0 };
+
+		TKernelVariant _kernel{ StencilKernel::variants<TWindow, TWindowStatic>().front() };
+
+		uint64_t _reductions_every{ 0 };
+		FieldReductions _reductions{};
+
+		Profiler _profiler;
+		const size_t _phase_fill{ _profiler.add_phase("fill") };
+		const size_t _phase_stencil{ _profiler.add_phase("stencil") };
+		const size_t _phase_exposure{ _profiler.add_phase("exposure") };
+		const size_t _phase_read_wait{ _profiler.add_phase("read_wait") };
+		const size_t _phase_write{ _profiler.add_phase("write") };
+		const size_t _phase_save_pictures{ _profiler.add_phase("save_pictures") };
+		const size_t _counter_iterations{ _profiler.add_counter("iterations") };
+		const size_t _counter_passes{ _profiler.add_counter("passes") };
+		const size_t _counter_bytes_read{ _profiler.add_counter("bytes_read") };
+		const size_t _counter_bytes_written{ _profiler.add_counter("bytes_written") };
+		const size_t _counter_pictures{ _profiler.add_counter("pictures") };
+
+		std::string _pictures_folder;
+		uint64_t _picture_exposing_until{ 0 };
+		ExposureConvergence _convergence;
+
+		static size_t voxels(const MediumSize& size) noexcept
+		{
+			return static_cast<size_t>(size.width) * size.height * size.depth;
+		}
+
+		static std::string file_in(const std::string& folder, const char* name)
+		{
+			return (std::filesystem::path(folder) / name).string();
+		}
+
+		MediumSize window_size() const noexcept
+		{
+			return { _size.width, _size.height, _slab_planes + 2 * _steps_per_pass };
+		}
+
+		size_t plane_bytes(size_t item_bytes) const noexcept
+		{
+			return static_cast<size_t>(_size.width) * _size.height * item_bytes;
+		}
+
+		// file plane z <-> plane wz of the medium
+		template <typename TMedium>
+		void read_plane(const MappedFile& file, int z, TMedium& medium, int wz) const noexcept
+		{
+			using TItem = std::remove_reference_t<decltype(medium.data[0])>;
+			const TItem* src = reinterpret_cast<const TItem*>(file.data()) + static_cast<size_t>(z) * _size.width * _size.height;
+
+			for (int y = 0; y < _size.height; ++y)
+				std::memcpy(&medium.data[medium.offset_for(0, y, wz)], src + static_cast<size_t>(y) * _size.width, _size.width * sizeof(TItem));
+		}
+
+		template <typename TMedium>
+		void write_plane(const TMedium& medium, int wz, MappedFile& file, int z) const noexcept
+		{
+			using TItem = std::remove_cv_t<std::remove_reference_t<decltype(medium.data[0])>>;
+			TItem* dst = reinterpret_cast<TItem*>(file.data()) + static_cast<size_t>(z) * _size.width * _size.height;
+
+			for (int y = 0; y < _size.height; ++y)
+				std::memcpy(dst + static_cast<size_t>(y) * _size.width, &medium.data[medium.offset_for(0, y, wz)], _size.width * sizeof(TItem));
+		}
+
+		template <typename TMedium>
+		void zero_plane(TMedium& medium, int wz) const noexcept
+		{
+			using TItem = std::remove_reference_t<decltype(medium.data[0])>;
+
+			for (int y = 0; y < _size.height; ++y)
+				std::fill_n(&medium.data[medium.offset_for(0, y, wz)], _size.width, TItem{});
+		}
+
+		// The planes z_begin.. of the field and the statics, zeros outside the scene like its guard planes.
+		// Runs on the reading thread.
+		void load_window(Window& window, MappedFile& field, int z_begin) noexcept
+		{
+			const int from = std::max(0, z_begin);
+			const int to = std::min(_size.depth, z_begin + window.items.depth());
+
+			if (from < to)
+			{
+				field.will_need(from * plane_bytes(sizeof(Item)), (to - from) * plane_bytes(sizeof(Item)));
+				_statics_file.will_need(from * plane_bytes(sizeof(ItemStatic)), (to - from) * plane_bytes(sizeof(ItemStatic)));
+			}
+
+			for (int wz = 0; wz < window.items.depth(); ++wz)
+			{
+				const int z = z_begin + wz;
+				if (z >= from && z < to)
+				{
+					read_plane(field, z, window.items, wz);
+					read_plane(_statics_file, z, window.statics, wz);
+				}
+				else
+				{
+					zero_plane(window.items, wz);
+					zero_plane(window.statics, wz);
+				}
+			}
+
+			_profiler.count(_counter_bytes_read, std::max(0, to - from) * plane_bytes(sizeof(Item) + sizeof(ItemStatic)));
+		}
+
+		// All the steps of the pass for one slab, the result ends up in window.items.
+		// The voxels the kernel skips (zero conductivity) keep what the window was loaded with in both halves.
+		// reduce_step - the step whose starting state gets reduced, -1 for none. Its planes next to the owned
+		// ones are still up to date then, the reduction reads them as neighbours.
+		void run_window(Window& window, int slab_start, int owned, uint64_t base, int reduce_step) noexcept
+		{
+			std::copy(window.items.data.begin(), window.items.data.end(), _pair.data.begin());
+
+			TWindow* current = &window.items;
+			TWindow* next = &_pair;
+
+			const int halo = _steps_per_pass;
+			const int z_base = slab_start - halo;
+
+			for (int step = 0; step < _steps_per_pass; ++step)
+			{
+				const uint64_t iteration = base + step;
+
+				{
+					ScopedTimer t{ _profiler, _phase_fill };
+					TScene::fill(*current, _pattern, _size, z_base, TScene::SOURCE_X, (iteration % 70) > 35);
+				}
+
+				if (step == reduce_step)
+				{
+					std::vector<FieldReductions> partials(_grid.NumThreads());
+					for (auto& partial : partials)
+						partial.reset(_size.width, _size.height * _size.depth);
+
+					_grid.GridRun(
+						[&](int thread_idx, int num_threads)
+						{
+							int from, to;
+							StencilKernel::slab_for(owned, thread_idx, num_threads, from, to);
+							StencilKernel::reduce_slab(*current, window.statics, halo + from, halo + to, partials[thread_idx]);
+						}
+						);
+
+					for (const auto& partial : partials)
+						_reductions.combine(partial);
+				}
+
+				{
+					ScopedTimer t{ _profiler, _phase_stencil };
+					ThreadGrid::StatsScope s{ _grid };
+					const uint64_t start = __rdtsc();
+					_kernel.run(*current, *next, window.statics, _grid);
+					elapsed_cpu_clocks += __rdtsc() - start;
+				}
+
+				if (_picture_exposing_until != 0 && iteration <= _picture_exposing_until)
+				{
+					ScopedTimer t{ _profiler, _phase_exposure };
+					expose(*current, halo, owned, slab_start);
+				}
+
+				std::swap(current, next);
+			}
+
+			if (current != &window.items)
+				std::swap(window.items, _pair);
+		}
+
+		void expose(const TWindow& current, int wz_from, int planes, int z_from) noexcept
+		{
+			for (int wz = wz_from, z = z_from; wz < wz_from + planes; ++wz, ++z)
+			{
+				for (int y = 0; y < _size.height; ++y)
+				{
+					for (int x = 0; x < _src_picture.width(); ++x)
+						_src_picture.at(x, y, z) += ::powf(current.at(x + TScene::PIC_SRC_BASE, y, wz).location, 2.0f);
+
+					for (int x = 0; x < _picture.width(); ++x)
+						_picture.at(x, y, z) += ::powf(current.at(x + TScene::PIC_BASE, y, wz).location, 2.0f);
+				}
+			}
+		}
+
+		void build_statics() noexcept
+		{
+			ItemStatic* statics = reinterpret_cast<ItemStatic*>(_statics_file.data());
+
+			_grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					StencilKernel::slab_for(_size.depth, thread_idx, num_threads, from, to);
+
+					for (int z = from; z < to; ++z)
+					{
+						ItemStatic* plane = statics + static_cast<size_t>(z) * _size.width * _size.height;
+						for (int y = 0; y < _size.height; ++y)
+						{
+							for (int x = 0; x < _size.width; ++x)
+								plane[static_cast<size_t>(y) * _size.width + x] = TScene::scene_voxel(_size, x, y, z);
+						}
+					}
+				}
+				);
+
+			_statics_file.done_with(0, _statics_file.size());
+		}
+
+	public:
+		// size must pass size_supported(), the folder must exist; throws std::runtime_error if the files can't be created
+		OutOfCoreWorld(const MediumSize& size, const std::string& folder, int slab_planes = DEFAULT_SLAB_PLANES,
+			int steps_per_pass = DEFAULT_STEPS_PER_PASS, int num_threads = TScene::DEFAULT_NUM_THREADS)
+			: _size{ size }
+			, _slab_planes{ std::clamp(slab_planes, 1, size.depth) }
+			, _steps_per_pass{ std::max(1, steps_per_pass) }
+			, _grid{ num_threads }
+			, _statics_file{ file_in(folder, "waves_statics.bin"), voxels(size) * sizeof(ItemStatic) }
+			, _field_files{ {
+				MappedFile{ file_in(folder, "waves_field_0.bin"), voxels(size) * sizeof(Item) },
+				MappedFile{ file_in(folder, "waves_field_1.bin"), voxels(size) * sizeof(Item) } } }
+			, _windows{ {
+				{ TWindow{ window_size(), uninitialized }, TWindowStatic{ window_size(), uninitialized } },
+				{ TWindow{ window_size(), uninitialized }, TWindowStatic{ window_size(), uninitialized } } } }
+			, _pair{ window_size(), uninitialized }
+			, _slice{ MediumSize{ size.width, size.height, 1 } }
+			, _src_picture{ size, TScene::SRC_PICTURE_PLANES }
+			, _picture{ size, TScene::PICTURE_PLANES }
+		{
+			for (auto& window : _windows)
+			{
+				StencilKernel::first_touch(window.items, _grid);
+				StencilKernel::first_touch(window.statics, _grid);
+			}
+			StencilKernel::first_touch(_pair, _grid);
+
+			build_statics();
+		}
+
+		bool initialized() const noexcept override
+		{
+			return _initialized;
+		}
+
+		bool initialize(const std::string& pattern_file_name) override
+		{
+			_initialized = true;
+			return TScene::load_pattern(_pattern, pattern_file_name);
+		}
+
+		// The exposure runs from the next pass on, with an empty folder it's only kept in memory
+		void start_taking_picture(const std::string& folder, uint64_t exposition) override
+		{
+			_picture.fill(0.0f);
+			_pictures_folder = folder;
+			_picture_exposing_until = _iteration + exposition + 1;
+			_convergence.start(exposition + 2, _picture);
+		}
+
+		bool taking_picture() const noexcept override
+		{
+			return _picture_exposing_until != 0;
+		}
+
+		void set_exposure_tolerance(double tolerance) noexcept override
+		{
+			_convergence.set_tolerance(tolerance);
+		}
+
+		int num_threads() const noexcept override
+		{
+			return _grid.NumThreads();
+		}
+
+		bool set_kernel(const std::string& name) override
+		{
+			for (const auto& variant : StencilKernel::variants<TWindow, TWindowStatic>())
+			{
+				if (name == variant.name)
+				{
+					_kernel = variant;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		const char* kernel_name() const noexcept override
+		{
+			return _kernel.name;
+		}
+
+		// the slab windows run several steps per pass at the full rate
+		bool set_multirate(bool on) override
+		{
+			return !on;
+		}
+
+		void set_reductions_every(uint64_t n) noexcept override
+		{
+			_reductions_every = n;
+		}
+
+		const FieldReductions& reductions() const noexcept override
+		{
+			return _reductions;
+		}
+
+		ThreadGridStats grid_stats() override
+		{
+			return _grid.Stats();
+		}
+
+		void enable_perf_counters() noexcept override
+		{
+			_grid.EnablePerfCounters();
+		}
+
+		PerfCounterReport perf_report() override
+		{
+			return PerfCounterReport::from(_grid.Stats().perf, static_cast<double>(voxels(_size)) * static_cast<double>(_iteration));
+		}
+
+		int slab_planes() const noexcept { return _slab_planes; }
+		int steps_per_pass() const noexcept { return _steps_per_pass; }
+
+		// One pass over all the slabs, steps_per_pass steps
+		bool iterate() noexcept override
+		{
+			const uint64_t base = _iteration;
+			const uint64_t end = base + _steps_per_pass;
+			const int halo = _steps_per_pass;
+
+			// the last step of the pass at a multiple of the reductions' period
+			const uint64_t reduce_at = _reductions_every != 0 ? (end - 1) / _reductions_every * _reductions_every : 0;
+			const bool reduce = _reductions_every != 0 && reduce_at >= base;
+			if (reduce)
+			{
+				_reductions.reset(_size.width, _size.height * _size.depth);
+				_reductions.iteration = reduce_at;
+			}
+
+			auto& input = _field_files[_current_file];
+			auto& output = _field_files[1 - _current_file];
+
+			int released = 0; // the input planes below are done with
+
+			auto reading = std::async(std::launch::async, [&] { load_window(_windows[1], input, -halo); });
+
+			for (int slab_start = 0; slab_start < _size.depth; slab_start += _slab_planes)
+			{
+				{
+					ScopedTimer t{ _profiler, _phase_read_wait };
+					reading.get();
+				}
+				std::swap(_windows[0], _windows[1]);
+
+				const int next_start = slab_start + _slab_planes;
+				if (next_start < _size.depth)
+					reading = std::async(std::launch::async, [&, next_start] { load_window(_windows[1], input, next_start - halo); });
+
+				const int owned = std::min(_slab_planes, _size.depth - slab_start);
+				run_window(_windows[0], slab_start, owned, base, reduce ? static_cast<int>(reduce_at - base) : -1);
+
+				{
+					ScopedTimer t{ _profiler, _phase_write };
+					for (int z = slab_start; z < slab_start + owned; ++z)
+						write_plane(_windows[0].items, z - slab_start + halo, output, z);
+					output.done_with(slab_start * plane_bytes(sizeof(Item)), owned * plane_bytes(sizeof(Item)));
+					_profiler.count(_counter_bytes_written, owned * plane_bytes(sizeof(Item)));
+				}
+
+				const int needed_from = std::min(_size.depth, next_start - halo);
+				if (needed_from > released)
+				{
+					input.done_with(released * plane_bytes(sizeof(Item)), (needed_from - released) * plane_bytes(sizeof(Item)));
+					_statics_file.done_with(released * plane_bytes(sizeof(ItemStatic)), (needed_from - released) * plane_bytes(sizeof(ItemStatic)));
+					released = needed_from;
+				}
+			}
+
+			_current_file = 1 - _current_file;
+
+			if (_picture_exposing_until != 0)
+			{
+				_convergence.add_frames(std::min(end, _picture_exposing_until + 1) - base);
+				if (_convergence.due() && _convergence.converged(_convergence.plane_sums(_picture)))
+				{
+					// the rest of the exposure would only repeat the same picture
+					_convergence.finish(_picture);
+					_convergence.finish(_src_picture);
+					_picture_exposing_until = end - 1;
+				}
+			}
+
+			if (_picture_exposing_until != 0 && _picture_exposing_until < end)
+			{
+				_picture_exposing_until = 0;
+
+				if (!_pictures_folder.empty())
+				{
+					ScopedTimer ts{ _profiler, _phase_save_pictures };
+					TScene::save_pictures(_picture, _pictures_folder, TScene::PIC_BASE);
+					TScene::save_pictures(_src_picture, _pictures_folder, TScene::PIC_SRC_BASE);
+					_profiler.count(_counter_pictures);
+				}
+			}
+
+			_iteration = end;
+			_profiler.count(_counter_iterations, _steps_per_pass);
+			_profiler.count(_counter_passes);
+			return true;
+		}
+
+		uint64_t current_iteration() const noexcept override
+		{
+			return _iteration;
+		}
+
+		// fill, stencil, exposure, read_wait (the compute waiting for the next window), write, save_pictures
+		Profiler& profiler() noexcept override
+		{
+			return _profiler;
+		}
+
+		MediumSize size() const noexcept override { return _size; }
+
+		const TPictureMedium& exposure() const noexcept { return _picture; }
+		const TSrcPictureMedium& source_exposure() const noexcept { return _src_picture; }
+
+		using IWorld::render_slice;
+
+		// Reads the plane back from the current field file
+		void render_slice(uint32_t* rgba, int z) noexcept override
+		{
+			auto& field = _field_files[_current_file];
+			read_plane(field, z, _slice, 0);
+			field.done_with(z * plane_bytes(sizeof(Item)), plane_bytes(sizeof(Item)));
+
+			SliceRenderer::render(_slice, 0, rgba, _grid);
+		}
+
+		const std::tuple<uint64_t, uint64_t> get_clocks_per_iter() override
+		{
+			if (_iteration == 0)
+				return { 0, 0 };
+
+			const uint64_t clocks_per_iter{ elapsed_cpu_clocks / _iteration };
+			const uint64_t clocks_per_iter_per_voxel{ clocks_per_iter / voxels(_size) };
+
+			return { clocks_per_iter, clocks_per_iter_per_voxel };
+		}
+	};
+	// nullptr if the scene doesn't fit, see BasicWorld::size_supported(); throws std::runtime_error if the files can't be created
+	inline std::unique_ptr<IWorld> make_out_of_core_world(const MediumSize& size, const std::string& folder, int slab_planes, int steps_per_pass, int num_threads)
+	{
+		if (!OutOfCoreWorld::size_supported(size, slab_planes, steps_per_pass))
+			return nullptr;
+
+		return std::make_unique<OutOfCoreWorld>(size, folder, slab_planes, steps_per_pass, num_threads);
+	}
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/mman.h>
+#else
+#include <xmmintrin.h>
+#endif
+
+namespace waves
+{
+	enum class huge_pages
+	{
+		off,			// 4 KiB pages, THP explicitly refused
+		transparent,	// 2 MiB aligned, madvise(MADV_HUGEPAGE) - the kernel backs what it can
+		hugetlb			// MAP_HUGETLB from the reserved pool, falls back to transparent if the pool is short
+	};
+
+	struct HugePageReport
+	{
+		huge_pages mode{ huge_pages::off };
+		uint64_t bytes{ 0 };			// live page allocations
+		uint64_t huge_bytes{ 0 };		// of those, backed by 2 MiB pages right now
+		bool fell_back{ false };		// a hugetlb request was served by THP
+		std::string error{};
+
+		double fraction() const noexcept
+		{
+			return bytes != 0 ? static_cast<double>(huge_bytes) / bytes : 0.0;
+		}
+
+		// one line: huge pages: <mode>, <n>% of <size> GB on 2 MiB pages[, fell back to thp][, error]
+		void print(std::ostream& out) const;
+	};
+
+	//
+	// Page granular allocations for the field buffers (see page_offset_buffer), optionally on 2 MiB pages -
+	// the stencil streams 7 loads from planes megabytes apart, each one walking its own set of 4 KiB pages.
+	// The mode applies to the allocations made after set_mode(), so it has to be set before the world is built.
+	//
+	// Whether THP was actually obtained is only known afterwards (and can change as khugepaged collapses
+	// pages), report() reads it back from /proc/self/smaps. On anything but Linux it's plain aligned memory.
+	//
+	class PageAllocator
+	{
+		static constexpr size_t PAGE = 4096;
+		static constexpr size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+		struct Allocation
+		{
+			void* mapping;
+			size_t mapping_bytes;
+			void* ptr;
+			size_t bytes;
+			bool hugetlb;
+		};
+
+		struct State
+		{
+			std::mutex lock;
+			huge_pages mode{ huge_pages::transparent };
+			bool fell_back{ false };
+			std::string error{};
+			std::vector<Allocation> allocations;
+		};
+
+		static State& state()
+		{
+			static State s;
+			return s;
+		}
+
+		static size_t round_up(size_t bytes, size_t to) noexcept
+		{
+			return (bytes + to - 1) / to * to;
+		}
+
+#if defined(__linux__)
+		static bool map(size_t bytes, huge_pages mode, Allocation& out, std::string& error)
+		{
+			if (mode == huge_pages::hugetlb)
+			{
+				const size_t len = round_up(bytes, HUGE_PAGE);
+				void* p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				if (p != MAP_FAILED)
+				{
+					out = { p, len, p, bytes, true };
+					return true;
+				}
+				error = std::string{ "MAP_HUGETLB failed: " } + strerror(errno) + ", see /proc/sys/vm/nr_hugepages";
+				return false;
+			}
+
+			// over-allocate to start on a 2 MiB boundary, otherwise the first and the last huge page are lost
+			const size_t len = mode == huge_pages::transparent ? round_up(bytes, PAGE) + HUGE_PAGE : round_up(bytes, PAGE);
+			void* p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				return false;
+
+			char* ptr = static_cast<char*>(p);
+			if (mode == huge_pages::transparent)
+			{
+				ptr = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(p), HUGE_PAGE));
+				// the tail huge page may stick out of the mapping, advise only what is ours
+				const size_t advised = std::min(round_up(bytes, HUGE_PAGE), static_cast<size_t>(static_cast<char*>(p) + len - ptr));
+				if (::madvise(ptr, advised, MADV_HUGEPAGE) != 0)
+					error = std::string{ "madvise(MADV_HUGEPAGE) failed: " } + strerror(errno);
+			}
+			else
+			{
+				::madvise(ptr, len, MADV_NOHUGEPAGE);
+			}
+
+			out = { p, len, ptr, bytes, false };
+			return true;
+		}
+
+		// AnonHugePages of every mapping overlapping one of ours. A mapping may hold more than the allocation,
+		// so the result is capped by the allocation sizes.
+		static uint64_t transparent_huge_bytes(const std::vector<Allocation>& allocations)
+		{
+			FILE* smaps = fopen("/proc/self/smaps", "r");
+			if (smaps == nullptr)
+				return 0;
+
+			uint64_t total = 0;
+			uint64_t current_cap = 0;
+			char line[512];
+			while (fgets(line, sizeof(line), smaps) != nullptr)
+			{
+				unsigned long long from, to;
+				unsigned long long kb;
+				if (sscanf(line, "%llx-%llx ", &from, &to) == 2) // a mapping header, the fields follow
+				{
+					current_cap = 0;
+					for (const auto& a : allocations)
+					{
+						const auto start = reinterpret_cast<uintptr_t>(a.mapping);
+						if (!a.hugetlb && start < to && start + a.mapping_bytes > from)
+							current_cap += a.bytes;
+					}
+				}
+				else if (current_cap != 0 && sscanf(line, "AnonHugePages: %llu kB", &kb) == 1)
+				{
+					total += std::min<uint64_t>(kb * 1024, current_cap);
+				}
+			}
+
+			fclose(smaps);
+			return total;
+		}
+#endif
+
+	public:
+		static void set_mode(huge_pages mode)
+		{
+			std::lock_guard<std::mutex> l(state().lock);
+			state().mode = mode;
+		}
+
+		static huge_pages mode()
+		{
+			std::lock_guard<std::mutex> l(state().lock);
+			return state().mode;
+		}
+
+		static const char* name(huge_pages mode) noexcept
+		{
+			switch (mode)
+			{
+			case huge_pages::off: return "off";
+			case huge_pages::transparent: return "thp";
+			case huge_pages::hugetlb: return "hugetlb";
+			}
+			return "?";
+		}
+
+		static bool parse(const std::string& value, huge_pages& mode) noexcept
+		{
+			for (auto m : { huge_pages::off, huge_pages::transparent, huge_pages::hugetlb })
+			{
+				if (value == name(m))
+				{
+					mode = m;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// page aligned, throws std::bad_alloc
+		static void* allocate(size_t bytes)
+		{
+			auto& s = state();
+			std::lock_guard<std::mutex> l(s.lock);
+
+#if defined(__linux__)
+			Allocation a{};
+			std::string error;
+			bool ok = map(bytes, s.mode, a, error);
+			if (!ok && s.mode == huge_pages::hugetlb)
+			{
+				s.fell_back = true;
+				ok = map(bytes, huge_pages::transparent, a, error);
+			}
+			if (!ok)
+				throw std::bad_alloc();
+			if (!error.empty())
+				s.error = error;
+#else
+			void* p = _mm_malloc(bytes, PAGE);
+			if (p == nullptr)
+				throw std::bad_alloc();
+			Allocation a{ p, bytes, p, bytes, false };
+			if (s.mode != huge_pages::off)
+				s.error = "huge pages are only supported on Linux";
+#endif
+
+			s.allocations.push_back(a);
+			return a.ptr;
+		}
+
+		static void deallocate(void* ptr) noexcept
+		{
+			if (ptr == nullptr)
+				return;
+
+			auto& s = state();
+			std::lock_guard<std::mutex> l(s.lock);
+
+			for (auto it = s.allocations.begin(); it != s.allocations.end(); ++it)
+			{
+				if (it->ptr != ptr)
+					continue;
+#if defined(__linux__)
+				::munmap(it->mapping, it->mapping_bytes);
+#else
+				_mm_free(it->mapping);
+#endif
+				s.allocations.erase(it);
+				return;
+			}
+		}
+
+		// Reads /proc/self/smaps for the THP part, a few ms - not for every frame
+		static HugePageReport report()
+		{
+			auto& s = state();
+			std::lock_guard<std::mutex> l(s.lock);
+
+			HugePageReport ret;
+			ret.mode = s.mode;
+			ret.fell_back = s.fell_back;
+			ret.error = s.error;
+
+			for (const auto& a : s.allocations)
+			{
+				ret.bytes += a.bytes;
+				if (a.hugetlb)
+					ret.huge_bytes += a.bytes;
+			}
+
+#if defined(__linux__)
+			ret.huge_bytes += transparent_huge_bytes(s.allocations);
+#endif
+			return ret;
+		}
+	};
+
+	inline void HugePageReport::print(std::ostream& out) const
+	{
+		const auto flags = out.flags();
+		const auto precision = out.precision();
+
+		out << "huge pages: " << PageAllocator::name(mode) << ", " << std::fixed << std::setprecision(1) << fraction() * 100.0
+			<< "% of " << std::setprecision(2) << bytes / 1e9 << " GB on 2 MiB pages";
+		if (fell_back)
+			out << ", fell back to thp";
+		if (!error.empty())
+			out << ", " << error;
+
+		out.flags(flags);
+		out.precision(precision);
+	}
+}
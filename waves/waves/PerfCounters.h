@@ -0,0 +1,284 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <string>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+#include <cpuid.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace waves
+{
+	struct PerfCounterValues
+	{
+		enum event
+		{
+			CYCLES,
+			INSTRUCTIONS,
+			L1D_MISSES,
+			LLC_MISSES,
+			FP_SCALAR_SINGLE,		// Intel only, FP_ARITH_INST_RETIRED.SCALAR_SINGLE
+			FP_PACKED_256_SINGLE,	// Intel only, FP_ARITH_INST_RETIRED.256B_PACKED_SINGLE
+			NUM_EVENTS
+		};
+
+		static constexpr const char* NAMES[NUM_EVENTS] = {
+			"cycles", "instructions", "l1d_misses", "llc_misses", "fp_scalar_single", "fp_packed_256_single"
+		};
+
+		std::array<uint64_t, NUM_EVENTS> value{};
+		std::array<bool, NUM_EVENTS> valid{};
+
+		PerfCounterValues& operator+=(const PerfCounterValues& other) noexcept
+		{
+			for (int i = 0; i < NUM_EVENTS; ++i)
+			{
+				value[i] += other.value[i];
+				valid[i] = valid[i] || other.valid[i];
+			}
+			return *this;
+		}
+
+		PerfCounterValues operator-(const PerfCounterValues& before) const noexcept
+		{
+			PerfCounterValues ret;
+			for (int i = 0; i < NUM_EVENTS; ++i)
+			{
+				ret.valid[i] = valid[i] && before.valid[i];
+				ret.value[i] = ret.valid[i] && value[i] > before.value[i] ? value[i] - before.value[i] : 0;
+			}
+			return ret;
+		}
+
+		bool any_valid() const noexcept
+		{
+			return valid[CYCLES];
+		}
+	};
+
+	//
+	// Derived numbers for a number of voxel updates. DRAM traffic is estimated as one 64 byte line per
+	// LLC miss - the memory controller counters need system wide access, which we don't want to require.
+	//
+	struct PerfCounterReport
+	{
+		bool available{ false };
+		double ipc{ 0 };
+		double l1d_misses_per_voxel{ 0 };
+		double llc_misses_per_voxel{ 0 };
+		double dram_bytes_per_voxel{ 0 };
+		double packed_fp_fraction{ -1 };	// share of 256 bit packed single precision FP ops, -1 if not counted
+
+		static PerfCounterReport from(const PerfCounterValues& v, double voxel_updates) noexcept
+		{
+			using e = PerfCounterValues;
+
+			PerfCounterReport ret;
+			ret.available = v.any_valid() && voxel_updates > 0;
+			if (!ret.available)
+				return ret;
+
+			if (v.valid[e::INSTRUCTIONS] && v.value[e::CYCLES] != 0)
+				ret.ipc = static_cast<double>(v.value[e::INSTRUCTIONS]) / v.value[e::CYCLES];
+			if (v.valid[e::L1D_MISSES])
+				ret.l1d_misses_per_voxel = v.value[e::L1D_MISSES] / voxel_updates;
+			if (v.valid[e::LLC_MISSES])
+			{
+				ret.llc_misses_per_voxel = v.value[e::LLC_MISSES] / voxel_updates;
+				ret.dram_bytes_per_voxel = ret.llc_misses_per_voxel * 64.0;
+			}
+
+			if (v.valid[e::FP_SCALAR_SINGLE] && v.valid[e::FP_PACKED_256_SINGLE])
+			{
+				// FP_ARITH counts one per instruction, a packed one does 8 single precision operations
+				const double scalar = static_cast<double>(v.value[e::FP_SCALAR_SINGLE]);
+				const double packed = 8.0 * v.value[e::FP_PACKED_256_SINGLE];
+				ret.packed_fp_fraction = scalar + packed > 0 ? packed / (scalar + packed) : 0.0;
+			}
+
+			return ret;
+		}
+	};
+
+	//
+	// A perf_event_open counter group, counting user space events of the thread which opened it.
+	// Must be opened and read from the same thread. Everything except the cycles leader is optional,
+	// events the kernel or the CPU doesn't support are just reported as not valid.
+	// On anything but Linux open() always fails.
+	//
+	class PerfCounterGroup
+	{
+		std::string _error{};
+
+#if defined(__linux__)
+		std::array<int, PerfCounterValues::NUM_EVENTS> _fds;
+		std::array<int, PerfCounterValues::NUM_EVENTS> _slot;	// position in the group read, -1 if not opened
+		int _num_opened{ 0 };
+
+		static bool is_intel() noexcept
+		{
+			unsigned int eax, ebx, ecx, edx;
+			if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+				return false;
+			return ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e; // "GenuineIntel"
+		}
+
+		static bool attr_for(int event, perf_event_attr& attr) noexcept
+		{
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			switch (event)
+			{
+			case PerfCounterValues::CYCLES:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CPU_CYCLES;
+				attr.disabled = 1;
+				return true;
+			case PerfCounterValues::INSTRUCTIONS:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+				return true;
+			case PerfCounterValues::L1D_MISSES:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				return true;
+			case PerfCounterValues::LLC_MISSES:
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = PERF_COUNT_HW_CACHE_MISSES;
+				return true;
+			case PerfCounterValues::FP_SCALAR_SINGLE:
+				attr.type = PERF_TYPE_RAW;
+				attr.config = 0x02c7;
+				return is_intel();
+			case PerfCounterValues::FP_PACKED_256_SINGLE:
+				attr.type = PERF_TYPE_RAW;
+				attr.config = 0x20c7;
+				return is_intel();
+			}
+			return false;
+		}
+#endif
+
+	public:
+		PerfCounterGroup() noexcept
+		{
+#if defined(__linux__)
+			_fds.fill(-1);
+			_slot.fill(-1);
+#endif
+		}
+
+		~PerfCounterGroup()
+		{
+			close();
+		}
+
+		PerfCounterGroup(const PerfCounterGroup&) = delete;
+		PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+		bool open()
+		{
+#if defined(__linux__)
+			close();
+
+			for (int event = 0; event < PerfCounterValues::NUM_EVENTS; ++event)
+			{
+				perf_event_attr attr;
+				if (!attr_for(event, attr))
+					continue;
+
+				const int leader = _fds[PerfCounterValues::CYCLES];
+				const int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+
+				if (fd < 0)
+				{
+					if (event == PerfCounterValues::CYCLES)
+					{
+						_error = std::string{ "perf_event_open failed: " } + strerror(errno) + ", see /proc/sys/kernel/perf_event_paranoid";
+						return false;
+					}
+					continue;
+				}
+
+				_fds[event] = fd;
+				_slot[event] = _num_opened++;
+			}
+
+			::ioctl(_fds[PerfCounterValues::CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			::ioctl(_fds[PerfCounterValues::CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+			return true;
+#else
+			_error = "hardware counters are only supported on Linux";
+			return false;
+#endif
+		}
+
+		void close() noexcept
+		{
+#if defined(__linux__)
+			for (auto& fd : _fds)
+			{
+				if (fd >= 0)
+					::close(fd);
+				fd = -1;
+			}
+			_slot.fill(-1);
+			_num_opened = 0;
+#endif
+		}
+
+		bool is_open() const noexcept
+		{
+#if defined(__linux__)
+			return _fds[PerfCounterValues::CYCLES] >= 0;
+#else
+			return false;
+#endif
+		}
+
+		const std::string& error() const noexcept
+		{
+			return _error;
+		}
+
+		// Running totals since open(), scaled up if the kernel had to multiplex the counters
+		bool read(PerfCounterValues& out) const noexcept
+		{
+#if defined(__linux__)
+			if (!is_open())
+				return false;
+
+			// nr, time_enabled, time_running, values[nr]
+			std::array<uint64_t, 3 + PerfCounterValues::NUM_EVENTS> buf{};
+			const auto expected = static_cast<ssize_t>((3 + _num_opened) * sizeof(uint64_t));
+			if (::read(_fds[PerfCounterValues::CYCLES], buf.data(), sizeof(buf)) < expected)
+				return false;
+
+			const uint64_t enabled = buf[1];
+			const uint64_t running = buf[2];
+			const double scale = running != 0 && running < enabled ? static_cast<double>(enabled) / running : 1.0;
+
+			for (int event = 0; event < PerfCounterValues::NUM_EVENTS; ++event)
+			{
+				out.valid[event] = _slot[event] >= 0 && running != 0;
+				out.value[event] = out.valid[event] ? static_cast<uint64_t>(buf[3 + _slot[event]] * scale) : 0;
+			}
+			return true;
+#else
+			(void)out;
+			return false;
+#endif
+		}
+	};
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "Medium.h"
+#include "StencilKernel.h"
+#include "ThreadGrid.h"
+
+namespace waves
+{
+	enum class boundary_kind
+	{
+		sponge,		// EDGE_SLOW_DOWN_FACTOR powers of the conductivity, EDGE_THICKNESS deep
+		pml			// convolutional PML, PmlBoundary::THICKNESS deep, conductivity left as it is
+	};
+
+	// Damping of the stretched coordinate along each axis at a point, per iteration
+	struct pml_damping
+	{
+		float x{ 0 };
+		float y{ 0 };
+		float z{ 0 };
+	};
+
+	//
+	// Convolutional PML (unsplit, CFS, second order form) as a correction pass after the stencil kernel.
+	// Along every axis with damping d the second difference of the 7-point update becomes
+	//
+	//    (g+ + psi+) - (g- + psi-) + xi
+	//
+	// with g+/g- the differences to the upper/lower neighbour, psi+/psi- their memory variables at the points
+	// half way to the neighbours and xi the one of the voxel, all following  m = b * m + a * (their term),
+	// b = exp(-(d + ALPHA)), a = d / (d + ALPHA) * (b - 1). The kernel has already applied the plain second
+	// difference, the pass adds k/6 * ((psi+ - psi-) + xi) to the velocity (and its share to the location)
+	// of the shell voxels only.
+	//
+	// The memory variables live in a sparse list per axis, one entry per voxel the axis is damped at - the
+	// half-way variables kept on both sides, so an entry never needs its neighbour's. The damping is quantized
+	// to LEVELS steps of a shared coefficient table.
+	//
+	class PmlBoundary
+	{
+	public:
+		static constexpr int THICKNESS = 6;
+		static constexpr int LEVELS = 256;
+
+		static constexpr float ALPHA = 0.01f;		// frequency shift, well below the source's 2 pi / 70, slower parts pass the layer undamped
+		static constexpr float REFLECTION = 1e-4f;	// design reflection of the profile at normal incidence
+
+		// the slow-down of the wave equation the kernel integrates, c^2 = k * dT / 6 in voxels per iteration
+		static float wave_speed(float velocity_factor) noexcept
+		{
+			return std::sqrt(velocity_factor * StencilKernel::LOC_FACTOR / 6.0f);
+		}
+
+		// quadratic profile at depth s into a layer of the given thickness, 0 outside
+		static float damping(float s, float thickness = THICKNESS) noexcept
+		{
+			if (s <= 0.0f)
+				return 0.0f;
+
+			const float r = std::min(s / thickness, 1.0f);
+			return max_damping(thickness) * r * r;
+		}
+
+		static float max_damping(float thickness = THICKNESS) noexcept
+		{
+			return 3.0f * wave_speed(StencilKernel::VEL_FACTOR1) * std::log(1.0f / REFLECTION) / (2.0f * thickness);
+		}
+
+		static const char* name(boundary_kind kind) noexcept
+		{
+			switch (kind)
+			{
+			case boundary_kind::sponge: return "sponge";
+			case boundary_kind::pml: return "pml";
+			}
+			return "?";
+		}
+
+		static bool parse(const std::string& value, boundary_kind& kind) noexcept
+		{
+			for (auto k : { boundary_kind::sponge, boundary_kind::pml })
+			{
+				if (value == name(k))
+				{
+					kind = k;
+					return true;
+				}
+			}
+			return false;
+		}
+
+	private:
+		struct entry
+		{
+			int offset;
+			uint8_t lower;		// damping levels half way to the lower neighbour, at the voxel, half way to the upper one
+			uint8_t voxel;
+			uint8_t upper;
+			float psi_lower;
+			float psi_upper;
+			float xi;
+		};
+
+		float _max_damping;
+		std::array<float, LEVELS> _b;
+		std::array<float, LEVELS> _a;
+
+		std::array<std::vector<entry>, 3> _entries;	// per axis, x y z
+
+		uint8_t level(float d) const noexcept
+		{
+			return static_cast<uint8_t>(std::clamp(std::lround(d / _max_damping * (LEVELS - 1)), 0L, static_cast<long>(LEVELS - 1)));
+		}
+
+	public:
+		// profile(x, y, z) - the pml_damping at a point of the medium, at the voxels and half way between them.
+		// Voxels with zero conductivity aren't updated by the kernel and get no entries.
+		template <typename TMediumStatic, typename TProfile>
+		PmlBoundary(const TMediumStatic& statics, TProfile&& profile, ThreadGrid& grid, float max_damping = PmlBoundary::max_damping())
+			: _max_damping{ max_damping }
+		{
+			for (int l = 0; l < LEVELS; ++l)
+			{
+				const float d = _max_damping * l / (LEVELS - 1);
+				_b[l] = std::exp(-(d + ALPHA));
+				_a[l] = d / (d + ALPHA) * (_b[l] - 1.0f);
+			}
+
+			std::vector<std::array<std::vector<entry>, 3>> partials(grid.NumThreads());
+
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					StencilKernel::slab_for(statics.depth(), thread_idx, num_threads, from, to);
+
+					auto& out = partials[thread_idx];
+
+					for (int z = from; z < to; ++z)
+					{
+						for (int y = 0; y < statics.height(); ++y)
+						{
+							for (int x = 0; x < statics.width(); ++x)
+							{
+								if (statics.at(x, y, z).conductivity == 0)
+									continue;
+
+								const auto fx = static_cast<float>(x);
+								const auto fy = static_cast<float>(y);
+								const auto fz = static_cast<float>(z);
+
+								const pml_damping at = profile(fx, fy, fz);
+								const float lower[3] = { profile(fx - 0.5f, fy, fz).x, profile(fx, fy - 0.5f, fz).y, profile(fx, fy, fz - 0.5f).z };
+								const float upper[3] = { profile(fx + 0.5f, fy, fz).x, profile(fx, fy + 0.5f, fz).y, profile(fx, fy, fz + 0.5f).z };
+								const float voxel[3] = { at.x, at.y, at.z };
+
+								for (int axis = 0; axis < 3; ++axis)
+								{
+									const entry e{ statics.offset_for(x, y, z), level(lower[axis]), level(voxel[axis]), level(upper[axis]), 0.0f, 0.0f, 0.0f };
+									if (e.lower != 0 || e.voxel != 0 || e.upper != 0)
+										out[axis].push_back(e);
+								}
+							}
+						}
+					}
+				}
+				);
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				for (const auto& partial : partials)
+					_entries[axis].insert(_entries[axis].end(), partial[axis].begin(), partial[axis].end());
+			}
+		}
+
+		// The correction of the step the kernel has just made current -> next
+		template <typename TMedium, typename TMediumStatic>
+		void apply(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid) noexcept
+		{
+			const int strides[3] = {
+				current.offset_for(1, 0, 0) - current.offset_for(0, 0, 0),
+				current.offset_for(0, 1, 0) - current.offset_for(0, 0, 0),
+				current.offset_for(0, 0, 1) - current.offset_for(0, 0, 0)
+			};
+
+			// one axis at a time, a voxel has one entry per axis
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				auto& entries = _entries[axis];
+				const int stride = strides[axis];
+
+				grid.GridRun(
+					[&](int thread_idx, int num_threads)
+					{
+						int from, to;
+						StencilKernel::slab_for(static_cast<int>(entries.size()), thread_idx, num_threads, from, to);
+
+						for (int i = from; i < to; ++i)
+						{
+							auto& e = entries[i];
+
+							const float location = current.data[e.offset].location;
+							const float upper = current.data[e.offset + stride].location - location;
+							const float lower = location - current.data[e.offset - stride].location;
+
+							e.psi_upper = _b[e.upper] * e.psi_upper + _a[e.upper] * upper;
+							e.psi_lower = _b[e.lower] * e.psi_lower + _a[e.lower] * lower;
+							e.xi = _b[e.voxel] * e.xi + _a[e.voxel] * ((upper + e.psi_upper) - (lower + e.psi_lower));
+
+							const auto item_static = statics.data[e.offset];
+							const float velocity_factor = item_static.velocity_bit ? StencilKernel::VEL_FACTOR2 : StencilKernel::VEL_FACTOR1;
+							const float conductivity_factor = static_cast<float>(item_static.conductivity) / 127.0f;
+
+							const float velocity = velocity_factor * (1.0f / 6.0f) * ((e.psi_upper - e.psi_lower) + e.xi) * conductivity_factor * 0.99999f;
+
+							next.data[e.offset].velocity += velocity;
+							next.data[e.offset].location += velocity * StencilKernel::LOC_FACTOR;
+						}
+					}
+					);
+			}
+		}
+
+		size_t entries() const noexcept
+		{
+			return _entries[0].size() + _entries[1].size() + _entries[2].size();
+		}
+
+		size_t bytes() const noexcept
+		{
+			return entries() * sizeof(entry);
+		}
+	};
+}
@@ -2,12 +2,16 @@
 
 #include <sstream>
 #include <iomanip>
+#include <filesystem>
 #include <stdint.h>
 #include <vector>
+#if !defined(WAVES_HEADLESS)
 #include <GL/gl.h>			/* OpenGL header file */
 #include <GL/glu.h>			/* OpenGL utilities header file */
+#endif
 
 #include "PngLogger.h"
+#include "Trace.h"
 
 #include "lodepng.h"
 
@@ -18,7 +22,8 @@ PngLogger::PngLogger(const std::string& logFolder)
 	, _vpWidth{ 1 }
 	, _vpHeight{ 1 }
 {
-	::CreateDirectoryA(logFolder.c_str(), nullptr);
+	std::error_code ec;
+	std::filesystem::create_directories(logFolder, ec);
 }
 
 
@@ -36,8 +41,25 @@ void PngLogger::onViewportResize(int width, int height)
 
 void PngLogger::onNewFrame()
 {
+#if !defined(WAVES_HEADLESS)
 	// Capture the actual pixels 
 	glReadPixels(0, 0, _vpWidth, _vpHeight, GL_RGBA, GL_UNSIGNED_BYTE, &_pixels[0]);
+	writeFrame();
+#endif
+}
+
+void PngLogger::onRenderedFrame(const unsigned char* rgba, int width, int height)
+{
+	if (width != _vpWidth || height != _vpHeight)
+		onViewportResize(width, height);
+
+	::memcpy(_pixels.data(), rgba, width * height * 4);
+	writeFrame();
+}
+
+void PngLogger::writeFrame()
+{
+	WAVES_TRACE_SCOPE("png_encode");
 
 	// BMP is a weird one, stored in a reverse order
 	for (int row = 0; row < _vpHeight; ++row)
@@ -48,16 +70,17 @@ void PngLogger::onNewFrame()
 	}
 
 
-	// todo: format the name with leading zeroes
 	std::ostringstream str;
-	str << _logFolder << "\\" << std::setw(8) << std::setfill('0') << _nextSeq++ << ".png";
-	std::string name = str.str();
+	str << std::setw(8) << std::setfill('0') << _nextSeq++ << ".png";
+	std::string name = (std::filesystem::path(_logFolder) / str.str()).string();
 
 	lodepng::encode(name.c_str(), _pixelsFlipped.data(), _vpWidth, _vpHeight);
 }
 
 void PngLogger::recordOrthogonalFrame(uint64_t plane_seq)
 {	
+	WAVES_TRACE_SCOPE("png_encode");
+
 	// BMP is a weird one, stored in a reverse order
 	for (int row = 0; row < _vpHeight; ++row)
 	{
@@ -66,10 +89,9 @@ void PngLogger::recordOrthogonalFrame(uint64_t plane_seq)
 		::memcpy(dst_row, src_row, _vpWidth * 4);
 	}
 
-	// todo: format the name with leading zeroes
 	std::ostringstream str;
-	str << _logFolder << "\\" << std::setw(3) << std::setfill('0') << plane_seq << ".png";
-	std::string name = str.str();
+	str << std::setw(3) << std::setfill('0') << plane_seq << ".png";
+	std::string name = (std::filesystem::path(_logFolder) / str.str()).string();
 
 	lodepng::encode(name.c_str(), _pixelsFlipped.data(), _vpWidth, _vpHeight);
 }
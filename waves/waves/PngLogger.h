@@ -14,6 +14,8 @@ class PngLogger : public IImageLogger
 
 	uint64_t _nextSeq{ 0 };
 
+	void writeFrame();
+
 public:
 	PngLogger(const std::string& logFolder);
 
@@ -21,6 +23,7 @@ public:
 
 	void onViewportResize(int widht, int height) override;
 	void onNewFrame() override;
+	void onRenderedFrame(const unsigned char* rgba, int width, int height) override;
 
 	inline std::vector<unsigned char>& data()
 	{
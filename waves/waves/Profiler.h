@@ -0,0 +1,267 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "Trace.h"
+
+namespace waves
+{
+	//
+	// Lock-free latency histogram, nanosecond resolution.
+	//
+	// Buckets are log2 with 4 linear sub-buckets per power of two (~19% worst case error),
+	// recording is a couple of relaxed atomic increments, so any thread can record at any time.
+	//
+	class LatencyHistogram
+	{
+		static constexpr int SUB_BUCKET_BITS = 2;
+		static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+		static constexpr int NUM_BUCKETS = 64 * SUB_BUCKETS;
+
+		std::array<std::atomic<uint64_t>, NUM_BUCKETS> _buckets{};
+		std::atomic<uint64_t> _count{ 0 };
+		std::atomic<uint64_t> _sum{ 0 };
+		std::atomic<uint64_t> _max{ 0 };
+
+		static int bucket_for(uint64_t ns) noexcept
+		{
+			if (ns < SUB_BUCKETS)
+				return static_cast<int>(ns);
+
+			int log2 = 63;
+			while ((ns >> log2) == 0)
+				--log2;
+
+			const int sub = static_cast<int>((ns >> (log2 - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+			return (log2 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+		}
+
+		// upper bound of the values falling into the bucket
+		static uint64_t bucket_limit(int bucket) noexcept
+		{
+			if (bucket < SUB_BUCKETS)
+				return static_cast<uint64_t>(bucket);
+
+			const int log2 = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+			const uint64_t sub = static_cast<uint64_t>(bucket % SUB_BUCKETS);
+			return ((SUB_BUCKETS + sub + 1) << (log2 - SUB_BUCKET_BITS)) - 1;
+		}
+
+	public:
+		void record(uint64_t ns) noexcept
+		{
+			_buckets[bucket_for(ns)].fetch_add(1, std::memory_order_relaxed);
+			_count.fetch_add(1, std::memory_order_relaxed);
+			_sum.fetch_add(ns, std::memory_order_relaxed);
+
+			uint64_t prev = _max.load(std::memory_order_relaxed);
+			while (prev < ns && !_max.compare_exchange_weak(prev, ns, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		uint64_t count() const noexcept { return _count.load(std::memory_order_relaxed); }
+		uint64_t sum() const noexcept { return _sum.load(std::memory_order_relaxed); }
+		uint64_t max() const noexcept { return _max.load(std::memory_order_relaxed); }
+
+		// p in 0..1, returns the upper bound of the bucket holding the p-th sample
+		uint64_t percentile(double p) const noexcept
+		{
+			const uint64_t total = count();
+			if (total == 0)
+				return 0;
+
+			const uint64_t rank = static_cast<uint64_t>(p * (total - 1)) + 1;
+
+			uint64_t seen = 0;
+			for (int b = 0; b < NUM_BUCKETS; ++b)
+			{
+				seen += _buckets[b].load(std::memory_order_relaxed);
+				if (seen >= rank)
+					return std::min(bucket_limit(b), max());
+			}
+
+			return max();
+		}
+
+		void reset() noexcept
+		{
+			for (auto& b : _buckets)
+				b.store(0, std::memory_order_relaxed);
+			_count = 0;
+			_sum = 0;
+			_max = 0;
+		}
+	};
+
+	struct PhaseSummary
+	{
+		std::string name;
+		uint64_t count;
+		uint64_t p50_ns;
+		uint64_t p99_ns;
+		uint64_t max_ns;
+		uint64_t mean_ns;
+	};
+
+	struct CounterSummary
+	{
+		std::string name;
+		uint64_t value;
+	};
+
+	//
+	// Named phases (latency histograms) and counters. Phases and counters are registered up-front,
+	// recording is lock-free and can happen from any thread.
+	//
+	//    const auto phase = profiler.add_phase("stencil");
+	//    { ScopedTimer t{ profiler, phase }; ... }
+	//
+	class Profiler
+	{
+		struct Phase
+		{
+			std::string name;
+			const char* trace_name{ nullptr };
+			LatencyHistogram histogram;
+		};
+
+		struct Counter
+		{
+			std::string name;
+			std::atomic<uint64_t> value{ 0 };
+		};
+
+		std::vector<std::unique_ptr<Phase>> _phases;
+		std::vector<std::unique_ptr<Counter>> _counters;
+
+	public:
+		using clock = std::chrono::steady_clock;
+
+		Profiler() = default;
+		Profiler(const Profiler&) = delete;
+		Profiler& operator=(const Profiler&) = delete;
+
+		// not thread safe, register everything before the recording starts
+		size_t add_phase(const std::string& name)
+		{
+			_phases.push_back(std::make_unique<Phase>());
+			_phases.back()->name = name;
+			_phases.back()->trace_name = Tracer::instance().intern(name);
+			return _phases.size() - 1;
+		}
+
+		size_t add_counter(const std::string& name)
+		{
+			_counters.push_back(std::make_unique<Counter>());
+			_counters.back()->name = name;
+			return _counters.size() - 1;
+		}
+
+		void record(size_t phase, uint64_t ns) noexcept
+		{
+			_phases[phase]->histogram.record(ns);
+		}
+
+		// also lands on the trace timeline, under the phase name, when built with WAVES_TRACE
+		void record(size_t phase, clock::time_point start, clock::time_point end) noexcept
+		{
+			record(phase, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+#if defined(WAVES_TRACE)
+			Tracer::instance().record(_phases[phase]->trace_name, start, end);
+#endif
+		}
+
+		void count(size_t counter, uint64_t n = 1) noexcept
+		{
+			_counters[counter]->value.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		const LatencyHistogram& histogram(size_t phase) const noexcept
+		{
+			return _phases[phase]->histogram;
+		}
+
+		std::vector<PhaseSummary> phases() const
+		{
+			std::vector<PhaseSummary> ret;
+			for (const auto& p : _phases)
+			{
+				const auto& h = p->histogram;
+				const uint64_t n = h.count();
+				ret.push_back({ p->name, n, h.percentile(0.5), h.percentile(0.99), h.max(), n != 0 ? h.sum() / n : 0 });
+			}
+			return ret;
+		}
+
+		std::vector<CounterSummary> counters() const
+		{
+			std::vector<CounterSummary> ret;
+			for (const auto& c : _counters)
+				ret.push_back({ c->name, c->value.load(std::memory_order_relaxed) });
+			return ret;
+		}
+
+		void reset() noexcept
+		{
+			for (auto& p : _phases)
+				p->histogram.reset();
+			for (auto& c : _counters)
+				c->value = 0;
+		}
+
+		// one line per phase: name n=.. p50=..ms p99=..ms max=..ms, then the counters on one line
+		void print(std::ostream& out) const
+		{
+			for (const auto& p : phases())
+			{
+				out << std::left << std::setw(18) << p.name << std::right << std::fixed << std::setprecision(3)
+					<< " n=" << p.count
+					<< " p50=" << p.p50_ns / 1e6 << "ms"
+					<< " p99=" << p.p99_ns / 1e6 << "ms"
+					<< " max=" << p.max_ns / 1e6 << "ms\n";
+			}
+
+			bool first = true;
+			for (const auto& c : counters())
+			{
+				out << (first ? "" : " ") << c.name << "=" << c.value;
+				first = false;
+			}
+			if (!first)
+				out << "\n";
+		}
+	};
+
+	class ScopedTimer
+	{
+		Profiler& _profiler;
+		size_t _phase;
+		Profiler::clock::time_point _start;
+
+	public:
+		ScopedTimer(Profiler& profiler, size_t phase) noexcept
+			: _profiler{ profiler }
+			, _phase{ phase }
+			, _start{ Profiler::clock::now() }
+		{
+		}
+
+		~ScopedTimer()
+		{
+			_profiler.record(_phase, _start, Profiler::clock::now());
+		}
+
+		ScopedTimer(const ScopedTimer&) = delete;
+		ScopedTimer& operator=(const ScopedTimer&) = delete;
+	};
+}
@@ -6,6 +6,6 @@
 
 namespace waves::props
 {
-	constexpr int32_t ViewPortWidth{ World::TMedium::width() * 3 / 2};
-	constexpr int32_t ViewPortHeight{ World::TMedium::height() * 3 / 2 };
+	constexpr int32_t ViewPortWidth{ DEFAULT_MEDIUM_SIZE.width * 3 / 2};
+	constexpr int32_t ViewPortHeight{ DEFAULT_MEDIUM_SIZE.height * 3 / 2 };
 }
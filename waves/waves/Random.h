@@ -3,6 +3,7 @@
 #include <stdexcept>
 #include <random>
 #include <chrono>
+#include <climits>
 
 class Random
 {
@@ -25,13 +26,11 @@ public:
 		return static_cast<T>(static_cast<double>(from - to) * NextDouble() + static_cast<double>(from));
 	}
 
-	template <>
 	float Next(const float& from, const float& to) noexcept
 	{
 		return static_cast<float>((from - to) * NextFloat() + from);
 	}
 
-	template <>
 	double Next(const double& from, const double& to) noexcept
 	{
 		return (from - to) * NextDouble() + from;
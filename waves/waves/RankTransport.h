@@ -0,0 +1,396 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(WAVES_MPI)
+#include <mpi.h>
+#endif
+
+namespace waves
+{
+	enum class reduce_op
+	{
+		sum,
+		max
+	};
+
+	//
+	// What the ranks of a DistributedWorld need from each other: messages between neighbouring ranks,
+	// a gather to rank 0 and all-reduces. Every rank has to make the same collective calls in the same order.
+	//
+	// start_send() / start_receive() only start the transfer, the buffers belong to the transport until
+	// wait_all() returns - so a rank can compute its interior in between.
+	//
+	class RankTransport
+	{
+	public:
+		virtual ~RankTransport() {}
+
+		virtual int rank() const noexcept = 0;
+		virtual int ranks() const noexcept = 0;
+		virtual const char* name() const noexcept = 0;
+
+		// to / from are rank - 1 or rank + 1
+		virtual void start_send(int to, const void* data, size_t bytes) = 0;
+		virtual void start_receive(int from, void* data, size_t bytes) = 0;
+		virtual void wait_all() = 0;
+
+		// The data of all the ranks, in rank order, into all on rank 0 (unused elsewhere); bytes may differ between ranks
+		virtual void gather(const void* data, size_t bytes, void* all) = 0;
+
+		// values[i] = op over the ranks of values[i], on every rank
+		virtual void all_reduce(double* values, size_t count, reduce_op op) = 0;
+
+		virtual void barrier() = 0;
+
+		// At the end of main(), returns the exit code of the process - rank 0 waits for the others there
+		virtual int finish(int exit_code) = 0;
+	};
+
+	// The largest transfers a DistributedWorld makes, the shared memory transport sizes its buffers after them
+	struct RankTransportLimits
+	{
+		size_t message_bytes{ 0 };
+		size_t gather_bytes{ 0 };
+		size_t reduce_values{ 0 };
+	};
+
+#if defined(__linux__)
+	//
+	// Forked processes on one machine, talking through a shared anonymous mapping:
+	//  - one channel per direction between neighbours, two message slots each, so a rank can send
+	//    step n + 1 before its neighbour has picked up step n
+	//  - a gather area and a reduce area, both used between two barriers
+	// The waits spin with a yield - the ranks are expected to have about the same amount of work.
+	//
+	class SharedMemoryTransport : public RankTransport
+	{
+		static constexpr int MAX_RANKS = 256;
+		static constexpr int SLOTS = 2;
+
+		struct alignas(64) Channel
+		{
+			std::atomic<uint64_t> written;
+			std::atomic<uint64_t> read;
+		};
+
+		struct Shared
+		{
+			alignas(64) std::atomic<int> barrier_count;
+			alignas(64) std::atomic<int> barrier_sense;
+			Channel channels[MAX_RANKS][2]; // [from][0 - to from - 1, 1 - to from + 1]
+			uint64_t gather_bytes[MAX_RANKS];
+		};
+
+		struct PendingReceive
+		{
+			int from;
+			void* data;
+			size_t bytes;
+		};
+
+		Shared* _shared;
+		char* _slots;			// [from][direction][slot], message_bytes each
+		double* _reduce;		// [rank][reduce_values]
+		char* _gather;
+		size_t _mapping_bytes;
+
+		RankTransportLimits _limits;
+		int _rank{ 0 };
+		int _ranks;
+		int _sense{ 0 };
+		std::vector<pid_t> _children;
+		std::vector<PendingReceive> _receives;
+
+		template <typename TCondition>
+		static void spin(TCondition&& done) noexcept
+		{
+			while (!done())
+				std::this_thread::yield();
+		}
+
+		static int direction(int from, int to) noexcept
+		{
+			return to < from ? 0 : 1;
+		}
+
+		char* slot(int from, int dir, uint64_t seq) const noexcept
+		{
+			return _slots + ((static_cast<size_t>(from) * 2 + dir) * SLOTS + seq % SLOTS) * _limits.message_bytes;
+		}
+
+		void check_neighbour(int other, size_t bytes) const
+		{
+			if (other != _rank - 1 && other != _rank + 1)
+				throw std::invalid_argument("rank " + std::to_string(_rank) + " can only talk to its neighbours, not to " + std::to_string(other));
+			if (bytes > _limits.message_bytes)
+				throw std::invalid_argument("message of " + std::to_string(bytes) + " bytes exceeds the limit");
+		}
+
+	public:
+		SharedMemoryTransport(int ranks, const RankTransportLimits& limits)
+			: _limits{ limits }
+			, _ranks{ ranks }
+		{
+			if (ranks < 1 || ranks > MAX_RANKS)
+				throw std::invalid_argument("between 1 and " + std::to_string(MAX_RANKS) + " ranks");
+
+			const size_t slots_bytes = static_cast<size_t>(ranks) * 2 * SLOTS * limits.message_bytes;
+			const size_t reduce_bytes = static_cast<size_t>(ranks) * limits.reduce_values * sizeof(double);
+			_mapping_bytes = sizeof(Shared) + slots_bytes + reduce_bytes + limits.gather_bytes;
+
+			void* p = ::mmap(nullptr, _mapping_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				throw std::runtime_error(std::string{ "can't map the shared memory: " } + strerror(errno));
+
+			_shared = new (p) Shared{};
+			_slots = static_cast<char*>(p) + sizeof(Shared);
+			_reduce = reinterpret_cast<double*>(_slots + slots_bytes);
+			_gather = _slots + slots_bytes + reduce_bytes;
+		}
+
+		~SharedMemoryTransport()
+		{
+			::munmap(_shared, _mapping_bytes);
+		}
+
+		SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+		SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+
+		// Forks ranks() - 1 copies of the process, each returns from here with its own rank().
+		// Has to be called before any thread is started.
+		void launch()
+		{
+			for (int r = 1; r < _ranks; ++r)
+			{
+				const pid_t pid = ::fork();
+				if (pid < 0)
+					throw std::runtime_error(std::string{ "fork failed: " } + strerror(errno));
+
+				if (pid == 0)
+				{
+					_rank = r;
+					_children.clear();
+					return;
+				}
+
+				_children.push_back(pid);
+			}
+		}
+
+		int rank() const noexcept override { return _rank; }
+		int ranks() const noexcept override { return _ranks; }
+		const char* name() const noexcept override { return "shared memory"; }
+
+		void start_send(int to, const void* data, size_t bytes) override
+		{
+			check_neighbour(to, bytes);
+
+			auto& channel = _shared->channels[_rank][direction(_rank, to)];
+			const uint64_t seq = channel.written.load(std::memory_order_relaxed);
+
+			spin([&] { return seq - channel.read.load(std::memory_order_acquire) < SLOTS; });
+
+			std::memcpy(slot(_rank, direction(_rank, to), seq), data, bytes);
+			channel.written.store(seq + 1, std::memory_order_release);
+		}
+
+		void start_receive(int from, void* data, size_t bytes) override
+		{
+			check_neighbour(from, bytes);
+			_receives.push_back({ from, data, bytes });
+		}
+
+		void wait_all() override
+		{
+			for (const auto& r : _receives)
+			{
+				auto& channel = _shared->channels[r.from][direction(r.from, _rank)];
+				const uint64_t seq = channel.read.load(std::memory_order_relaxed);
+
+				spin([&] { return channel.written.load(std::memory_order_acquire) > seq; });
+
+				std::memcpy(r.data, slot(r.from, direction(r.from, _rank), seq), r.bytes);
+				channel.read.store(seq + 1, std::memory_order_release);
+			}
+			_receives.clear();
+		}
+
+		void gather(const void* data, size_t bytes, void* all) override
+		{
+			_shared->gather_bytes[_rank] = bytes;
+			barrier();
+
+			size_t offset = 0;
+			size_t total = 0;
+			for (int r = 0; r < _ranks; ++r)
+			{
+				if (r < _rank)
+					offset += _shared->gather_bytes[r];
+				total += _shared->gather_bytes[r];
+			}
+
+			if (total > _limits.gather_bytes)
+				throw std::invalid_argument("gather of " + std::to_string(total) + " bytes exceeds the limit");
+
+			std::memcpy(_gather + offset, data, bytes);
+			barrier();
+
+			if (_rank == 0)
+				std::memcpy(all, _gather, total);
+			barrier();
+		}
+
+		void all_reduce(double* values, size_t count, reduce_op op) override
+		{
+			if (count > _limits.reduce_values)
+				throw std::invalid_argument("all-reduce of " + std::to_string(count) + " values exceeds the limit");
+
+			std::copy(values, values + count, _reduce + static_cast<size_t>(_rank) * _limits.reduce_values);
+			barrier();
+
+			// in rank order on every rank, so the sums are the same everywhere
+			for (size_t i = 0; i < count; ++i)
+			{
+				double value = _reduce[i];
+				for (int r = 1; r < _ranks; ++r)
+				{
+					const double other = _reduce[static_cast<size_t>(r) * _limits.reduce_values + i];
+					value = op == reduce_op::sum ? value + other : std::max(value, other);
+				}
+				values[i] = value;
+			}
+			barrier();
+		}
+
+		void barrier() override
+		{
+			_sense = 1 - _sense;
+			if (_shared->barrier_count.fetch_add(1, std::memory_order_acq_rel) + 1 == _ranks)
+			{
+				_shared->barrier_count.store(0, std::memory_order_relaxed);
+				_shared->barrier_sense.store(_sense, std::memory_order_release);
+			}
+			else
+			{
+				spin([&] { return _shared->barrier_sense.load(std::memory_order_acquire) == _sense; });
+			}
+		}
+
+		// The worst exit code of all the ranks on rank 0
+		int finish(int exit_code) override
+		{
+			for (const pid_t child : _children)
+			{
+				int status = 0;
+				if (::waitpid(child, &status, 0) < 0 || !WIFEXITED(status))
+					exit_code = std::max(exit_code, 1);
+				else
+					exit_code = std::max(exit_code, WEXITSTATUS(status));
+			}
+			_children.clear();
+			return exit_code;
+		}
+	};
+#endif
+
+#if defined(WAVES_MPI)
+	//
+	// The same over MPI, for ranks on several nodes: mpirun -np <n> waves_headless --mpi ...
+	//
+	class MpiTransport : public RankTransport
+	{
+		int _rank{ 0 };
+		int _ranks{ 1 };
+		std::vector<MPI_Request> _requests;
+
+	public:
+		MpiTransport(int* argc, char*** argv)
+		{
+			int provided = 0;
+			MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+			MPI_Comm_rank(MPI_COMM_WORLD, &_rank);
+			MPI_Comm_size(MPI_COMM_WORLD, &_ranks);
+		}
+
+		~MpiTransport()
+		{
+			int finalized = 0;
+			MPI_Finalized(&finalized);
+			if (!finalized)
+				MPI_Finalize();
+		}
+
+		MpiTransport(const MpiTransport&) = delete;
+		MpiTransport& operator=(const MpiTransport&) = delete;
+
+		int rank() const noexcept override { return _rank; }
+		int ranks() const noexcept override { return _ranks; }
+		const char* name() const noexcept override { return "mpi"; }
+
+		void start_send(int to, const void* data, size_t bytes) override
+		{
+			_requests.emplace_back();
+			MPI_Isend(data, static_cast<int>(bytes), MPI_BYTE, to, 0, MPI_COMM_WORLD, &_requests.back());
+		}
+
+		void start_receive(int from, void* data, size_t bytes) override
+		{
+			_requests.emplace_back();
+			MPI_Irecv(data, static_cast<int>(bytes), MPI_BYTE, from, 0, MPI_COMM_WORLD, &_requests.back());
+		}
+
+		void wait_all() override
+		{
+			MPI_Waitall(static_cast<int>(_requests.size()), _requests.data(), MPI_STATUSES_IGNORE);
+			_requests.clear();
+		}
+
+		void gather(const void* data, size_t bytes, void* all) override
+		{
+			const int count = static_cast<int>(bytes);
+			std::vector<int> counts(_ranks);
+			MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+			std::vector<int> offsets(_ranks, 0);
+			for (int r = 1; r < _ranks; ++r)
+				offsets[r] = offsets[r - 1] + counts[r - 1];
+
+			MPI_Gatherv(data, count, MPI_BYTE, all, counts.data(), offsets.data(), MPI_BYTE, 0, MPI_COMM_WORLD);
+		}
+
+		void all_reduce(double* values, size_t count, reduce_op op) override
+		{
+			MPI_Allreduce(MPI_IN_PLACE, values, static_cast<int>(count), MPI_DOUBLE, op == reduce_op::sum ? MPI_SUM : MPI_MAX, MPI_COMM_WORLD);
+		}
+
+		void barrier() override
+		{
+			MPI_Barrier(MPI_COMM_WORLD);
+		}
+
+		int finish(int exit_code) override
+		{
+			MPI_Allreduce(MPI_IN_PLACE, &exit_code, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+			MPI_Finalize();
+			return exit_code;
+		}
+	};
+#endif
+}
@@ -1,20 +1,87 @@
 #pragma once
 
 #include <charconv>
+#if defined(_WIN32)
 #include <shellapi.h>
+#endif
+#include <cstring>
 #include <limits>
 #include <string>
 #include <vector>
 
+#include "Medium.h"
+#include "PageAllocator.h"
+#include "Pml.h"
+
 namespace waves
 {
+    enum class record_format
+    {
+        png,
+        y4m,
+        delta_rle
+    };
+
+    // Exposure to take during a headless run: starts at the given iteration and integrates for 'length' iterations
+    struct exposure_schedule_item
+    {
+        uint64_t start;
+        uint64_t length;
+    };
+
     class runtime_config
     {
         bool _auto_start{ false };
 
         int _scene{ 0 };
 
-        
+        record_format _record_format{ record_format::y4m };
+
+        MediumSize _medium_size{ 432, 768, 768 };
+        huge_pages _huge_pages{ huge_pages::transparent };
+        boundary_kind _boundary{ boundary_kind::sponge };
+
+        // out-of-core fields, see OutOfCoreWorld
+        std::string _out_of_core_folder{}; // empty - in memory
+        int _slab_planes{ 32 };
+        int _steps_per_pass{ 4 };
+
+        // parameter sweeps, see SweepRunner
+        std::string _sweep_manifest{}; // empty - a single run
+        int _sweep_concurrent{ 0 }; // 0 - as many as fit
+
+        // z split between processes, see DistributedWorld
+        int _ranks{ 1 };
+        bool _mpi{ false };
+
+        // headless runner
+        std::string _pattern_file{};
+        std::vector<std::string> _ensemble_patterns{}; // empty - a single simulation of _pattern_file
+        uint64_t _iterations{ 1000 };
+        std::vector<exposure_schedule_item> _exposures{};
+        double _exposure_tolerance{ 0 }; // 0 - the exposures run for their whole length
+        int _threads{ 8 };
+        bool _threads_given{ false };
+        std::string _output_folder{ "." };
+        uint64_t _stats_every{ 100 };
+        uint64_t _slice_every{ 0 }; // 0 - don't save slices
+
+        bool _perf_counters{ false };
+        std::string _trace_file{}; // empty - no tracing
+
+        std::string _kernel{ "reference" };
+        bool _kernel_given{ false };
+        bool _multirate{ false };
+        uint64_t _reductions_every{ 10 }; // 0 - off
+
+        // golden-result checks, see Golden.h
+        std::string _golden_write_file{};
+        std::string _golden_check_file{};
+        std::string _samples_folder{ "samples" };
+
+        // per-host tuning, see Autotune.h
+        bool _autotune{ false };
+        std::string _tuning_profile{}; // empty - waves_tuning_<host>.txt, "off" - none
 
     public:
 
@@ -22,6 +89,7 @@ namespace waves
         {
         }
 
+#if defined(_WIN32)
         static std::string wcs2mbs(std::wstring w_string)
         {
             const wchar_t* wcs_ind_string = w_string.c_str();
@@ -39,12 +107,55 @@ namespace waves
                 return "";
             return std::string(buffer.data(), converted-1);
         }
+#endif
 
         const wchar_t* get_usage()
         {
-            return L"Usage: \nwaves.exe [--scene <n>] [--auto-start]";
+            return L"Usage: \nwaves.exe [--scene <n>] [--auto-start] [--record-format png|y4m|rle] [--threads <n>] [--size <w>x<h>x<d>] [--huge-pages off|thp|hugetlb] [--perf-counters] [--trace <file.json>] [--kernel <name>] [--reductions-every <n>] [--exposure-tolerance <x>] [--tuning-profile <file>|off] [--boundary sponge|pml] [--multirate]";
+        }
+
+        static const char* get_headless_usage()
+        {
+            return
+                "Usage: waves_headless [options]\n"
+                "  --pattern <file.png>         240x240 png pattern, default round pattern if omitted\n"
+                "  --ensemble <file.png>        run the pattern as one member of an ensemble sharing the scene, may repeat (up to 32)\n"
+                "  --iterations <n>             number of iterations to run (default 1000)\n"
+                "  --exposure <start>:<length>  take a picture integrating from <start> for <length> iterations, may repeat\n"
+                "  --exposure-tolerance <x>     end an exposure once its picture changes by less than x (relative) per source\n"
+                "                               period, and the run once all the exposures are done (default 0 - off)\n"
+                "  --threads <n>                number of worker threads (default 8, or the tuning profile's)\n"
+                "  --size <w>x<h>x<d>           medium size in voxels (default 432x768x768), at least 290x240x240\n"
+                "  --huge-pages off|thp|hugetlb field buffers on 2 MiB pages: madvise or the hugetlbfs pool (default thp)\n"
+                "  --boundary sponge|pml        absorbing boundary of the scene: the conductivity sponge (default) or a thinner\n"
+                "                               convolutional PML (in-memory single-pattern runs and sweeps)\n"
+                "  --out-of-core <dir>          keep the fields in files in <dir> (local NVMe) and stream them in z-slabs\n"
+                "  --slab-planes <n>            out of core: z-planes per slab (default 32)\n"
+                "  --steps-per-pass <n>         out of core: steps per pass over the files, the iterations round up to it (default 4)\n"
+                "  --sweep <manifest>           run the jobs of the manifest (pattern, exposure start, length, iterations, output dir\n"
+                "                               per line), as many at a time as fit, sharing the scene, pinned to their own cpus\n"
+                "  --sweep-concurrent <n>       sweep: at most n jobs at a time (default 0 - as many as fit into memory and cpus)\n"
+                "  --ranks <n>                  split the scene in z between n processes on this machine (Linux)\n"
+                "  --mpi                        split the scene in z between the MPI ranks (WAVES_MPI builds, under mpirun)\n"
+                "  --output <dir>               output folder for pictures and stats (default .)\n"
+                "  --stats-every <n>            append a stats row every n iterations (default 100)\n"
+                "  --slice-every <n>            save the mid slice as png every n iterations (default 0 - never)\n"
+                "  --perf-counters              sample hardware counters around the stencil (Linux perf_event_open)\n"
+                "  --trace <file.json>          write a Chrome trace timeline at exit (needs a WAVES_TRACE build)\n"
+                "                               (not with --sweep or --autotune)\n"
+                "  --kernel <name>              stencil kernel variant (default reference, or the tuning profile's)\n"
+                "  --multirate                  step the VEL_FACTOR2 material at half the rate, in place of --kernel\n"
+                "                               (in-memory runs and sweeps with the sponge boundary)\n"
+                "  --reductions-every <n>       field energy / max / plane RMS every n iterations (default 10, 0 - off)\n"
+                "  --golden-write <file>        run the golden scenes with --kernel and store the results\n"
+                "  --golden-check <file>        run the golden scenes with --kernel and compare against the file\n"
+                "  --samples <dir>              folder with the golden scene patterns (default samples)\n"
+                "  --autotune                   time the kernels and thread counts on a reduced --size grid, store the\n"
+                "                               fastest into the tuning profile\n"
+                "  --tuning-profile <file>|off  tuning profile to use and update (default waves_tuning_<host>.txt)\n";
         }
 
+#if defined(_WIN32)
         bool parse_command_line(LPWSTR lpszCmdLine)
         {
             if (wcscmp(lpszCmdLine, L"") == 0)
@@ -55,29 +166,237 @@ namespace waves
             int argc;
             LPWSTR* argv = CommandLineToArgvW(lpszCmdLine, &argc);
 
-            uint64_t report_every_n_seconds = 1000;
-            uint64_t duration = 0; // infinite 
-
+            std::vector<std::string> args;
             for (int idx = 0; idx < argc; idx++)
             {
-                if (wcscmp(argv[idx], L"--scene") == 0 && (idx + 1) < argc)
-                {
-                    _scene = std::stoi(std::wstring{ argv[idx + 1] });
-                    idx++;
-                }
-                else if (wcscmp(argv[idx], L"--auto-start") == 0)
-                {
-                    _auto_start = true;
-                }
-                else
+                args.push_back(wcs2mbs(argv[idx]));
+            }
+
+            ::LocalFree(argv);
+
+            return parse_args(args);
+        }
+#endif
+
+        // argv[0] is the program name, as passed to main()
+        bool parse_command_line(int argc, char** argv)
+        {
+            std::vector<std::string> args;
+            for (int idx = 1; idx < argc; idx++)
+            {
+                args.push_back(argv[idx]);
+            }
+
+            return parse_args(args);
+        }
+
+        bool parse_args(const std::vector<std::string>& args)
+        {
+            const int argc = static_cast<int>(args.size());
+
+            try
+            {
+                for (int idx = 0; idx < argc; idx++)
                 {
-                    return false;
+                    const auto& arg = args[idx];
+                    const bool has_value = (idx + 1) < argc;
+
+                    if (arg == "--scene" && has_value)
+                    {
+                        _scene = std::stoi(args[++idx]);
+                    }
+                    else if (arg == "--auto-start")
+                    {
+                        _auto_start = true;
+                    }
+                    else if (arg == "--record-format" && has_value)
+                    {
+                        const auto& fmt = args[++idx];
+                        if (fmt == "png")
+                            _record_format = record_format::png;
+                        else if (fmt == "y4m")
+                            _record_format = record_format::y4m;
+                        else if (fmt == "rle")
+                            _record_format = record_format::delta_rle;
+                        else
+                            return false;
+                    }
+                    else if (arg == "--pattern" && has_value)
+                    {
+                        _pattern_file = args[++idx];
+                    }
+                    else if (arg == "--ensemble" && has_value)
+                    {
+                        _ensemble_patterns.push_back(args[++idx]);
+                    }
+                    else if (arg == "--iterations" && has_value)
+                    {
+                        _iterations = std::stoull(args[++idx]);
+                    }
+                    else if (arg == "--exposure" && has_value)
+                    {
+                        const auto& value = args[++idx];
+                        const auto sep = value.find(':');
+                        if (sep == std::string::npos)
+                            return false;
+
+                        _exposures.push_back({ std::stoull(value.substr(0, sep)), std::stoull(value.substr(sep + 1)) });
+                    }
+                    else if (arg == "--exposure-tolerance" && has_value)
+                    {
+                        _exposure_tolerance = std::stod(args[++idx]);
+                        if (_exposure_tolerance < 0)
+                            return false;
+                    }
+                    else if (arg == "--threads" && has_value)
+                    {
+                        _threads = std::stoi(args[++idx]);
+                        if (_threads <= 0)
+                            return false;
+                        _threads_given = true;
+                    }
+                    else if (arg == "--size" && has_value)
+                    {
+                        if (!parse_size(args[++idx], _medium_size))
+                            return false;
+                    }
+                    else if (arg == "--huge-pages" && has_value)
+                    {
+                        if (!PageAllocator::parse(args[++idx], _huge_pages))
+                            return false;
+                    }
+                    else if (arg == "--boundary" && has_value)
+                    {
+                        if (!PmlBoundary::parse(args[++idx], _boundary))
+                            return false;
+                    }
+                    else if (arg == "--out-of-core" && has_value)
+                    {
+                        _out_of_core_folder = args[++idx];
+                    }
+                    else if (arg == "--slab-planes" && has_value)
+                    {
+                        _slab_planes = std::stoi(args[++idx]);
+                        if (_slab_planes <= 0)
+                            return false;
+                    }
+                    else if (arg == "--steps-per-pass" && has_value)
+                    {
+                        _steps_per_pass = std::stoi(args[++idx]);
+                        if (_steps_per_pass <= 0)
+                            return false;
+                    }
+                    else if (arg == "--sweep" && has_value)
+                    {
+                        _sweep_manifest = args[++idx];
+                    }
+                    else if (arg == "--sweep-concurrent" && has_value)
+                    {
+                        _sweep_concurrent = std::stoi(args[++idx]);
+                        if (_sweep_concurrent < 0)
+                            return false;
+                    }
+                    else if (arg == "--ranks" && has_value)
+                    {
+                        _ranks = std::stoi(args[++idx]);
+                        if (_ranks <= 0)
+                            return false;
+                    }
+                    else if (arg == "--mpi")
+                    {
+                        _mpi = true;
+                    }
+                    else if (arg == "--output" && has_value)
+                    {
+                        _output_folder = args[++idx];
+                    }
+                    else if (arg == "--stats-every" && has_value)
+                    {
+                        _stats_every = std::stoull(args[++idx]);
+                    }
+                    else if (arg == "--slice-every" && has_value)
+                    {
+                        _slice_every = std::stoull(args[++idx]);
+                    }
+                    else if (arg == "--perf-counters")
+                    {
+                        _perf_counters = true;
+                    }
+                    else if (arg == "--trace" && has_value)
+                    {
+                        _trace_file = args[++idx];
+                    }
+                    else if (arg == "--kernel" && has_value)
+                    {
+                        _kernel = args[++idx];
+                        _kernel_given = true;
+                    }
+                    else if (arg == "--multirate")
+                    {
+                        _multirate = true;
+                    }
+                    else if (arg == "--reductions-every" && has_value)
+                    {
+                        _reductions_every = std::stoull(args[++idx]);
+                    }
+                    else if (arg == "--golden-write" && has_value)
+                    {
+                        _golden_write_file = args[++idx];
+                    }
+                    else if (arg == "--golden-check" && has_value)
+                    {
+                        _golden_check_file = args[++idx];
+                    }
+                    else if (arg == "--samples" && has_value)
+                    {
+                        _samples_folder = args[++idx];
+                    }
+                    else if (arg == "--autotune")
+                    {
+                        _autotune = true;
+                    }
+                    else if (arg == "--tuning-profile" && has_value)
+                    {
+                        _tuning_profile = args[++idx];
+                    }
+                    else
+                    {
+                        return false;
+                    }
                 }
             }
+            catch (const std::exception&)
+            {
+                return false;
+            }
 
             return true;
         }
 
+        // the settings of a tuning profile, for those not given on the command line
+        void use_tuned(const std::string& kernel, int threads)
+        {
+            if (!_kernel_given)
+                _kernel = kernel;
+            if (!_threads_given && threads > 0)
+                _threads = threads;
+        }
+
+        // <w>x<h>x<d>, all positive
+        static bool parse_size(const std::string& value, MediumSize& size)
+        {
+            const auto x1 = value.find('x');
+            const auto x2 = x1 != std::string::npos ? value.find('x', x1 + 1) : std::string::npos;
+            if (x2 == std::string::npos)
+                return false;
+
+            size.width = std::stoi(value.substr(0, x1));
+            size.height = std::stoi(value.substr(x1 + 1, x2 - x1 - 1));
+            size.depth = std::stoi(value.substr(x2 + 1));
+
+            return size.width > 0 && size.height > 0 && size.depth > 0;
+        }
+
         inline bool auto_star() const noexcept
         {
             return _auto_start;
@@ -87,6 +406,166 @@ namespace waves
         {
             return _scene;
         }
+
+        inline record_format recording_format() const noexcept
+        {
+            return _record_format;
+        }
+
+        inline const std::string& pattern_file() const noexcept
+        {
+            return _pattern_file;
+        }
+
+        inline const std::vector<std::string>& ensemble_patterns() const noexcept
+        {
+            return _ensemble_patterns;
+        }
+
+        inline uint64_t iterations() const noexcept
+        {
+            return _iterations;
+        }
+
+        inline const std::vector<exposure_schedule_item>& exposures() const noexcept
+        {
+            return _exposures;
+        }
+
+        inline double exposure_tolerance() const noexcept
+        {
+            return _exposure_tolerance;
+        }
+
+        inline int threads() const noexcept
+        {
+            return _threads;
+        }
+
+        inline bool threads_given() const noexcept
+        {
+            return _threads_given;
+        }
+
+        inline const MediumSize& medium_size() const noexcept
+        {
+            return _medium_size;
+        }
+
+        inline huge_pages huge_page_mode() const noexcept
+        {
+            return _huge_pages;
+        }
+
+        inline boundary_kind boundary() const noexcept
+        {
+            return _boundary;
+        }
+
+        inline const std::string& out_of_core_folder() const noexcept
+        {
+            return _out_of_core_folder;
+        }
+
+        inline int slab_planes() const noexcept
+        {
+            return _slab_planes;
+        }
+
+        inline int steps_per_pass() const noexcept
+        {
+            return _steps_per_pass;
+        }
+
+        inline const std::string& sweep_manifest() const noexcept
+        {
+            return _sweep_manifest;
+        }
+
+        inline int sweep_concurrent() const noexcept
+        {
+            return _sweep_concurrent;
+        }
+
+        inline int ranks() const noexcept
+        {
+            return _ranks;
+        }
+
+        inline bool mpi() const noexcept
+        {
+            return _mpi;
+        }
+
+        inline const std::string& output_folder() const noexcept
+        {
+            return _output_folder;
+        }
+
+        inline uint64_t stats_every() const noexcept
+        {
+            return _stats_every;
+        }
+
+        inline uint64_t slice_every() const noexcept
+        {
+            return _slice_every;
+        }
+
+        inline bool perf_counters() const noexcept
+        {
+            return _perf_counters;
+        }
+
+        inline const std::string& trace_file() const noexcept
+        {
+            return _trace_file;
+        }
+
+        inline const std::string& kernel() const noexcept
+        {
+            return _kernel;
+        }
+
+        inline bool kernel_given() const noexcept
+        {
+            return _kernel_given;
+        }
+
+        inline bool multirate() const noexcept
+        {
+            return _multirate;
+        }
+
+        inline uint64_t reductions_every() const noexcept
+        {
+            return _reductions_every;
+        }
+
+        inline const std::string& golden_write_file() const noexcept
+        {
+            return _golden_write_file;
+        }
+
+        inline const std::string& golden_check_file() const noexcept
+        {
+            return _golden_check_file;
+        }
+
+        inline const std::string& samples_folder() const noexcept
+        {
+            return _samples_folder;
+        }
+
+        inline bool autotune() const noexcept
+        {
+            return _autotune;
+        }
+
+        inline const std::string& tuning_profile() const noexcept
+        {
+            return _tuning_profile;
+        }
     };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include <immintrin.h>
+
+#include "ThreadGrid.h"
+
+namespace waves
+{
+	//
+	// CPU-side renderer of a single z-slice of the medium into an RGBA buffer.
+	//
+	// The colour mapping is identical to the one WorldView used to draw voxel by voxel:
+	//  r = brightness_p, g = max(0, 3*brightness_p - 2), b = brightness_n, empty voxels are dark yellow.
+	// Output is width() x height() pixels, one uint32_t per pixel with bytes in R,G,B,A order,
+	// rows are bottom-up (row 0 is y = 0), i.e. the same order glReadPixels returns.
+	//
+	class SliceRenderer
+	{
+		static constexpr float BRIGHTNESS_SCALE = 1.0f / 1000.0f;
+		static constexpr uint32_t EMPTY_COLOR = 0xff008080u; // glColor3f(0.5f, 0.5f, 0.0f)
+
+	public:
+		template <typename TMedium>
+		static void render(const TMedium& medium, int z, uint32_t* rgba, ThreadGrid& grid) noexcept
+		{
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					const int rows_per_thread = (medium.height() + num_threads - 1) / num_threads;
+					const int from = thread_idx * rows_per_thread;
+					const int to = std::min(medium.height(), from + rows_per_thread);
+
+					for (int y = from; y < to; ++y)
+					{
+						render_row(&medium.at(0, y, z), medium.width(), rgba + y * medium.width());
+					}
+				});
+		}
+
+		template <typename TMedium>
+		static void render(const TMedium& medium, int z, std::vector<uint32_t>& rgba, ThreadGrid& grid) noexcept
+		{
+			rgba.resize(static_cast<size_t>(medium.width()) * medium.height());
+			render(medium, z, rgba.data(), grid);
+		}
+
+		template <typename TItem>
+		static void render_row(const TItem* items, int width, uint32_t* dst) noexcept
+		{
+			int x = 0;
+
+#if defined(AVX2)
+			const __m256 scale = _mm256_set1_ps(BRIGHTNESS_SCALE);
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 one = _mm256_set1_ps(1.0f);
+			const __m256 three = _mm256_set1_ps(3.0f);
+			const __m256 two = _mm256_set1_ps(2.0f);
+			const __m256 quarter = _mm256_set1_ps(0.25f);
+			const __m256 to_byte = _mm256_set1_ps(255.0f);
+			const __m256 half = _mm256_set1_ps(0.5f);
+			const __m256i alpha = _mm256_set1_epi32(0xff000000);
+			const __m256i empty_color = _mm256_set1_epi32(static_cast<int>(EMPTY_COLOR));
+
+			for (; x + 8 <= width; x += 8)
+			{
+				// 8 items are 16 interleaved floats: l0 v0 l1 v1 ... l7 v7
+				const __m256 a = _mm256_loadu_ps(&items[x].location);
+				const __m256 b = _mm256_loadu_ps(&items[x + 4].location);
+
+				// shuffle gives l0 l1 l4 l5 | l2 l3 l6 l7, permute restores the natural order
+				const __m256 loc = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, 0x88)), 0xd8));
+				const __m256 vel = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, 0xdd)), 0xd8));
+
+				const __m256 v = _mm256_mul_ps(loc, scale);
+				const __m256 brightness_p = _mm256_min_ps(one, _mm256_max_ps(zero, v));
+				const __m256 brightness_n = _mm256_mul_ps(_mm256_min_ps(one, _mm256_max_ps(zero, _mm256_sub_ps(zero, v))), quarter);
+				const __m256 green = _mm256_max_ps(zero, _mm256_sub_ps(_mm256_mul_ps(three, brightness_p), two));
+
+				// + 0.5 and truncate, like to_byte()
+				const __m256i r = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(brightness_p, to_byte), half));
+				const __m256i g = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(green, to_byte), half));
+				const __m256i bl = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(brightness_n, to_byte), half));
+
+				const __m256i color = _mm256_or_si256(
+					_mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+					_mm256_or_si256(_mm256_slli_epi32(bl, 16), alpha));
+
+				const __m256 empty = _mm256_and_ps(_mm256_cmp_ps(loc, zero, _CMP_EQ_OQ), _mm256_cmp_ps(vel, zero, _CMP_EQ_OQ));
+
+				_mm256_storeu_si256(
+					reinterpret_cast<__m256i*>(dst + x),
+					_mm256_blendv_epi8(color, empty_color, _mm256_castps_si256(empty)));
+			}
+#endif
+			for (; x < width; ++x)
+			{
+				dst[x] = color_for(items[x]);
+			}
+		}
+
+		template <typename TItem>
+		static uint32_t color_for(const TItem& item) noexcept
+		{
+			if (item.location == 0 && item.velocity == 0)
+				return EMPTY_COLOR;
+
+			const float v = item.location * BRIGHTNESS_SCALE;
+
+			const float brightness_p = std::max(0.0f, std::min(1.0f, v));
+			const float brightness_n = std::max(0.0f, std::min(1.0f, -v)) / 4.0f;
+			const float green = std::max(0.0f, 3.0f * brightness_p - 2.0f);
+
+			return to_byte(brightness_p) | (to_byte(green) << 8) | (to_byte(brightness_n) << 16) | 0xff000000u;
+		}
+
+	private:
+		static uint32_t to_byte(float v) noexcept
+		{
+			return static_cast<uint32_t>(v * 255.0f + 0.5f);
+		}
+	};
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+
+#include <GL/gl.h>			/* OpenGL header file */
+
+#if !defined(_WIN32)
+#include <GL/glx.h>
+#endif
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_WRITE_ONLY
+#define GL_WRITE_ONLY 0x88B9
+#endif
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+namespace waves
+{
+	//
+	// A single RGBA texture holding the colour-mapped slice, drawn as one quad.
+	//
+	// The frame is uploaded with glTexSubImage2D. When pixel buffer objects are available
+	// (GL 2.1 / ARB_pixel_buffer_object) the producer writes straight into a mapped PBO,
+	// so the driver can DMA the data without an extra copy or a pipeline stall.
+	//
+	// The slice isn't a power of two in size, so the texture needs GL 2.0 / ARB_texture_non_power_of_two.
+	// Without it the frame stays in memory and is drawn with glDrawPixels, zoomed to the rect.
+	//
+	class SliceTexture
+	{
+		using PFN_GenBuffers = void (APIENTRY*)(GLsizei, GLuint*);
+		using PFN_DeleteBuffers = void (APIENTRY*)(GLsizei, const GLuint*);
+		using PFN_BindBuffer = void (APIENTRY*)(GLenum, GLuint);
+		using PFN_BufferData = void (APIENTRY*)(GLenum, ptrdiff_t, const void*, GLenum);
+		using PFN_MapBuffer = void* (APIENTRY*)(GLenum, GLenum);
+		using PFN_UnmapBuffer = GLboolean(APIENTRY*)(GLenum);
+
+		PFN_GenBuffers _glGenBuffers{ nullptr };
+		PFN_DeleteBuffers _glDeleteBuffers{ nullptr };
+		PFN_BindBuffer _glBindBuffer{ nullptr };
+		PFN_BufferData _glBufferData{ nullptr };
+		PFN_MapBuffer _glMapBuffer{ nullptr };
+		PFN_UnmapBuffer _glUnmapBuffer{ nullptr };
+
+		bool _initialized{ false };
+		bool _useTexture{ false };
+		bool _usePbo{ false };
+
+		GLuint _texture{ 0 };
+		GLuint _pbo{ 0 };
+
+		int _width{ 0 };
+		int _height{ 0 };
+
+		std::vector<uint32_t> _fallback;
+
+	public:
+		SliceTexture() = default;
+
+		SliceTexture(const SliceTexture&) = delete;
+		SliceTexture& operator=(const SliceTexture&) = delete;
+
+		~SliceTexture()
+		{
+			// the GL context might be gone already by now, leave the cleanup to the context destruction
+		}
+
+		bool using_pbo() const noexcept { return _usePbo; }
+
+		bool using_texture() const noexcept { return _useTexture; }
+
+		//
+		// Calls producer(uint32_t* rgba) to fill width x height pixels (rows bottom-up) and uploads the result
+		//
+		template <typename TProducer>
+		void Update(int width, int height, TProducer&& producer) noexcept
+		{
+			if (!_initialized)
+				Initialize();
+
+			if (width != _width || height != _height)
+				Allocate(width, height);
+
+			if (!_useTexture)
+			{
+				producer(_fallback.data());
+				return;
+			}
+
+			glBindTexture(GL_TEXTURE_2D, _texture);
+
+			const size_t bytes = static_cast<size_t>(_width) * _height * sizeof(uint32_t);
+
+			uint32_t* dst = nullptr;
+			if (_usePbo)
+			{
+				_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+				// orphan the previous storage, so we never wait for the previous upload to finish
+				_glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+				dst = static_cast<uint32_t*>(_glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+			}
+
+			if (dst != nullptr)
+			{
+				producer(dst);
+				_glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+				_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+			else
+			{
+				if (_usePbo)
+					_glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+				producer(_fallback.data());
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, _fallback.data());
+			}
+
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+
+		// Draws the texture over the rect (x0, y0) - (x1, y1) in the current model-view coordinates
+		void DrawAt(float x0, float y0, float x1, float y1) noexcept
+		{
+			if (!_useTexture)
+			{
+				DrawPixelsAt(x0, y0, x1, y1);
+				return;
+			}
+
+			if (_texture == 0)
+				return;
+
+			glEnable(GL_TEXTURE_2D);
+			glBindTexture(GL_TEXTURE_2D, _texture);
+			glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+
+			glBegin(GL_QUADS);
+			glTexCoord2f(0.0f, 0.0f); glVertex2f(x0, y0);
+			glTexCoord2f(1.0f, 0.0f); glVertex2f(x1, y0);
+			glTexCoord2f(1.0f, 1.0f); glVertex2f(x1, y1);
+			glTexCoord2f(0.0f, 1.0f); glVertex2f(x0, y1);
+			glEnd();
+
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glDisable(GL_TEXTURE_2D);
+		}
+
+	private:
+		void DrawPixelsAt(float x0, float y0, float x1, float y1) noexcept
+		{
+			if (_width == 0 || _height == 0)
+				return;
+
+			float wx0, wy0, wx1, wy1;
+			ToWindow(x0, y0, wx0, wy0);
+			ToWindow(x1, y1, wx1, wy1);
+
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glRasterPos2f(x0, y0);
+			glPixelZoom((wx1 - wx0) / _width, (wy1 - wy0) / _height);
+			glDrawPixels(_width, _height, GL_RGBA, GL_UNSIGNED_BYTE, _fallback.data());
+			glPixelZoom(1.f, 1.f);
+		}
+
+		// window coordinates of a point in the current model-view coordinates, z = 0
+		static void ToWindow(float x, float y, float& wx, float& wy) noexcept
+		{
+			GLfloat mv[16], proj[16];
+			GLint viewport[4];
+			glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+			glGetFloatv(GL_PROJECTION_MATRIX, proj);
+			glGetIntegerv(GL_VIEWPORT, viewport);
+
+			// the matrices are column major
+			float eye[4];
+			for (int r = 0; r < 4; ++r)
+				eye[r] = mv[r] * x + mv[4 + r] * y + mv[12 + r];
+
+			float clip[4];
+			for (int r = 0; r < 4; ++r)
+				clip[r] = proj[r] * eye[0] + proj[4 + r] * eye[1] + proj[8 + r] * eye[2] + proj[12 + r] * eye[3];
+
+			const float w = clip[3] != 0.0f ? clip[3] : 1.0f;
+			wx = viewport[0] + (clip[0] / w + 1.0f) * 0.5f * viewport[2];
+			wy = viewport[1] + (clip[1] / w + 1.0f) * 0.5f * viewport[3];
+		}
+
+		template <typename TProc>
+		static TProc LoadProc(const char* name, const char* arb_name) noexcept
+		{
+#if defined(_WIN32)
+			auto proc = reinterpret_cast<TProc>(::wglGetProcAddress(name));
+			if (proc == nullptr)
+				proc = reinterpret_cast<TProc>(::wglGetProcAddress(arb_name));
+#else
+			auto proc = reinterpret_cast<TProc>(::glXGetProcAddressARB(reinterpret_cast<const GLubyte*>(name)));
+			if (proc == nullptr)
+				proc = reinterpret_cast<TProc>(::glXGetProcAddressARB(reinterpret_cast<const GLubyte*>(arb_name)));
+#endif
+			return proc;
+		}
+
+		void Initialize() noexcept
+		{
+			_initialized = true;
+
+			const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+			const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+
+			_useTexture =
+				(extensions != nullptr && std::strstr(extensions, "GL_ARB_texture_non_power_of_two") != nullptr) ||
+				(version != nullptr && version[0] >= '2');
+
+			if (!_useTexture)
+				return;
+
+			const bool has_pbo =
+				(extensions != nullptr && std::strstr(extensions, "GL_ARB_pixel_buffer_object") != nullptr) ||
+				(version != nullptr && (version[0] > '2' || (version[0] == '2' && version[2] >= '1')));
+
+			if (has_pbo)
+			{
+				_glGenBuffers = LoadProc<PFN_GenBuffers>("glGenBuffers", "glGenBuffersARB");
+				_glDeleteBuffers = LoadProc<PFN_DeleteBuffers>("glDeleteBuffers", "glDeleteBuffersARB");
+				_glBindBuffer = LoadProc<PFN_BindBuffer>("glBindBuffer", "glBindBufferARB");
+				_glBufferData = LoadProc<PFN_BufferData>("glBufferData", "glBufferDataARB");
+				_glMapBuffer = LoadProc<PFN_MapBuffer>("glMapBuffer", "glMapBufferARB");
+				_glUnmapBuffer = LoadProc<PFN_UnmapBuffer>("glUnmapBuffer", "glUnmapBufferARB");
+
+				_usePbo = _glGenBuffers && _glDeleteBuffers && _glBindBuffer && _glBufferData && _glMapBuffer && _glUnmapBuffer;
+			}
+
+			if (_usePbo)
+				_glGenBuffers(1, &_pbo);
+
+			glGenTextures(1, &_texture);
+		}
+
+		void Allocate(int width, int height) noexcept
+		{
+			_width = width;
+			_height = height;
+			_fallback.resize(static_cast<size_t>(width) * height);
+
+			if (!_useTexture)
+				return;
+
+			glBindTexture(GL_TEXTURE_2D, _texture);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+	};
+}
@@ -0,0 +1,609 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#if defined(AVX2)
+#include <immintrin.h>
+#endif
+
+#include "Medium.h"
+#include "ThreadGrid.h"
+
+namespace waves
+{
+	//
+	// Whole-field statistics of one state - the one a step starts from, after the source fill:
+	//   energy - sum of 0.5 * v^2 (kinetic) + 0.5 * k * (x - avg(neighbours))^2 (potential, the state's own neighbours)
+	//   max_abs_location - max |x|
+	//   plane_sq_location[x] - sum of x^2 over the y/z plane, see plane_rms()
+	// Voxels with zero conductivity aren't updated and don't contribute. The fused kernels (run_reducing) and
+	// the separate reduce() pass compute the same.
+	//
+	struct FieldReductions
+	{
+		uint64_t iteration{ 0 };	// the step which started from the state
+		double energy{ 0 };
+		float max_abs_location{ 0 };
+		std::vector<double> plane_sq_location;
+		int plane_voxels{ 0 };		// height * depth
+
+		void reset(int width, int plane_size)
+		{
+			energy = 0;
+			max_abs_location = 0;
+			plane_sq_location.assign(width, 0.0);
+			plane_voxels = plane_size;
+		}
+
+		void combine(const FieldReductions& partial)
+		{
+			energy += partial.energy;
+			max_abs_location = std::max(max_abs_location, partial.max_abs_location);
+			for (size_t x = 0; x < plane_sq_location.size(); ++x)
+				plane_sq_location[x] += partial.plane_sq_location[x];
+		}
+
+		double plane_rms(int x) const noexcept
+		{
+			return plane_voxels != 0 ? std::sqrt(plane_sq_location[x] / plane_voxels) : 0.0;
+		}
+	};
+
+	//
+	// A named whole-medium kernel, current -> next. Variants are interchangeable in World and the benchmarks,
+	// and must reproduce the reference results within the golden tolerance (Golden.h).
+	//
+	template <typename TMedium, typename TMediumStatic>
+	struct StencilKernelVariant
+	{
+		const char* name;
+
+		// DRAM bytes per voxel update: item read + static read + item write (+ read-for-ownership of the written line)
+		double bytes_per_voxel;
+
+		void (*run)(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid);
+
+		// run() of the planes z_from..z_to only, the rest of next is left as it is
+		void (*run_planes)(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid, int z_from, int z_to);
+
+		// same step, also computing FieldReductions on the way; nullptr if the variant can't,
+		// World then follows up with a separate StencilKernel::reduce() pass
+		void (*run_reducing)(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid, FieldReductions& out);
+	};
+
+	//
+	// The 7-point wave update, shared by World and the benchmarks.
+	//
+	// For every voxel with non-zero conductivity:
+	//   v' = (v - k * (x - avg(neighbours))) * conductivity / 127 * 0.99999
+	//   x' = x + v' * dT
+	// where k is VEL_FACTOR1 or VEL_FACTOR2 depending on ItemStatic::velocity_bit.
+	//
+	struct StencilKernel
+	{
+		static constexpr float VEL_FACTOR1 = 0.40f; // dV = -k*x/m * dT, this is k*dT/m
+		static constexpr float VEL_FACTOR2 = 0.2f; // 0.13; // dV = -k*x/m * dT, this is k*dT/m
+		static constexpr float LOC_FACTOR = 0.1f; // dX = V * dT, this is dT
+
+		// z-slab of the given thread, covers the whole depth even if it doesn't divide by num_threads
+		static constexpr void slab_for(int depth, int thread_idx, int num_threads, int& from, int& to) noexcept
+		{
+			from = static_cast<int>(static_cast<int64_t>(depth) * thread_idx / num_threads);
+			to = static_cast<int>(static_cast<int64_t>(depth) * (thread_idx + 1) / num_threads);
+		}
+
+		// Zero-fills a medium constructed uninitialized, every worker writing the planes of its own slab, so the
+		// pages are first touched - and placed on a NUMA node - by the thread which updates them later.
+		// The guard planes go with the first and the last slab.
+		template <typename TMedium>
+		static void first_touch(TMedium& medium, ThreadGrid& grid) noexcept
+		{
+			using TItem = std::remove_reference_t<decltype(medium.data[0])>;
+
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(medium.depth(), thread_idx, num_threads, from, to);
+
+					const size_t plane = static_cast<size_t>(medium.plane_stride);
+					const size_t begin = thread_idx == 0 ? 0 : (from + TMedium::D_GUARD) * plane;
+					const size_t end = thread_idx == num_threads - 1 ? medium.data.size() : (to + TMedium::D_GUARD) * plane;
+
+					std::fill(medium.data.begin() + begin, medium.data.begin() + end, TItem{});
+				}
+				);
+		}
+
+#pragma warning(push)
+#pragma warning(disable:26451)
+		template <typename TMedium, typename TMediumStatic, bool REDUCE = false>
+		static void run_slab(const TMedium& current, TMedium& next, const TMediumStatic& statics, int z_from, int z_to, FieldReductions* partial = nullptr) noexcept
+		{
+			double energy = 0.0;
+			float max_abs_location = 0.0f;
+			double* plane_sq = REDUCE ? partial->plane_sq_location.data() : nullptr;
+
+			// constants for a Medium, loaded strides for a RuntimeMedium
+			const int xd_neighbour = current.offset_for(-1, 0, 0) - current.offset_for(0, 0, 0);
+			const int xu_neighbour = current.offset_for(1, 0, 0) - current.offset_for(0, 0, 0);
+
+			const int yd_neighbour = current.offset_for(0, -1, 0) - current.offset_for(0, 0, 0);
+			const int yu_neighbour = current.offset_for(0, 1, 0) - current.offset_for(0, 0, 0);
+
+			const int zd_neighbour = current.offset_for(0, 0, -1) - current.offset_for(0, 0, 0);
+			const int zu_neighbour = current.offset_for(0, 0, 1) - current.offset_for(0, 0, 0);
+
+			const int width = current.width();
+			const int height = current.height();
+
+			for (int z = z_from; z < z_to; ++z)
+			{
+				for (int y = 0; y < height; ++ y)
+				{
+					float row_energy = 0.0f; // the row sum is short enough for float, the total isn't
+
+					const int row = current.offset_for(0, y, z);
+
+					for (int x = 0; x < width; ++x)
+					{
+						const int offset = row + x;
+						const auto item_static = statics.data[offset];
+
+						if (item_static.conductivity == 0)
+							continue;
+
+						const float neigh_total =
+							current.data[offset + xd_neighbour].location +
+							current.data[offset + xu_neighbour].location +
+							current.data[offset + yd_neighbour].location +
+							current.data[offset + yu_neighbour].location +
+							current.data[offset + zd_neighbour].location +
+							current.data[offset + zu_neighbour].location;
+
+						const float neight_average = neigh_total * (1.0f / 6.0f);
+
+						const float delta_x = current.data[offset].location - neight_average; // location relative to the current neightbour average
+
+						const float velolicty_factor = item_static.velocity_bit ? VEL_FACTOR2 : VEL_FACTOR1;
+						const float conductivity_factor = static_cast<float>(item_static.conductivity) / 127.0f;
+
+						const float new_velocity = (current.data[offset].velocity - velolicty_factor * delta_x) * conductivity_factor * 0.99999f;
+
+						const float new_location = current.data[offset].location + new_velocity * LOC_FACTOR;
+
+						next.data[offset].location = new_location;
+						next.data[offset].velocity = new_velocity;
+
+						if constexpr (REDUCE)
+						{
+							const float velocity = current.data[offset].velocity;
+							const float location = current.data[offset].location;
+							row_energy += 0.5f * (velocity * velocity + velolicty_factor * delta_x * delta_x);
+							max_abs_location = std::max(max_abs_location, std::abs(location));
+							plane_sq[x] += location * location;
+						}
+					}
+
+					if constexpr (REDUCE)
+						energy += row_energy;
+				}
+			}
+
+			if constexpr (REDUCE)
+			{
+				partial->energy = energy;
+				partial->max_abs_location = max_abs_location;
+			}
+		}
+#pragma warning(pop)
+
+		// One full time step current -> next on the grid
+		template <typename TMedium, typename TMediumStatic>
+		static void run(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid) noexcept
+		{
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(current.depth(), thread_idx, num_threads, from, to);
+					run_slab(current, next, statics, from, to);
+				}
+				);
+		}
+
+		// One time step of the planes z_from..z_to, e.g. the boundary planes of a DistributedWorld rank ahead of its interior
+		template <typename TMedium, typename TMediumStatic>
+		static void run_planes(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid, int z_from, int z_to) noexcept
+		{
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(z_to - z_from, thread_idx, num_threads, from, to);
+					run_slab(current, next, statics, z_from + from, z_from + to);
+				}
+				);
+		}
+
+		// One time step, the reductions of the state it starts from are combined at the GridRun barrier
+		template <typename TMedium, typename TMediumStatic>
+		static void run_reducing(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid, FieldReductions& out)
+		{
+			std::vector<FieldReductions> partials(grid.NumThreads());
+			for (auto& partial : partials)
+				partial.reset(current.width(), current.height() * current.depth());
+
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(current.depth(), thread_idx, num_threads, from, to);
+					run_slab<TMedium, TMediumStatic, true>(current, next, statics, from, to, &partials[thread_idx]);
+				}
+				);
+
+			out.reset(current.width(), current.height() * current.depth());
+			for (const auto& partial : partials)
+				out.combine(partial);
+		}
+
+		//
+		// Multi-rate stepping. The VEL_FACTOR2 material is half as stiff, so its voxels take a step of 2 dT
+		// every second iteration while the rest steps every iteration:
+		//
+		//   slow step:  v' = (v - 2k * (x - avg(neighbours))) * (conductivity / 127 * 0.99999)^2,  x' = x + v' * dT
+		//   drift:      v' = v,  x' = x + v' * dT
+		//
+		// After the pair x has moved by 2 dT * v', and in between it is half way - the value the full rate
+		// voxels next to the material boundary read. The slow step reads its full rate neighbours as they are
+		// at its start. The drift reads one item and writes one, no neighbours and no statics.
+		//
+		// Which voxels step at half the rate is the velocity_bit run at the end of each row, see
+		// multirate_splits(): split[z * height + y] is the first x of it, width if the row has none.
+		//
+		template <typename TMediumStatic>
+		static std::vector<int> multirate_splits(const TMediumStatic& statics, ThreadGrid& grid)
+		{
+			std::vector<int> ret(static_cast<size_t>(statics.height()) * statics.depth());
+
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(statics.depth(), thread_idx, num_threads, from, to);
+
+					for (int z = from; z < to; ++z)
+					{
+						for (int y = 0; y < statics.height(); ++y)
+						{
+							int x = statics.width();
+							while (x > 0 && statics.at(x - 1, y, z).velocity_bit)
+								--x;
+							ret[static_cast<size_t>(z) * statics.height() + y] = x;
+						}
+					}
+				}
+				);
+
+			return ret;
+		}
+
+		// One iteration current -> next with the rows split at split, slow_step on the first iteration of each pair
+		template <typename TMedium, typename TMediumStatic>
+		static void run_multirate(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid, const std::vector<int>& split, bool slow_step) noexcept
+		{
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(current.depth(), thread_idx, num_threads, from, to);
+					run_slab_multirate(current, next, statics, from, to, split, slow_step);
+				}
+				);
+		}
+
+#pragma warning(push)
+#pragma warning(disable:26451)
+		template <typename TMedium, typename TMediumStatic>
+		static void run_slab_multirate(const TMedium& current, TMedium& next, const TMediumStatic& statics, int z_from, int z_to, const std::vector<int>& split, bool slow_step) noexcept
+		{
+			const int xd_neighbour = current.offset_for(-1, 0, 0) - current.offset_for(0, 0, 0);
+			const int xu_neighbour = current.offset_for(1, 0, 0) - current.offset_for(0, 0, 0);
+
+			const int yd_neighbour = current.offset_for(0, -1, 0) - current.offset_for(0, 0, 0);
+			const int yu_neighbour = current.offset_for(0, 1, 0) - current.offset_for(0, 0, 0);
+
+			const int zd_neighbour = current.offset_for(0, 0, -1) - current.offset_for(0, 0, 0);
+			const int zu_neighbour = current.offset_for(0, 0, 1) - current.offset_for(0, 0, 0);
+
+			const int width = current.width();
+			const int height = current.height();
+
+			for (int z = z_from; z < z_to; ++z)
+			{
+				for (int y = 0; y < height; ++y)
+				{
+					const int row = current.offset_for(0, y, z);
+					const int row_split = split[static_cast<size_t>(z) * height + y];
+
+					// full rate up to the split, then either the slow step or the drift
+					const int stencil_to = slow_step ? width : row_split;
+
+					for (int x = 0; x < stencil_to; ++x)
+					{
+						const int offset = row + x;
+						const auto item_static = statics.data[offset];
+
+						if (item_static.conductivity == 0)
+							continue;
+
+						const float neigh_total =
+							current.data[offset + xd_neighbour].location +
+							current.data[offset + xu_neighbour].location +
+							current.data[offset + yd_neighbour].location +
+							current.data[offset + yu_neighbour].location +
+							current.data[offset + zd_neighbour].location +
+							current.data[offset + zu_neighbour].location;
+
+						const float delta_x = current.data[offset].location - neigh_total * (1.0f / 6.0f);
+
+						const float velocity_factor = item_static.velocity_bit ? VEL_FACTOR2 : VEL_FACTOR1;
+						const float conductivity_factor = static_cast<float>(item_static.conductivity) / 127.0f * 0.99999f;
+
+						const float new_velocity = x < row_split
+							? (current.data[offset].velocity - velocity_factor * delta_x) * conductivity_factor
+							: (current.data[offset].velocity - 2.0f * velocity_factor * delta_x) * conductivity_factor * conductivity_factor;
+
+						next.data[offset].location = current.data[offset].location + new_velocity * LOC_FACTOR;
+						next.data[offset].velocity = new_velocity;
+					}
+
+					if (!slow_step)
+					{
+						// the voxels with zero conductivity have zero velocity, so drifting them copies them over
+						for (int x = row_split; x < width; ++x)
+						{
+							const int offset = row + x;
+							next.data[offset].location = current.data[offset].location + current.data[offset].velocity * LOC_FACTOR;
+							next.data[offset].velocity = current.data[offset].velocity;
+						}
+					}
+				}
+			}
+		}
+#pragma warning(pop)
+
+#if defined(AVX2)
+		// The same update as run_slab, four voxels to a 256 bit vector, writing next with non-temporal stores:
+		// next is written in full and not read again in this step, so the read-for-ownership of each written
+		// line is pure overhead - 17 instead of 25 DRAM bytes per voxel. Writing whole vectors means the
+		// voxels with zero conductivity can't be skipped, they are copied over instead - their location only
+		// ever changes by the source fill (into current) and their velocity stays 0, so next ends up holding
+		// the same as with the reference. Heads and tails of the rows not 32 byte aligned in next go through
+		// regular stores. ItemStatic is read as a byte, velocity_bit in bit 0 (the bit-field order of both
+		// MSVC and GCC/Clang on x86).
+		// The stores are weakly ordered, the slab ends with a fence so they are visible past the GridRun barrier.
+		template <typename TMedium, typename TMediumStatic>
+		static void run_slab_streaming(const TMedium& current, TMedium& next, const TMediumStatic& statics, int z_from, int z_to) noexcept
+		{
+			static_assert(sizeof(current.data[0]) == sizeof(Item) && sizeof(statics.data[0]) == sizeof(ItemStatic));
+
+			const int xd_neighbour = current.offset_for(-1, 0, 0) - current.offset_for(0, 0, 0);
+			const int xu_neighbour = current.offset_for(1, 0, 0) - current.offset_for(0, 0, 0);
+
+			const int yd_neighbour = current.offset_for(0, -1, 0) - current.offset_for(0, 0, 0);
+			const int yu_neighbour = current.offset_for(0, 1, 0) - current.offset_for(0, 0, 0);
+
+			const int zd_neighbour = current.offset_for(0, 0, -1) - current.offset_for(0, 0, 0);
+			const int zu_neighbour = current.offset_for(0, 0, 1) - current.offset_for(0, 0, 0);
+
+			const int width = current.width();
+			const int height = current.height();
+
+			auto update_one = [&](int offset)
+			{
+				const auto item_static = statics.data[offset];
+				if (item_static.conductivity == 0)
+				{
+					next.data[offset] = current.data[offset];
+					return;
+				}
+
+				const float neigh_total =
+					current.data[offset + xd_neighbour].location +
+					current.data[offset + xu_neighbour].location +
+					current.data[offset + yd_neighbour].location +
+					current.data[offset + yu_neighbour].location +
+					current.data[offset + zd_neighbour].location +
+					current.data[offset + zu_neighbour].location;
+
+				const float delta_x = current.data[offset].location - neigh_total * (1.0f / 6.0f);
+
+				const float velolicty_factor = item_static.velocity_bit ? VEL_FACTOR2 : VEL_FACTOR1;
+				const float conductivity_factor = static_cast<float>(item_static.conductivity) / 127.0f;
+
+				const float new_velocity = (current.data[offset].velocity - velolicty_factor * delta_x) * conductivity_factor * 0.99999f;
+
+				next.data[offset].location = current.data[offset].location + new_velocity * LOC_FACTOR;
+				next.data[offset].velocity = new_velocity;
+			};
+
+			const __m256 sixth = _mm256_set1_ps(1.0f / 6.0f);
+			const __m256 vel_factor1 = _mm256_set1_ps(VEL_FACTOR1);
+			const __m256 vel_factor2 = _mm256_set1_ps(VEL_FACTOR2);
+			const __m256 max_conductivity = _mm256_set1_ps(127.0f);
+			const __m256 damping = _mm256_set1_ps(0.99999f);
+			const __m256 loc_factor = _mm256_set1_ps(LOC_FACTOR);
+			const __m256i one = _mm256_set1_epi32(1);
+			const __m256i zero = _mm256_setzero_si256();
+			const __m128i statics_to_pairs = _mm_setr_epi8(0, 0, 1, 1, 2, 2, 3, 3, -1, -1, -1, -1, -1, -1, -1, -1);
+
+			for (int z = z_from; z < z_to; ++z)
+			{
+				for (int y = 0; y < height; ++y)
+				{
+					const int row = current.offset_for(0, y, z);
+
+					int x = 0;
+					for (; x < width && (reinterpret_cast<uintptr_t>(&next.data[row + x]) & 31) != 0; ++x)
+						update_one(row + x);
+
+					for (; x + 4 <= width; x += 4)
+					{
+						const int offset = row + x;
+						auto load = [&](int at) { return _mm256_loadu_ps(&current.data[at].location); };
+
+						// lanes: x0 v0 x1 v1 x2 v2 x3 v3, only the even lanes of the neighbours matter
+						const __m256 item = load(offset);
+						const __m256 neigh_total =
+							_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+								load(offset + xd_neighbour), load(offset + xu_neighbour)),
+								load(offset + yd_neighbour)), load(offset + yu_neighbour)),
+								load(offset + zd_neighbour)), load(offset + zu_neighbour));
+
+						const __m256 delta_x = _mm256_moveldup_ps(_mm256_sub_ps(item, _mm256_mul_ps(neigh_total, sixth)));
+
+						uint32_t four_statics;
+						std::memcpy(&four_statics, &statics.data[offset], sizeof(four_statics));
+						const __m256i item_static = _mm256_cvtepu8_epi32(_mm_shuffle_epi8(_mm_cvtsi32_si128(static_cast<int>(four_statics)), statics_to_pairs));
+
+						const __m256i conductivity = _mm256_srli_epi32(item_static, 1);
+						const __m256 velocity_bit = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(item_static, one), one));
+						const __m256 empty = _mm256_castsi256_ps(_mm256_cmpeq_epi32(conductivity, zero));
+
+						const __m256 velolicty_factor = _mm256_blendv_ps(vel_factor1, vel_factor2, velocity_bit);
+						const __m256 conductivity_factor = _mm256_div_ps(_mm256_cvtepi32_ps(conductivity), max_conductivity);
+
+						const __m256 new_velocity = _mm256_mul_ps(_mm256_mul_ps(
+							_mm256_sub_ps(_mm256_movehdup_ps(item), _mm256_mul_ps(velolicty_factor, delta_x)), conductivity_factor), damping);
+						const __m256 new_location = _mm256_add_ps(_mm256_moveldup_ps(item), _mm256_mul_ps(new_velocity, loc_factor));
+
+						const __m256 new_item = _mm256_blendv_ps(_mm256_blend_ps(new_location, new_velocity, 0xaa), item, empty);
+						_mm256_stream_ps(&next.data[offset].location, new_item);
+					}
+
+					for (; x < width; ++x)
+						update_one(row + x);
+				}
+			}
+
+			_mm_sfence();
+		}
+
+		template <typename TMedium, typename TMediumStatic>
+		static void run_streaming(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid) noexcept
+		{
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(current.depth(), thread_idx, num_threads, from, to);
+					run_slab_streaming(current, next, statics, from, to);
+				}
+				);
+		}
+
+		template <typename TMedium, typename TMediumStatic>
+		static void run_planes_streaming(const TMedium& current, TMedium& next, const TMediumStatic& statics, ThreadGrid& grid, int z_from, int z_to) noexcept
+		{
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(z_to - z_from, thread_idx, num_threads, from, to);
+					run_slab_streaming(current, next, statics, z_from + from, z_from + to);
+				}
+				);
+		}
+#endif
+
+		// Separate pass over a state for the kernels without run_reducing, costs a full read of the medium.
+		// Reads the neighbours for the potential energy, so the state's halo planes have to be up to date.
+		template <typename TMedium, typename TMediumStatic>
+		static void reduce(const TMedium& medium, const TMediumStatic& statics, ThreadGrid& grid, FieldReductions& out)
+		{
+			std::vector<FieldReductions> partials(grid.NumThreads());
+			for (auto& partial : partials)
+				partial.reset(medium.width(), medium.height() * medium.depth());
+
+			grid.GridRun(
+				[&](int thread_idx, int num_threads)
+				{
+					int from, to;
+					slab_for(medium.depth(), thread_idx, num_threads, from, to);
+					reduce_slab(medium, statics, from, to, partials[thread_idx]);
+				}
+				);
+
+			out.reset(medium.width(), medium.height() * medium.depth());
+			for (const auto& partial : partials)
+				out.combine(partial);
+		}
+
+		// reduce() of the planes z_from..z_to, added to partial
+		template <typename TMedium, typename TMediumStatic>
+		static void reduce_slab(const TMedium& medium, const TMediumStatic& statics, int z_from, int z_to, FieldReductions& partial) noexcept
+		{
+			const int xd_neighbour = medium.offset_for(-1, 0, 0) - medium.offset_for(0, 0, 0);
+			const int xu_neighbour = medium.offset_for(1, 0, 0) - medium.offset_for(0, 0, 0);
+
+			const int yd_neighbour = medium.offset_for(0, -1, 0) - medium.offset_for(0, 0, 0);
+			const int yu_neighbour = medium.offset_for(0, 1, 0) - medium.offset_for(0, 0, 0);
+
+			const int zd_neighbour = medium.offset_for(0, 0, -1) - medium.offset_for(0, 0, 0);
+			const int zu_neighbour = medium.offset_for(0, 0, 1) - medium.offset_for(0, 0, 0);
+
+			for (int z = z_from; z < z_to; ++z)
+			{
+				for (int y = 0; y < medium.height(); ++y)
+				{
+					float row_energy = 0.0f; // as run_slab sums it
+
+					for (int x = 0; x < medium.width(); ++x)
+					{
+						const int offset = medium.offset_for(x, y, z);
+						const auto item_static = statics.data[offset];
+						if (item_static.conductivity == 0)
+							continue;
+
+						const float neigh_total =
+							medium.data[offset + xd_neighbour].location +
+							medium.data[offset + xu_neighbour].location +
+							medium.data[offset + yd_neighbour].location +
+							medium.data[offset + yu_neighbour].location +
+							medium.data[offset + zd_neighbour].location +
+							medium.data[offset + zu_neighbour].location;
+
+						const auto& item = medium.data[offset];
+						const float delta_x = item.location - neigh_total * (1.0f / 6.0f);
+						const float velocity_factor = item_static.velocity_bit ? VEL_FACTOR2 : VEL_FACTOR1;
+
+						row_energy += 0.5f * (item.velocity * item.velocity + velocity_factor * delta_x * delta_x);
+						partial.max_abs_location = std::max(partial.max_abs_location, std::abs(item.location));
+						partial.plane_sq_location[x] += item.location * item.location;
+					}
+
+					partial.energy += row_energy;
+				}
+			}
+		}
+
+		// All the kernels, the first one is the reference
+		template <typename TMedium, typename TMediumStatic>
+		static std::vector<StencilKernelVariant<TMedium, TMediumStatic>> variants()
+		{
+			return {
+				{ "reference", 2.0 * sizeof(Item) + sizeof(ItemStatic) + sizeof(Item), &run<TMedium, TMediumStatic>, &run_planes<TMedium, TMediumStatic>, &run_reducing<TMedium, TMediumStatic> },
+#if defined(AVX2)
+				{ "streaming", sizeof(Item) + sizeof(ItemStatic) + sizeof(Item), &run_streaming<TMedium, TMediumStatic>, &run_planes_streaming<TMedium, TMediumStatic>, nullptr },
+#endif
+			};
+		}
+	};
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "World.h"
+#include "PageAllocator.h"
+#include "RuntimeConfig.h"
+#include "ThreadGrid.h"
+
+namespace waves
+{
+	// One line of a sweep manifest
+	struct SweepJob
+	{
+		std::string pattern;		// empty - the default round pattern
+		uint64_t exposure_start{ 0 };
+		uint64_t exposure_length{ 0 };	// 0 - no exposure
+		uint64_t iterations{ 0 };
+		std::string output;
+	};
+
+	//
+	// How a sweep is laid onto the machine: as many worlds at a time as fit into the available memory next
+	// to the one shared static medium - but no more than there are jobs or CPUs - each with an equal,
+	// disjoint share of the CPUs for its ThreadGrid.
+	//
+	struct SweepPlan
+	{
+		int concurrent{ 1 };
+		int threads_per_world{ 1 };
+		std::vector<std::vector<int>> cpu_sets;
+
+		uint64_t scene_bytes{ 0 };
+		uint64_t world_bytes{ 0 };		// the fields and the pictures of one world
+		uint64_t available_bytes{ 0 };	// 0 - unknown, the memory doesn't limit the plan then
+
+		static constexpr double MEMORY_SHARE = 0.9;	// of the available memory, for the worlds
+
+		static SweepPlan make(const MediumSize& size, size_t jobs, const std::vector<int>& cpus, uint64_t available_bytes, int max_concurrent)
+		{
+			SweepPlan ret;
+			ret.scene_bytes = scene_bytes_for(size);
+			ret.world_bytes = world_bytes_for(size);
+			ret.available_bytes = available_bytes;
+
+			int concurrent = static_cast<int>(std::min<size_t>(std::max<size_t>(jobs, 1), cpus.size()));
+			if (max_concurrent > 0)
+				concurrent = std::min(concurrent, max_concurrent);
+
+			if (available_bytes != 0)
+			{
+				const double budget = available_bytes * MEMORY_SHARE - static_cast<double>(ret.scene_bytes);
+				const int fit = static_cast<int>(std::max(0.0, budget / static_cast<double>(ret.world_bytes)));
+				concurrent = std::min(concurrent, std::max(fit, 1));
+			}
+
+			ret.concurrent = concurrent;
+			ret.threads_per_world = std::max(1, static_cast<int>(cpus.size()) / concurrent);
+
+			for (int slot = 0; slot < concurrent; ++slot)
+			{
+				std::vector<int> set;
+				for (int t = 0; t < ret.threads_per_world; ++t)
+					set.push_back(cpus[(slot * ret.threads_per_world + t) % cpus.size()]);
+				ret.cpu_sets.push_back(set);
+			}
+
+			return ret;
+		}
+
+		bool fits() const noexcept
+		{
+			return available_bytes == 0 || scene_bytes + concurrent * world_bytes <= available_bytes * MEMORY_SHARE;
+		}
+
+		// the static medium, as BasicWorld lays it out
+		static uint64_t scene_bytes_for(const MediumSize& size) noexcept
+		{
+			return medium_items(size, 4) * sizeof(ItemStatic);
+		}
+
+		// both field buffers and the pictures
+		static uint64_t world_bytes_for(const MediumSize& size) noexcept
+		{
+			using TScene = BasicWorld<RuntimeMedium<>>;
+
+			const uint64_t pictures = medium_items({ TScene::PICTURE_PLANES, size.height, size.depth }, 0)
+				+ medium_items({ TScene::SRC_PICTURE_PLANES, size.height, size.depth }, 0);
+
+			return 2 * medium_items(size, 4) * sizeof(Item) + pictures * sizeof(float);
+		}
+
+		static uint64_t medium_items(const MediumSize& size, int guard) noexcept
+		{
+			const auto padded = MediumLayout::padding::padded;
+			const int row = MediumLayout::row_stride(size.width + 2 * guard, padded);
+			return static_cast<uint64_t>(MediumLayout::plane_stride(row, size.height + 2 * guard, padded)) * (size.depth + 2 * guard);
+		}
+
+		// MemAvailable on Linux, the available physical memory on Windows; 0 if unknown
+		static uint64_t available_memory() noexcept
+		{
+#if defined(_WIN32)
+			MEMORYSTATUSEX status{};
+			status.dwLength = sizeof(status);
+			if (::GlobalMemoryStatusEx(&status))
+				return status.ullAvailPhys;
+#elif defined(__linux__)
+			std::ifstream meminfo{ "/proc/meminfo" };
+			std::string key;
+			uint64_t kb;
+			while (meminfo >> key >> kb)
+			{
+				if (key == "MemAvailable:")
+					return kb * 1024;
+				meminfo.ignore(256, '\n');
+			}
+#endif
+			return 0;
+		}
+	};
+
+	//
+	// Runs the jobs of a sweep manifest (config.sweep_manifest()) in one process, see SweepPlan for how many
+	// at a time. The worlds share one static medium, a world per job, its workers pinned to its slot's CPUs.
+	//
+	// The manifest has one job per line, '#' starts a comment:
+	//   <pattern.png>, <exposure start>, <exposure length>, <iterations>, <output dir>
+	// an empty pattern is the default round one, an exposure length of 0 takes no picture. The pictures of a
+	// job go to its output dir, config.output_folder() gets
+	//   sweep.csv - one row per job: where it ran, how long it took, its throughput
+	// and the aggregate throughput is printed at the end.
+	//
+	class SweepRunner
+	{
+		using clock = std::chrono::steady_clock;
+
+		struct JobResult
+		{
+			int slot{ -1 };
+			double seconds{ 0.0 };
+			uint64_t iterations{ 0 };
+			bool exposure_saved{ false };
+			std::string error;
+		};
+
+		runtime_config& _config;
+		MediumSize _size;
+
+		std::vector<SweepJob> _jobs;
+		std::vector<JobResult> _results;
+		SweepPlan _plan;
+
+		scene_handle _scene;
+		std::atomic<size_t> _next_job{ 0 };
+
+		std::mutex _out_lock;
+		FILE* _csv{ nullptr };
+
+	public:
+		SweepRunner(runtime_config& config)
+			: _config{ config }
+			, _size{ config.medium_size() }
+		{
+		}
+
+		~SweepRunner()
+		{
+			if (_csv != nullptr)
+				fclose(_csv);
+		}
+
+		// false with error set if the manifest can't be read or a line doesn't parse
+		static bool load_manifest(const std::string& file_name, std::vector<SweepJob>& jobs, std::string& error)
+		{
+			std::ifstream in{ file_name };
+			if (!in)
+			{
+				error = "can't open " + file_name;
+				return false;
+			}
+
+			std::string line;
+			for (int line_no = 1; std::getline(in, line); ++line_no)
+			{
+				line = line.substr(0, line.find('#'));
+
+				std::vector<std::string> fields;
+				std::stringstream ss{ line };
+				for (std::string field; std::getline(ss, field, ',');)
+				{
+					const auto from = field.find_first_not_of(" \t\r");
+					const auto to = field.find_last_not_of(" \t\r");
+					fields.push_back(from == std::string::npos ? std::string{} : field.substr(from, to - from + 1));
+				}
+
+				if (fields.empty() || (fields.size() == 1 && fields[0].empty()))
+					continue;
+
+				if (fields.size() != 5 || fields[4].empty())
+				{
+					error = file_name + ":" + std::to_string(line_no) + ": expected <pattern>, <exposure start>, <exposure length>, <iterations>, <output dir>";
+					return false;
+				}
+
+				try
+				{
+					jobs.push_back({ fields[0], std::stoull(fields[1]), std::stoull(fields[2]), std::stoull(fields[3]), fields[4] });
+				}
+				catch (const std::exception&)
+				{
+					error = file_name + ":" + std::to_string(line_no) + ": not a number";
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		int Run()
+		{
+			std::string error;
+			if (!load_manifest(_config.sweep_manifest(), _jobs, error))
+			{
+				std::cerr << "Sweep manifest: " << error << std::endl;
+				return 1;
+			}
+
+			if (_jobs.empty())
+			{
+				std::cerr << "Sweep manifest " << _config.sweep_manifest() << " has no jobs" << std::endl;
+				return 1;
+			}
+
+			if (!BasicWorld<RuntimeMedium<>>::size_supported(_size))
+			{
+				std::cerr << "The scene doesn't fit into " << _size.width << "x" << _size.height << "x" << _size.depth << ", or the grid is over 2^31 voxels" << std::endl;
+				return 1;
+			}
+
+			const std::filesystem::path output{ _config.output_folder() };
+			std::error_code ec;
+			std::filesystem::create_directories(output, ec);
+			if (ec)
+			{
+				std::cerr << "Can't create output folder " << output.string() << ": " << ec.message() << std::endl;
+				return 1;
+			}
+
+			_csv = fopen((output / "sweep.csv").string().c_str(), "w");
+			if (_csv == nullptr)
+			{
+				std::cerr << "Can't create " << (output / "sweep.csv").string() << std::endl;
+				return 1;
+			}
+			fprintf(_csv, "job,pattern,output,slot,cpus,iterations,seconds,iterations_per_second,gvoxels_per_second,exposure_saved,error\n");
+
+			_plan = SweepPlan::make(_size, _jobs.size(), ThreadGrid::AvailableCpus(), SweepPlan::available_memory(), _config.sweep_concurrent());
+			printPlan();
+
+			PageAllocator::set_mode(_config.huge_page_mode());
+
+			_results.resize(_jobs.size());
+
+			const auto start = clock::now();
+
+			// the first world builds the scene the others share
+			auto first = make_world(_size, _plan.threads_per_world, _plan.cpu_sets[0], &_scene, _config.boundary());
+			std::cout << "Scene built in " << std::chrono::duration<double>(clock::now() - start).count() << "s" << std::endl;
+
+			std::vector<std::thread> slots;
+			for (int slot = 0; slot < _plan.concurrent; ++slot)
+			{
+				slots.emplace_back([this, slot, world = slot == 0 ? std::move(first) : nullptr]() mutable
+					{
+						RunSlot(slot, std::move(world));
+					});
+			}
+
+			for (auto& slot : slots)
+				slot.join();
+
+			const double wall = std::chrono::duration<double>(clock::now() - start).count();
+
+			uint64_t iterations = 0;
+			int failed = 0;
+			for (const auto& result : _results)
+			{
+				iterations += result.iterations;
+				failed += !result.error.empty();
+			}
+
+			const double voxels = static_cast<double>(_size.width) * _size.height * _size.depth;
+			std::cout << "Sweep done: " << _jobs.size() << " jobs, " << failed << " failed, " << iterations << " iterations in " << wall << "s, "
+				<< iterations / wall << " iter/s " << iterations * voxels / wall / 1e9 << " Gvoxel/s aggregate" << std::endl;
+
+			return failed != 0 ? 2 : 0;
+		}
+
+	private:
+		void printPlan()
+		{
+			const double gb = 1024.0 * 1024.0 * 1024.0;
+
+			std::cout << "Sweep of " << _jobs.size() << " jobs on " << _size.width << "x" << _size.height << "x" << _size.depth
+				<< ": " << _plan.concurrent << " at a time, " << _plan.threads_per_world << " threads each; scene "
+				<< _plan.scene_bytes / gb << " GB shared, " << _plan.world_bytes / gb << " GB per world, ";
+			if (_plan.available_bytes != 0)
+				std::cout << _plan.available_bytes / gb << " GB available" << std::endl;
+			else
+				std::cout << "available memory unknown" << std::endl;
+
+			for (int slot = 0; slot < _plan.concurrent; ++slot)
+				std::cout << "  slot " << slot << ": cpus " << cpuList(_plan.cpu_sets[slot]) << std::endl;
+
+			if (!_plan.fits())
+				std::cerr << "Warning: even one world at a time needs more than the available memory" << std::endl;
+		}
+
+		static std::string cpuList(const std::vector<int>& cpus)
+		{
+			std::string ret;
+			for (size_t i = 0; i < cpus.size(); ++i)
+				ret += (i != 0 ? " " : "") + std::to_string(cpus[i]);
+			return ret;
+		}
+
+		void RunSlot(int slot, std::unique_ptr<IWorld> world)
+		{
+			for (size_t job = _next_job++; job < _jobs.size(); job = _next_job++)
+			{
+				if (!world)
+				{
+					auto scene = _scene;
+					world = make_world(_size, _plan.threads_per_world, _plan.cpu_sets[slot], &scene, _config.boundary());
+				}
+
+				_results[job] = RunJob(*world, _jobs[job]);
+				_results[job].slot = slot;
+				world.reset();
+
+				report(job);
+			}
+		}
+
+		JobResult RunJob(IWorld& world, const SweepJob& job)
+		{
+			JobResult ret;
+
+			std::error_code ec;
+			std::filesystem::create_directories(job.output, ec);
+			if (ec)
+			{
+				ret.error = "can't create " + job.output;
+				return ret;
+			}
+
+			if (!world.set_kernel(_config.kernel()))
+			{
+				ret.error = "unknown kernel " + _config.kernel();
+				return ret;
+			}
+
+			if (!world.set_multirate(_config.multirate()))
+			{
+				ret.error = "--multirate needs the sponge boundary";
+				return ret;
+			}
+
+			if (!world.initialize(job.pattern))
+			{
+				ret.error = "can't use the pattern " + job.pattern;
+				return ret;
+			}
+
+			world.set_exposure_tolerance(_config.exposure_tolerance());
+
+			const auto start = clock::now();
+			bool exposing = false;
+
+			while (world.current_iteration() < job.iterations)
+			{
+				if (job.exposure_length != 0 && world.current_iteration() == job.exposure_start)
+				{
+					world.start_taking_picture(job.output, job.exposure_length);
+					exposing = true;
+				}
+
+				world.iterate();
+
+				// the exposure is all a job leaves behind
+				if (_config.exposure_tolerance() > 0 && exposing && !world.taking_picture())
+					break;
+			}
+
+			ret.seconds = std::chrono::duration<double>(clock::now() - start).count();
+			ret.iterations = world.current_iteration();
+			ret.exposure_saved = exposing && !world.taking_picture();
+			return ret;
+		}
+
+		void report(size_t job)
+		{
+			const auto& j = _jobs[job];
+			const auto& r = _results[job];
+
+			const double voxels = static_cast<double>(_size.width) * _size.height * _size.depth;
+			const double ips = r.seconds > 0.0 ? r.iterations / r.seconds : 0.0;
+
+			std::lock_guard<std::mutex> lock{ _out_lock };
+
+			fprintf(_csv, "%zu,%s,%s,%d,%s,%llu,%.3f,%.3f,%.3f,%d,%s\n",
+				job, j.pattern.c_str(), j.output.c_str(), r.slot, cpuList(_plan.cpu_sets[r.slot]).c_str(),
+				static_cast<unsigned long long>(r.iterations), r.seconds, ips, ips * voxels / 1e9, r.exposure_saved ? 1 : 0, r.error.c_str());
+			fflush(_csv);
+
+			if (!r.error.empty())
+				std::cerr << "Job " << job << " failed: " << r.error << std::endl;
+			else
+				std::cout << "Job " << job << " (" << (j.pattern.empty() ? "round" : j.pattern) << ") done on slot " << r.slot << ": "
+					<< r.iterations << " iterations in " << r.seconds << "s, " << ips << " iter/s " << ips * voxels / 1e9 << " Gvoxel/s" << std::endl;
+		}
+	};
+}
@@ -8,11 +8,59 @@
 #include <atomic>
 #include <functional>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+
+#include <immintrin.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "PerfCounters.h"
+#include "Trace.h"
+
+// Accumulated timings of one worker across the accounted GridRun calls since the last ResetStats(), see StatsScope
+struct ThreadGridWorkerStats
+{
+    uint64_t computeNs{ 0 };     // inside the task
+    uint64_t taskWaitNs{ 0 };    // from GridRun dispatch until the worker picked the task up
+    uint64_t barrierWaitNs{ 0 }; // from the end of own task until the slowest worker finished
+    uint64_t maxComputeNs{ 0 };  // slowest single run
+
+    waves::PerfCounterValues perf;  // only if EnablePerfCounters() was called
+};
+
+struct ThreadGridStats
+{
+    uint64_t runs{ 0 };
+    uint64_t wallNs{ 0 };        // sum of GridRun durations
+
+    // per run: slowest worker compute / mean worker compute, 1.0 is a perfect split
+    double meanImbalance{ 0.0 };
+    double maxImbalance{ 0.0 };
+
+    // sum of compute / (num threads * wall), the share of the grid doing useful work
+    double efficiency{ 0.0 };
+
+    std::vector<ThreadGridWorkerStats> workers;
+
+    // sum over the workers, perfError is set if the counters were requested but couldn't be opened
+    waves::PerfCounterValues perf;
+    std::string perfError;
+};
 
 class ThreadGrid
 {
+    using clock = std::chrono::steady_clock;
+
     int numThreads;
 
+    std::vector<int> cpus; // worker i runs on cpus[i % size], empty - wherever the OS puts it
+
     std::vector<std::thread> threads;
     std::vector<std::mutex> threadIsActive;
 
@@ -25,14 +73,56 @@ class ThreadGrid
     std::condition_variable taskAwailableCond;
     std::condition_variable taskDoneCond;
 
+    // written by each worker for its own index before it reports done, read by GridRun under taskLock
+    std::vector<clock::time_point> runStart;
+    std::vector<clock::time_point> runEnd;
+
+    // hardware counters, opened lazily by each worker on its own thread once requested
+    std::atomic_bool perfRequested{ false };
+    std::vector<std::unique_ptr<waves::PerfCounterGroup>> perfGroups;
+    std::vector<waves::PerfCounterValues> runPerf;
+
+    ThreadGridStats stats;
+    double imbalanceSum{ 0.0 };
+    int statsScopes{ 0 };   // open StatsScopes, touched by the thread calling GridRun only
+
 public:
-    ThreadGrid(int n)
+    // Only the GridRuns inside a StatsScope are accounted in Stats(). The worlds open one around the stencil,
+    // so the timings and the counters aren't mixed with the fill, the separate reductions or the pictures.
+    class StatsScope
+    {
+        ThreadGrid& grid;
+
+    public:
+        explicit StatsScope(ThreadGrid& g) noexcept
+            : grid(g)
+        {
+            ++grid.statsScopes;
+        }
+
+        ~StatsScope()
+        {
+            --grid.statsScopes;
+        }
+
+        StatsScope(const StatsScope&) = delete;
+        StatsScope& operator=(const StatsScope&) = delete;
+    };
+
+    ThreadGrid(int n, const std::vector<int>& pinTo = {})
         : numThreads(n)
+        , cpus(pinTo)
         , threads(n)
         , threadIsActive(n)
         , hasTask(n)
 		, numActiveThreads{0}
+        , runStart(n)
+        , runEnd(n)
+        , perfGroups(n)
+        , runPerf(n)
     {
+        stats.workers.resize(n);
+
         for (int i = 0; i < n; ++i)
         {
             threads[i] = std::thread(&ThreadGrid::Thread, this, i);
@@ -54,12 +144,69 @@ public:
         }
     }
 
+    int NumThreads() const noexcept
+    {
+        return numThreads;
+    }
+
+    const std::vector<int>& Cpus() const noexcept
+    {
+        return cpus;
+    }
+
+    // The CPUs this process may run on, in order - the affinity mask it was started with on Linux
+    static std::vector<int> AvailableCpus()
+    {
+        std::vector<int> ret;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &set))
+                    ret.push_back(cpu);
+            }
+        }
+#endif
+        if (ret.empty())
+        {
+            for (int cpu = 0; cpu < static_cast<int>(std::max(1u, std::thread::hardware_concurrency())); ++cpu)
+                ret.push_back(cpu);
+        }
+        return ret;
+    }
+
+    ThreadGridStats Stats()
+    {
+        std::lock_guard<std::mutex> m(taskLock);
+        return stats;
+    }
+
+    // Counts cycles, instructions and cache misses of every worker from the next GridRun on.
+    // If the counters can't be opened the runs go on as usual and Stats().perfError says why.
+    void EnablePerfCounters() noexcept
+    {
+        perfRequested = true;
+    }
+
+    void ResetStats()
+    {
+        std::lock_guard<std::mutex> m(taskLock);
+        stats = ThreadGridStats{};
+        stats.workers.resize(numThreads);
+        imbalanceSum = 0.0;
+    }
+
     void GridRun(std::function<void(int, int)>&& item) noexcept
     {
 		try 
 		{
 			std::unique_lock<std::mutex> m(taskLock);
 
+			const auto dispatched = clock::now();
+
 			std::fill(std::begin(hasTask), std::end(hasTask), true);
 			numActiveThreads = numThreads;
 
@@ -74,6 +221,8 @@ public:
 
 			// Finally - ensure we clean up the task closure
 			task = std::function<void(int, int)>();
+
+			accountRun(dispatched, clock::now());
 		}
 		catch (...)
 		{
@@ -83,11 +232,80 @@ public:
     }
 
 private:
+    // best effort, an unpinned worker still does its share
+    static void PinCurrentThread(int cpu) noexcept
+    {
+#if defined(_WIN32)
+        if (cpu < 64)
+            ::SetThreadAffinityMask(::GetCurrentThread(), DWORD_PTR{ 1 } << cpu);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    static uint64_t ns(clock::duration d) noexcept
+    {
+        return static_cast<uint64_t>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+    }
+
+    // called with taskLock held, after all the workers are done
+    void accountRun(clock::time_point dispatched, clock::time_point done) noexcept
+    {
+        if (statsScopes == 0)
+            return;
+
+        const auto lastEnd = *std::max_element(runEnd.begin(), runEnd.end());
+
+        uint64_t computeTotal = 0;
+        uint64_t computeMax = 0;
+
+        for (int i = 0; i < numThreads; ++i)
+        {
+            auto& w = stats.workers[i];
+            const uint64_t compute = ns(runEnd[i] - runStart[i]);
+
+            w.computeNs += compute;
+            w.taskWaitNs += ns(runStart[i] - dispatched);
+            w.barrierWaitNs += ns(lastEnd - runEnd[i]);
+            w.maxComputeNs = std::max(w.maxComputeNs, compute);
+
+            w.perf += runPerf[i];
+            stats.perf += runPerf[i];
+
+            if (perfGroups[i] && !perfGroups[i]->is_open())
+                stats.perfError = perfGroups[i]->error();
+
+            computeTotal += compute;
+            computeMax = std::max(computeMax, compute);
+        }
+
+        const double imbalance = computeTotal != 0 ? static_cast<double>(computeMax) * numThreads / computeTotal : 1.0;
+
+        stats.runs++;
+        stats.wallNs += ns(done - dispatched);
+        imbalanceSum += imbalance;
+        stats.meanImbalance = imbalanceSum / stats.runs;
+        stats.maxImbalance = std::max(stats.maxImbalance, imbalance);
+
+        uint64_t allCompute = 0;
+        for (const auto& w : stats.workers)
+            allCompute += w.computeNs;
+        stats.efficiency = stats.wallNs != 0 ? static_cast<double>(allCompute) / (static_cast<double>(stats.wallNs) * numThreads) : 0.0;
+    }
+
     void Thread(int threadIdx)
     {
         _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
         _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 
+        WAVES_TRACE_THREAD_NAME("grid worker " + std::to_string(threadIdx));
+
+        if (!cpus.empty())
+            PinCurrentThread(cpus[threadIdx % cpus.size()]);
+
         while (!terminate)
         {
             std::function<void(int, int)> item;
@@ -100,8 +318,25 @@ private:
                 item = task;
             }
 
+            auto& perf = perfGroups[threadIdx];
+            if (perfRequested && !perf)
+            {
+                perf = std::make_unique<waves::PerfCounterGroup>();
+                perf->open();
+            }
+
+            waves::PerfCounterValues perfBefore, perfAfter;
+            const bool counting = perf && perf->read(perfBefore);
+
             // we have the task - run it
+            runStart[threadIdx] = clock::now();
             item(threadIdx, numThreads);
+            runEnd[threadIdx] = clock::now();
+#if defined(WAVES_TRACE)
+            waves::Tracer::instance().record("grid_task", runStart[threadIdx], runEnd[threadIdx]);
+#endif
+
+            runPerf[threadIdx] = counting && perf->read(perfAfter) ? perfAfter - perfBefore : waves::PerfCounterValues{};
 
             // Mark ourselves as done, and if we are the last thread - notify the waitinig "GridRun"
             std::unique_lock<std::mutex> m(taskLock);
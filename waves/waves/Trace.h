@@ -0,0 +1,252 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+//
+// Timeline tracing, written out as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+//
+// Instrumentation is only compiled in with WAVES_TRACE defined, otherwise the macros below expand to
+// nothing. With it compiled in, nothing is recorded until Tracer::instance().start() is called
+// (--trace <file.json>); a disabled scope is a single relaxed load.
+//
+//    WAVES_TRACE_SCOPE("png_encode");
+//    WAVES_TRACE_THREAD_NAME("calc");
+//
+// Every thread records into its own fixed size ring of complete events, the oldest events are
+// overwritten, so a long run keeps its tail. Rings are never freed, so write_chrome_json() can be
+// called after the recording threads are gone.
+//
+namespace waves
+{
+	struct TraceEvent
+	{
+		const char* name;		// a string literal or a Tracer::intern()-ed name
+		uint64_t start_ns;
+		uint64_t duration_ns;
+	};
+
+	class TraceBuffer
+	{
+		std::vector<TraceEvent> _events;
+		std::atomic<uint64_t> _written{ 0 };
+
+	public:
+		const int tid;
+		std::string thread_name;
+
+		TraceBuffer(size_t capacity, int thread_id)
+			: _events(capacity)
+			, tid{ thread_id }
+		{
+		}
+
+		// owning thread only
+		void push(const TraceEvent& event) noexcept
+		{
+			const uint64_t idx = _written.load(std::memory_order_relaxed);
+			_events[idx % _events.size()] = event;
+			_written.store(idx + 1, std::memory_order_release);
+		}
+
+		// any thread, the ring should be quiet - an event being written at the same time may come out torn
+		template <typename TFunc>
+		void for_each(TFunc&& func) const
+		{
+			const uint64_t written = _written.load(std::memory_order_acquire);
+			const uint64_t first = written > _events.size() ? written - _events.size() : 0;
+
+			for (uint64_t idx = first; idx < written; ++idx)
+				func(_events[idx % _events.size()]);
+		}
+	};
+
+	class Tracer
+	{
+		using clock = std::chrono::steady_clock;
+
+		std::atomic_bool _enabled{ false };
+		size_t _capacity{ 1 << 16 };
+		const clock::time_point _epoch{ clock::now() };
+
+		std::mutex _lock;
+		std::vector<std::unique_ptr<TraceBuffer>> _buffers;
+		std::set<std::string, std::less<>> _names;
+
+		Tracer() = default;
+
+		// names can be given before the tracing starts, the ring is only allocated with the first event
+		static std::string& pending_thread_name()
+		{
+			thread_local std::string name;
+			return name;
+		}
+
+		TraceBuffer& buffer()
+		{
+			thread_local TraceBuffer* tls = nullptr;
+			if (tls == nullptr)
+			{
+				std::lock_guard<std::mutex> l(_lock);
+				_buffers.push_back(std::make_unique<TraceBuffer>(_capacity, static_cast<int>(_buffers.size()) + 1));
+				tls = _buffers.back().get();
+				tls->thread_name = pending_thread_name();
+			}
+			return *tls;
+		}
+
+		static void write_escaped(FILE* out, const char* str)
+		{
+			for (; *str; ++str)
+			{
+				if (*str == '"' || *str == '\\')
+					fputc('\\', out);
+				fputc(*str, out);
+			}
+		}
+
+	public:
+		static Tracer& instance()
+		{
+			static Tracer tracer;
+			return tracer;
+		}
+
+		static constexpr bool compiled_in() noexcept
+		{
+#if defined(WAVES_TRACE)
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// events_per_thread: ring size, 24 bytes per event
+		void start(size_t events_per_thread = 1 << 16)
+		{
+			{
+				std::lock_guard<std::mutex> l(_lock);
+				_capacity = events_per_thread;
+			}
+			_enabled.store(true, std::memory_order_relaxed);
+		}
+
+		void stop() noexcept
+		{
+			_enabled.store(false, std::memory_order_relaxed);
+		}
+
+		bool enabled() const noexcept
+		{
+			return _enabled.load(std::memory_order_relaxed);
+		}
+
+		uint64_t now_ns() const noexcept
+		{
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _epoch).count());
+		}
+
+		uint64_t to_ns(clock::time_point t) const noexcept
+		{
+			return t > _epoch ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t - _epoch).count()) : 0;
+		}
+
+		void record(const char* name, uint64_t start_ns, uint64_t end_ns)
+		{
+			if (enabled())
+				buffer().push({ name, start_ns, end_ns > start_ns ? end_ns - start_ns : 0 });
+		}
+
+		void record(const char* name, clock::time_point start, clock::time_point end)
+		{
+			if (enabled())
+				record(name, to_ns(start), to_ns(end));
+		}
+
+		// a copy of the name that lives as long as the tracer, for names that aren't literals; not for the hot path
+		const char* intern(const std::string& name)
+		{
+			std::lock_guard<std::mutex> l(_lock);
+			return _names.insert(name).first->c_str();
+		}
+
+		void set_thread_name(const std::string& name)
+		{
+			pending_thread_name() = name;
+		}
+
+		bool write_chrome_json(const std::string& file)
+		{
+			FILE* out = fopen(file.c_str(), "w");
+			if (out == nullptr)
+				return false;
+
+			std::lock_guard<std::mutex> l(_lock);
+
+			fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+			bool first = true;
+			for (const auto& buffer : _buffers)
+			{
+				if (!buffer->thread_name.empty())
+				{
+					fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"", first ? "" : ",\n", buffer->tid);
+					write_escaped(out, buffer->thread_name.c_str());
+					fprintf(out, "\"}}");
+					first = false;
+				}
+
+				buffer->for_each([&](const TraceEvent& e)
+					{
+						fprintf(out, "%s{\"name\":\"", first ? "" : ",\n");
+						write_escaped(out, e.name);
+						fprintf(out, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+							buffer->tid, e.start_ns / 1000.0, e.duration_ns / 1000.0);
+						first = false;
+					});
+			}
+
+			fprintf(out, "\n]}\n");
+			return fclose(out) == 0;
+		}
+	};
+
+	class TraceScope
+	{
+		const char* _name;
+		uint64_t _start;
+
+	public:
+		explicit TraceScope(const char* name) noexcept
+			: _name{ Tracer::instance().enabled() ? name : nullptr }
+			, _start{ _name != nullptr ? Tracer::instance().now_ns() : 0 }
+		{
+		}
+
+		~TraceScope()
+		{
+			if (_name != nullptr)
+				Tracer::instance().record(_name, _start, Tracer::instance().now_ns());
+		}
+
+		TraceScope(const TraceScope&) = delete;
+		TraceScope& operator=(const TraceScope&) = delete;
+	};
+}
+
+#if defined(WAVES_TRACE)
+#define WAVES_TRACE_CONCAT_(a, b) a##b
+#define WAVES_TRACE_CONCAT(a, b) WAVES_TRACE_CONCAT_(a, b)
+#define WAVES_TRACE_SCOPE(name) waves::TraceScope WAVES_TRACE_CONCAT(_trace_scope_, __LINE__){ name }
+#define WAVES_TRACE_THREAD_NAME(name) waves::Tracer::instance().set_thread_name(name)
+#else
+#define WAVES_TRACE_SCOPE(name)
+#define WAVES_TRACE_THREAD_NAME(name)
+#endif
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+
+namespace waves
+{
+	//
+	// Lock-free single producer / single consumer triple buffer.
+	//
+	// The producer always owns a "back" slot it can fill at its own pace, the consumer always owns
+	// a "front" slot it can read at its own pace. The third slot sits in the middle and is swapped
+	// atomically on publish() / consume(), neither side ever waits for the other. The consumer just
+	// gets the most recently published value, intermediate ones are dropped.
+	//
+	template <typename T>
+	class TripleBuffer
+	{
+		static constexpr uint8_t INDEX_MASK = 0x3;
+		static constexpr uint8_t DIRTY_BIT = 0x4;
+
+		std::array<T, 3> _slots{};
+
+		alignas(64) std::atomic<uint8_t> _middle{ 1 };
+		alignas(64) uint8_t _back{ 0 };		// owned by the producer
+		alignas(64) uint8_t _front{ 2 };	// owned by the consumer
+
+	public:
+		TripleBuffer() = default;
+
+		TripleBuffer(const TripleBuffer&) = delete;
+		TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+		// Producer side: the slot to fill next
+		T& back() noexcept
+		{
+			return _slots[_back];
+		}
+
+		// Producer side: makes back() visible to the consumer and hands over a fresh back slot
+		void publish() noexcept
+		{
+			_back = _middle.exchange(_back | DIRTY_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+		}
+
+		// Consumer side: grabs the latest published value if there is one, returns true if front() changed
+		bool consume() noexcept
+		{
+			if ((_middle.load(std::memory_order_relaxed) & DIRTY_BIT) == 0)
+				return false;
+
+			_front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX_MASK;
+			return true;
+		}
+
+		// Consumer side: the latest consumed value
+		const T& front() const noexcept
+		{
+			return _slots[_front];
+		}
+	};
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <array>
+#include <ctime>
+#include <string>
 
 // Quick reverse square root from Quake 3 source code 
 inline float Q_rsqrt(float number)  noexcept
@@ -44,11 +46,16 @@ const T& ValueCap(const T& val, const  T& min, const T& max)  noexcept
     return min;
 }
 
-std::string ctime_to_utc_str(__time64_t epoch_time)
+inline std::string ctime_to_utc_str(int64_t epoch_time)
 {
     std::array<char, 128> time_string;
     struct tm tm;
+#if defined(_WIN32)
     _gmtime64_s(&tm, &epoch_time);
+#else
+    const time_t t = static_cast<time_t>(epoch_time);
+    gmtime_r(&t, &tm);
+#endif
     strftime(time_string.data(), time_string.size() - 1, "%Y-%m-%d %H:%M", &tm);
     return { time_string.data() };
 }
@@ -12,17 +12,23 @@
 #include <unordered_set>
 #include <sstream>
 #include <array>
+#include <memory>
+#include <typeinfo>
 
-#include <ppl.h>
 #include <immintrin.h> 
 
-#include "vec3d.h"
 #include "Random.h"
 #include "ThreadGrid.h"
 
 #include "Utils.h"
 
 #include "Medium.h"
+#include "IWorld.h"
+#include "ExposureConvergence.h"
+#include "Pml.h"
+#include "SliceRenderer.h"
+#include "StencilKernel.h"
+#include "Profiler.h"
 
 #include "Log.h"
 #include "PngLogger.h"
@@ -38,33 +44,60 @@ namespace waves
 		return std::forward<T>(b);
 	}
 
-    class World
+	//
+	// The static medium of a world - the lens, the camera and the edges - handed to the next world to share
+	// (see BasicWorld::scene()). It only fits a world of the same size, boundary and medium type.
+	//
+	struct scene_handle
+	{
+		MediumSize size{ 0, 0, 0 };
+		boundary_kind boundary{ boundary_kind::sponge };
+		const std::type_info* type{ nullptr };
+		std::shared_ptr<const void> medium;
+
+		// nullptr if empty or made for a different world
+		template <typename TMediumStatic>
+		std::shared_ptr<const TMediumStatic> get(const MediumSize& for_size, boundary_kind for_boundary) const noexcept
+		{
+			if (!medium || !(size == for_size) || boundary != for_boundary || *type != typeid(TMediumStatic))
+				return nullptr;
+			return std::static_pointer_cast<const TMediumStatic>(medium);
+		}
+	};
+
+	//
+	// The scene and its simulation. The geometry is given in voxels, the lens and the camera are centred
+	// in y/z, so any medium at least 304 voxels wide and 256x256 in y/z holds the whole scene - a smaller
+	// one is used by the golden-result checks (see Golden.h).
+	//
+	// TMediumType is either a fixed size Medium or a RuntimeMedium, see make_world().
+	//
+	template <typename TMediumType>
+    class BasicWorld : public IWorld
     {
 	public:
 
 		static constexpr int PATTERN_SIDE = 240;
 
+		static constexpr int DEFAULT_NUM_THREADS = 8;
 
-		using TMedium = Medium<432, 768, 768>;
-		using TMediumStatic = Medium<TMedium::width(), TMedium::height(), TMedium::depth(), ItemStatic>;
 
-		using TMediumPatternStatic = Medium<1, PATTERN_SIDE, PATTERN_SIDE, float, 0, true>;
+		using TMedium = TMediumType;
+		using TMediumStatic = typename TMedium::template rebind<ItemStatic>;
 
-		// a temp object used to calculate resistance/conductivity with higher precision
-		using TMediumCondStatic = Medium<TMedium::width(), TMedium::height(), TMedium::depth(), float>;
+		using TMediumPatternStatic = Medium<1, PATTERN_SIDE, PATTERN_SIDE, float, 0, true>;
 
-		using TSrcPictureMedium = Medium<1, TMedium::height(), TMedium::depth(), float, 0, true>;
-		using TPictureMedium = Medium<100, TMedium::height(), TMedium::depth(), float, 0, true>;
+		static constexpr int SRC_PICTURE_PLANES = 1;
+		static constexpr int PICTURE_PLANES = 100;
 
-		static_assert(PATTERN_SIDE <= TMedium::height());
-		static_assert(PATTERN_SIDE <= TMedium::depth());
+		using TSrcPictureMedium = typename TMedium::template plane_stack<SRC_PICTURE_PLANES, float>;
+		using TPictureMedium = typename TMedium::template plane_stack<PICTURE_PLANES, float>;
 
-		static constexpr int PATTERN_Y_OFFSET = (TMedium::height() - PATTERN_SIDE) / 2;
-		static constexpr int PATTERN_Z_OFFSET = (TMedium::depth() - PATTERN_SIDE) / 2;
+		using TKernelVariant = StencilKernelVariant<TMedium, TMediumStatic>;
 
-		static constexpr float VEL_FACTOR1 = 0.40 ; // dV = -k*x/m * dT, this is k*dT/m
-		static constexpr float VEL_FACTOR2 = 0.2; // 0.13; // dV = -k*x/m * dT, this is k*dT/m
-		static constexpr float LOC_FACTOR = 0.1 ; // dX = V * dT, this is dT
+		static constexpr float VEL_FACTOR1 = StencilKernel::VEL_FACTOR1;
+		static constexpr float VEL_FACTOR2 = StencilKernel::VEL_FACTOR2;
+		static constexpr float LOC_FACTOR = StencilKernel::LOC_FACTOR;
 
 		static constexpr float EDGE_SLOW_DOWN_FACTOR = 0.98;
 
@@ -80,12 +113,21 @@ namespace waves
 		static constexpr int LENSE_BASE_X1 = 70;
 		static constexpr int LENSE_BASE_X2 = 90;
 		static constexpr float LENSE_SPHERE_X = 150;
-		static constexpr float LENSE_SPEHERE_Y = TMedium::height() / 2.0f;
-		static constexpr float LENSE_SPEHERE_Z = TMedium::depth() / 2.0f;
 		static constexpr float LENSE_SPHERE_RADIUS = 123.0f;
 
 		static constexpr float LENSE_RADIUS = 105.0f;
-		static constexpr float INNER_CAMERA_RADIUS = ce_min(TMedium::height(), TMedium::depth()) / 2.0 - 15.0;
+
+		// the pattern has to fit in y/z and the picture planes in x, everything else scales with the size
+		static constexpr bool scene_fits(const MediumSize& size) noexcept
+		{
+			return size.width >= PIC_BASE + PICTURE_PLANES && size.height >= PATTERN_SIDE && size.depth >= PATTERN_SIDE;
+		}
+
+		// the scene fits and the whole medium is addressable, see MediumLayout::offsets_fit()
+		static constexpr bool size_supported(const MediumSize& size) noexcept
+		{
+			return scene_fits(size) && MediumLayout::offsets_fit(size);
+		}
 
 	private:
 
@@ -93,9 +135,13 @@ namespace waves
 
 		TMediumPatternStatic _pattern{};
 
-		ThreadGrid _grid{ 8 };
+		const MediumSize _size;
+		const boundary_kind _boundary;
 
-		TMediumStatic _static;
+		ThreadGrid _grid;
+
+		std::shared_ptr<const TMediumStatic> _static;	// read only once built, may be shared with other worlds of the size
+		std::unique_ptr<PmlBoundary> _pml;				// with boundary_kind::pml only
 		std::array<TMedium, 2> _mediums;
 
 		TSrcPictureMedium _src_picture;
@@ -106,51 +152,103 @@ namespace waves
 
 		uint64_t elapsed_cpu_clocks{ 0 };
 
+		TKernelVariant _kernel{ StencilKernel::variants<TMedium, TMediumStatic>().front() };
+
+		// multi-rate stepping, see set_multirate()
+		bool _multirate{ false };
+		uint64_t _multirate_parity{ 0 };	// of the iterations making the slow steps
+		std::vector<int> _multirate_split;
+
+		uint64_t _reductions_every{ 0 };
+		FieldReductions _reductions{};
+
+		Profiler _profiler;
+		const size_t _phase_fill{ _profiler.add_phase("fill") };
+		const size_t _phase_stencil{ _profiler.add_phase("stencil") };
+		const size_t _phase_exposure{ _profiler.add_phase("exposure") };
+		const size_t _phase_save_pictures{ _profiler.add_phase("save_pictures") };
+		const size_t _counter_iterations{ _profiler.add_counter("iterations") };
+		const size_t _counter_pictures{ _profiler.add_counter("pictures") };
+
 		std::string _pictures_folder;
 		uint64_t _picture_exposing_until{ 0 };
 		uint64_t _exposition{ 0 };
+		ExposureConvergence _convergence;
+
+		static std::shared_ptr<const TMediumStatic> build_static(const MediumSize& size, ThreadGrid& grid, boundary_kind boundary)
+		{
+			auto ret = std::make_shared<TMediumStatic>(size, uninitialized);
+			StencilKernel::first_touch(*ret, grid);
+			load_scene(*ret, grid, boundary);
+			return ret;
+		}
 
 	public:
-        World()
+		// size must be TMedium::size() for a fixed size medium, and pass size_supported().
+		// The workers are pinned to cpus if given (see ThreadGrid), scene is the static medium of another world
+		// to share (see scene()); an empty one, or one of another size or boundary, is ignored and the world builds its own.
+        BasicWorld(const MediumSize& size, int num_threads = DEFAULT_NUM_THREADS, const std::vector<int>& cpus = {}, const scene_handle& scene = {},
+			boundary_kind boundary = boundary_kind::sponge)
+			: _size{ size }
+			, _boundary{ boundary }
+			, _grid{ num_threads, cpus }
+			, _static{ scene.get<TMediumStatic>(size, boundary) }
+			, _mediums{ { TMedium{ size, uninitialized }, TMedium{ size, uninitialized } } }
+			, _src_picture{ size, SRC_PICTURE_PLANES }
+			, _picture{ size, PICTURE_PLANES }
         {	
-			load_scene(_static);
+			if (!_static)
+				_static = build_static(size, _grid, boundary);
+
+			// the big buffers are zeroed by the workers, so their pages land where the stencil slabs run
+			StencilKernel::first_touch(_mediums[0], _grid);
+			StencilKernel::first_touch(_mediums[1], _grid);
+
+			if (boundary == boundary_kind::pml)
+				_pml = std::make_unique<PmlBoundary>(*_static, [&](float x, float y, float z) { return pml_profile(size, x, y, z); }, _grid);
 		}
 
-		~World()
+		~BasicWorld()
 		{
 		}
 
-		bool initialized() const noexcept
+		bool initialized() const noexcept override
 		{
 			return _initialized;
 		}
 
-		void initialize(const std::string& pattern_file_name)
+		// Returns false if the pattern file can't be used, the world is initialized with the default round pattern then
+		bool initialize(const std::string& pattern_file_name) override
 		{
-			const int32_t R = std::min(_pattern.depth(), _pattern.height()) / 2 - 5;
+			_initialized = true; // one way or another, proceed
+			return load_pattern(_pattern, pattern_file_name);
+		}
+
+		// The round default pattern, masked by the png if a file is given; false if the file can't be used
+		static bool load_pattern(TMediumPatternStatic& pattern, const std::string& pattern_file_name)
+		{
+			const int32_t R = std::min(pattern.depth(), pattern.height()) / 2 - 5;
 			const int32_t RSqr = R * R;
 
-			for (int z = 0; z < _pattern.depth(); ++z)
+			for (int z = 0; z < pattern.depth(); ++z)
 			{
-				for (int y = 0; y < _pattern.height(); ++y)
+				for (int y = 0; y < pattern.height(); ++y)
 				{
-					const float dz = z - _pattern.depth() / 2.0f;
-					const float dy = y - _pattern.height() / 2.0f;
+					const float dz = z - pattern.depth() / 2.0f;
+					const float dy = y - pattern.height() / 2.0f;
 
 					auto dSqr = dz * dz + dy * dy;
 					if (dSqr <= RSqr)
 					{
-						_pattern.at(0, y, z) = FILL_VALUE;
+						pattern.at(0, y, z) = FILL_VALUE;
 					}
 					else
 					{
-						_pattern.at(0, y, z) = FILL_VALUE / (dSqr - RSqr);
+						pattern.at(0, y, z) = FILL_VALUE / (dSqr - RSqr);
 					}
 				}
 			}
 
-			_initialized = true; // one way or another, proceed
-
 			if (pattern_file_name != "")
 			{
 				std::vector<unsigned char> data;
@@ -158,322 +256,465 @@ namespace waves
 				unsigned height;
 				if (lodepng::decode(data, width, height, pattern_file_name) == 0)
 				{
-					if (width != _pattern.depth() || height != _pattern.height())
+					if (width != pattern.depth() || height != pattern.height())
 					{
-						::MessageBox(NULL, L"Pattern size is incorrect! Expected 240x240 png", L"Re-think what you are doing! :)", MB_OK);
-						return;
+						return false;
 					}
 
-					for (int y = 0; y < _pattern.height(); ++y)					
+					for (int y = 0; y < pattern.height(); ++y)					
 					{
-						for (int z = 0; z < _pattern.depth(); ++z)
+						for (int z = 0; z < pattern.depth(); ++z)
 						{
 							auto img_offs = 4 * (y * width + z);
 							bool blocking = data[img_offs] < 127 && data[img_offs+1] < 127 && data[img_offs+2] < 127;
-							_pattern.at(0, _pattern.height()-y-1, z) *= blocking ? 0.0f : 1.0f;
+							pattern.at(0, pattern.height()-y-1, z) *= blocking ? 0.0f : 1.0f;
 						}
 					}
 				}
+				else
+				{
+					return false;
+				}
 			}
+
+			return true;
 		}
 
-		void start_taking_picture(const std::string& folder, uint64_t exposition)
+		// With an empty folder the exposure is only kept in memory, see exposure()
+		void start_taking_picture(const std::string& folder, uint64_t exposition) override
 		{
 			_exposition = exposition;
 			_picture.fill(0.0f);
 			_pictures_folder = folder;
 			_picture_exposing_until = _iteration + exposition + 1;
+			_convergence.start(exposition + 2, _picture);
 		}
 
-	private: 
+		bool taking_picture() const noexcept override
+		{
+			return _picture_exposing_until != 0;
+		}
 
-		static void load_scene_edges(TMediumCondStatic& medium)
+		void set_exposure_tolerance(double tolerance) noexcept override
 		{
-			const float R = static_cast<float>(std::min(medium.depth(), medium.height()) / 2 - EDGE_THICKNESS);
+			_convergence.set_tolerance(tolerance);
+		}
 
-			// Cylinder walls 
-			for (int x = 0; x < TMedium::width(); ++x)
+		int num_threads() const noexcept override
+		{
+			return _grid.NumThreads();
+		}
+
+		// Selects one of StencilKernel::variants() by name, returns false (keeping the current one) if there's no such kernel
+		bool set_kernel(const std::string& name) override
+		{
+			for (const auto& variant : StencilKernel::variants<TMedium, TMediumStatic>())
 			{
-				for (int y = 0; y < TMedium::height(); ++y)
+				if (name == variant.name)
 				{
-					for (int z = 0; z < TMedium::depth(); ++z)
-					{
-						const int offset = TMedium::offset_for(x, y, z);
+					_kernel = variant;
+					return true;
+				}
+			}
+			return false;
+		}
 
-						const float dz = static_cast<float>(z - medium.depth() / 2);
-						const float dy = static_cast<float>(y - medium.height() / 2);
+		const char* kernel_name() const noexcept override
+		{
+			return _kernel.name;
+		}
 
-						const float r = std::sqrt(dz * dz + dy * dy);
-						if (r >= R)
-						{
-							if (r - R < EDGE_THICKNESS)
-								medium.data[offset] *= std::powf(EDGE_SLOW_DOWN_FACTOR, r - R);
-							else
-								medium.data[offset] = 0;
-						}
-					}
-				}
-			}			
+		// The VEL_FACTOR2 material steps at half the rate (see StencilKernel::run_multirate), in place of the
+		// selected kernel. False with the PML boundary, whose correction expects every voxel to step every iteration.
+		bool set_multirate(bool on) override
+		{
+			if (on && _pml)
+				return false;
 
-			for (int x = 0; x < TMedium::width(); ++x)				
+			if (on && !_multirate)
 			{
-				for (int y = 0; y < TMedium::height(); ++y)
-				{
-					for (int z = 0; z < TMedium::depth(); ++z)
-					{
-						const int offset = TMedium::offset_for(x, y, z);
-
-						if (x < EDGE_THICKNESS)
-						{
-							medium.data[offset] *= std::powf(EDGE_SLOW_DOWN_FACTOR, static_cast<float>(EDGE_THICKNESS - x));
-						}
-						else if (x >= TMedium::width() - EDGE_THICKNESS)
-						{
-							medium.data[offset] *= std::powf(EDGE_SLOW_DOWN_FACTOR, static_cast<float>(x - (TMedium::width() - EDGE_THICKNESS)));
-						}
-					}
-				}
+				if (_multirate_split.empty())
+					_multirate_split = StencilKernel::multirate_splits(*_static, _grid);
+				_multirate_parity = _iteration % 2;
 			}
-		}		
 
-		static void load_scene(TMediumStatic& medium)
+			_multirate = on;
+			return true;
+		}
+
+		// Computes FieldReductions inside the stencil pass of every n-th step, 0 - never
+		void set_reductions_every(uint64_t n) noexcept override
 		{
-			TMediumCondStatic cond_static{};
+			_reductions_every = n;
+		}
 
-			for (int z = 0; z < TMedium::depth(); ++z)
-			{
-				for (int x = 0; x < TMedium::width(); ++x)
-				{
-					for (int y = 0; y < TMedium::height(); ++y)
-					{
-						const int offset = TMedium::offset_for(x, y, z);
+		// The latest reductions, FieldReductions::iteration says which step they are from
+		const FieldReductions& reductions() const noexcept override
+		{
+			return _reductions;
+		}
 
-						const float yz_r = std::sqrt(std::pow(y - LENSE_SPEHERE_Y, 2.0f) + std::pow(z - LENSE_SPEHERE_Z, 2.0f));
+		// Per-worker compute / wait split of the stencil runs, see ThreadGridStats
+		ThreadGridStats grid_stats() override
+		{
+			return _grid.Stats();
+		}
 
-						const bool inside_sphere = 
-							(std::pow(x - LENSE_SPHERE_X, 2.0f) + std::pow(y - LENSE_SPEHERE_Y, 2.0f) + std::pow(z - LENSE_SPEHERE_Z, 2.0f)) 
-								< std::pow(LENSE_SPHERE_RADIUS, 2.0);
+		void enable_perf_counters() noexcept override
+		{
+			_grid.EnablePerfCounters();
+		}
 
-						if (x < LENSE_BASE_X2 && inside_sphere || (x >= LENSE_BASE_X2))
-							medium.data[offset].velocity_bit = 1;// VEL_FACTOR2;
-						else
-							medium.data[offset].velocity_bit = 0; // VEL_FACTOR1;
+		// Hardware counters of the stencil runs, per voxel update since the start
+		PerfCounterReport perf_report() override
+		{
+			const double voxels = static_cast<double>(_size.width) * _size.height * _size.depth;
+			return PerfCounterReport::from(_grid.Stats().perf, voxels * static_cast<double>(_iteration));
+		}
 
-						cond_static.data[offset] = 127.0;
+	public:
 
-						if (yz_r > LENSE_RADIUS && x > LENSE_BASE_X1 && x < LENSE_BASE_X2)
-						{
-							if (x < LENSE_BASE_X1 + 10)
-							{
-								const float i = std::abs(x - LENSE_BASE_X1) + 2.0f;
-								cond_static.data[offset] = 127.0f * std::powf(EDGE_SLOW_DOWN_FACTOR, i);
-							}
-							else if (x > LENSE_BASE_X2 - 10)
-							{
-								const float i = std::abs(x - LENSE_BASE_X2) + 2.0f;
-								cond_static.data[offset] = 127.0f * std::powf(EDGE_SLOW_DOWN_FACTOR, i);
-							}
-
-							if (yz_r < LENSE_RADIUS + 10)
-							{
-								const float i = std::abs(yz_r - LENSE_RADIUS) + 2.0f;
-								cond_static.data[offset] *= std::powf(EDGE_SLOW_DOWN_FACTOR, i);
-							}
-
-							if ((x >= LENSE_BASE_X1 + 10) && (x <= LENSE_BASE_X2 - 10) && (yz_r >= LENSE_RADIUS + 10))
-							{
-								cond_static.data[offset] = 0.0f;
-							}
-						}
-						else if (yz_r > INNER_CAMERA_RADIUS && x >= LENSE_BASE_X2)
-						{							
-							if (yz_r < INNER_CAMERA_RADIUS + 10)
-							{
-								const float i = std::abs(yz_r - INNER_CAMERA_RADIUS) + 2.0f;
-								cond_static.data[offset] *= std::powf(EDGE_SLOW_DOWN_FACTOR, i);
-							}
-
-							if ((x <= TMedium::width()-EDGE_THICKNESS) && (yz_r >= INNER_CAMERA_RADIUS + 10))
-							{
-								cond_static.data[offset] = 0.0f;
-							}
-						}
-					}
+		// The lens, the camera and the damped edges - the static properties of voxel x, y, z of a scene of the given size.
+		// Depends on nothing but the coordinates, so any part of the scene can be built on its own (see OutOfCoreWorld).
+		static ItemStatic scene_voxel(const MediumSize& size, int x, int y, int z, boundary_kind boundary = boundary_kind::sponge) noexcept
+		{
+			const float LENSE_SPEHERE_Y = size.height / 2.0f;
+			const float LENSE_SPEHERE_Z = size.depth / 2.0f;
+			const float INNER_CAMERA_RADIUS = std::min(size.height, size.depth) / 2.0f - 15.0f;
+
+			ItemStatic ret{};
+
+			const float yz_r = std::sqrt(std::pow(y - LENSE_SPEHERE_Y, 2.0f) + std::pow(z - LENSE_SPEHERE_Z, 2.0f));
+
+			const bool inside_sphere = 
+				(std::pow(x - LENSE_SPHERE_X, 2.0f) + std::pow(y - LENSE_SPEHERE_Y, 2.0f) + std::pow(z - LENSE_SPEHERE_Z, 2.0f)) 
+					< std::pow(LENSE_SPHERE_RADIUS, 2.0);
+
+			if (x < LENSE_BASE_X2 && inside_sphere || (x >= LENSE_BASE_X2))
+				ret.velocity_bit = 1;// VEL_FACTOR2;
+			else
+				ret.velocity_bit = 0; // VEL_FACTOR1;
+
+			// resistance/conductivity is calculated in float for the precision, and only then stored
+			float conductivity = 127.0;
+
+			if (yz_r > LENSE_RADIUS && x > LENSE_BASE_X1 && x < LENSE_BASE_X2)
+			{
+				if (x < LENSE_BASE_X1 + 10)
+				{
+					const float i = std::abs(x - LENSE_BASE_X1) + 2.0f;
+					conductivity = 127.0f * ::powf(EDGE_SLOW_DOWN_FACTOR, i);
+				}
+				else if (x > LENSE_BASE_X2 - 10)
+				{
+					const float i = std::abs(x - LENSE_BASE_X2) + 2.0f;
+					conductivity = 127.0f * ::powf(EDGE_SLOW_DOWN_FACTOR, i);
+				}
+
+				if (yz_r < LENSE_RADIUS + 10)
+				{
+					const float i = std::abs(yz_r - LENSE_RADIUS) + 2.0f;
+					conductivity *= ::powf(EDGE_SLOW_DOWN_FACTOR, i);
+				}
+
+				if ((x >= LENSE_BASE_X1 + 10) && (x <= LENSE_BASE_X2 - 10) && (yz_r >= LENSE_RADIUS + 10))
+				{
+					conductivity = 0.0f;
 				}
 			}
+			else if (yz_r > INNER_CAMERA_RADIUS && x >= LENSE_BASE_X2)
+			{							
+				if (yz_r < INNER_CAMERA_RADIUS + 10)
+				{
+					const float i = std::abs(yz_r - INNER_CAMERA_RADIUS) + 2.0f;
+					conductivity *= ::powf(EDGE_SLOW_DOWN_FACTOR, i);
+				}
+
+				if ((x <= size.width-EDGE_THICKNESS) && (yz_r >= INNER_CAMERA_RADIUS + 10))
+				{
+					conductivity = 0.0f;
+				}
+			}
+
+			// Cylinder walls 
+			const float R = cylinder_radius(size);
+
+			const float dz = static_cast<float>(z - size.depth / 2);
+			const float dy = static_cast<float>(y - size.height / 2);
 
-			load_scene_edges(cond_static);
-			for (int z = 0; z < TMedium::depth(); ++z)
+			const float r = std::sqrt(dz * dz + dy * dy);
+
+			if (boundary == boundary_kind::pml)
+			{
+				// the layers start where the sponges do, but end sooner - the rest isn't updated; see pml_profile()
+				if (r - R >= PmlBoundary::THICKNESS || pml_depth_x(size, static_cast<float>(x)) >= PmlBoundary::THICKNESS)
+					conductivity = 0;
+			}
+			else
 			{
-				for (int x = 0; x < TMedium::width(); ++x)
+				if (r >= R)
 				{
-					for (int y = 0; y < TMedium::height(); ++y)
-					{
-						const int offset = TMedium::offset_for(x, y, z);
-						medium.data[offset].conductivity = static_cast<uint8_t>(cond_static.data[offset]);
-					}
+					if (r - R < EDGE_THICKNESS)
+						conductivity *= ::powf(EDGE_SLOW_DOWN_FACTOR, r - R);
+					else
+						conductivity = 0;
+				}
+
+				if (x < EDGE_THICKNESS)
+				{
+					conductivity *= ::powf(EDGE_SLOW_DOWN_FACTOR, static_cast<float>(EDGE_THICKNESS - x));
+				}
+				else if (x >= size.width - EDGE_THICKNESS)
+				{
+					conductivity *= ::powf(EDGE_SLOW_DOWN_FACTOR, static_cast<float>(x - (size.width - EDGE_THICKNESS)));
 				}
 			}
-		}
 
-	public:
+			ret.conductivity = static_cast<uint8_t>(conductivity);
+			return ret;
+		}
 
-#pragma warning(push)
-#pragma warning(disable:26451)
-		bool iterate()  noexcept
+		// The radius the cylinder wall's absorbing layer starts at
+		static float cylinder_radius(const MediumSize& size) noexcept
 		{
-			auto& current = _mediums[_iteration % 2];
-			auto& next = _mediums[(_iteration + 1) % 2];
+			return static_cast<float>(std::min(size.depth, size.height) / 2 - EDGE_THICKNESS);
+		}
 
-			fill(current, 11, (_iteration % 70) > 35);
+		// How deep x is in the absorbing layer of either x end, <= 0 outside
+		static float pml_depth_x(const MediumSize& size, float x) noexcept
+		{
+			const float lower = EDGE_THICKNESS - 0.5f;
+			const float upper = size.width - EDGE_THICKNESS - 0.5f;
+			return std::max(lower - x, x - upper);
+		}
 
-			const uint64_t start = __rdtsc();
+		// The PML damping at a point of the scene, see PmlBoundary. The cylinder wall's is split between y and z
+		// along the wall's normal - exact where the wall is square to an axis, an approximation in between.
+		static pml_damping pml_profile(const MediumSize& size, float x, float y, float z) noexcept
+		{
+			pml_damping ret{};
+			ret.x = PmlBoundary::damping(pml_depth_x(size, x));
 
-			constexpr int xd_neighbour = TMedium::offset_for(-1, 0, 0) - TMedium::offset_for(0, 0, 0);
-			constexpr int xu_neighbour = TMedium::offset_for(1, 0, 0) - TMedium::offset_for(0, 0, 0);
+			const float dz = z - static_cast<float>(size.depth / 2);
+			const float dy = y - static_cast<float>(size.height / 2);
+			const float r = std::sqrt(dz * dz + dy * dy);
 
-			constexpr int yd_neighbour = TMedium::offset_for(0, -1, 0) - TMedium::offset_for(0, 0, 0);
-			constexpr int yu_neighbour = TMedium::offset_for(0, 1, 0) - TMedium::offset_for(0, 0, 0);
+			const float damping = PmlBoundary::damping(r - cylinder_radius(size));
+			if (damping > 0.0f)
+			{
+				ret.y = damping * std::abs(dy) / r;
+				ret.z = damping * std::abs(dz) / r;
+			}
+			return ret;
+		}
 
-			constexpr int zd_neighbour = TMedium::offset_for(0, 0, -1) - TMedium::offset_for(0, 0, 0);
-			constexpr int zu_neighbour = TMedium::offset_for(0, 0, 1) - TMedium::offset_for(0, 0, 0);
+		// Every voxel is computed on its own, so the z-slabs are done in parallel. EnsembleWorld builds its
+		// statics - of the same type, its items are wider - with it as well
+		static void load_scene(TMediumStatic& medium, ThreadGrid& grid, boundary_kind boundary = boundary_kind::sponge)
+		{
+			const MediumSize size = medium.size();
 
-			_grid.GridRun(
+			grid.GridRun(
 				[&](int thread_idx, int num_threads)
 				{
-					int slice = TMedium::depth() / num_threads;
-					int from = thread_idx * slice;
-					int to = (thread_idx + 1) * slice;
+					int from, to;
+					StencilKernel::slab_for(medium.depth(), thread_idx, num_threads, from, to);
 
 					for (int z = from; z < to; ++z)
 					{
-						for (int y = 0; y < TMedium::height(); ++ y)
+						for (int y = 0; y < medium.height(); ++y)
 						{
-							for (int x = 0; x < TMedium::width(); ++x)
-							{
-								const int offset = TMedium::offset_for(x, y, z);
-								const auto item_static = _static.data[offset];
+							for (int x = 0; x < medium.width(); ++x)
+								medium.data[medium.offset_for(x, y, z)] = scene_voxel(size, x, y, z, boundary);
+						}
+					}
+				}
+				);
+		}
 
-								if (item_static.conductivity == 0)
-									continue;
+	public:
 
-								const float neigh_total =
-									current.data[offset + xd_neighbour].location +
-									current.data[offset + xu_neighbour].location +
-									current.data[offset + yd_neighbour].location +
-									current.data[offset + yu_neighbour].location +
-									current.data[offset + zd_neighbour].location +
-									current.data[offset + zu_neighbour].location;
+#pragma warning(push)
+#pragma warning(disable:26451)
+		bool iterate()  noexcept override
+		{
+			auto& current = _mediums[_iteration % 2];
+			auto& next = _mediums[(_iteration + 1) % 2];
 
-								const float neight_average = neigh_total * (1.0f / 6.0f);
+			{
+				ScopedTimer t{ _profiler, _phase_fill };
+				fill(current, _pattern, _size, 0, SOURCE_X, (_iteration % 70) > 35);
+			}
 
-								const float delta_x = current.data[offset].location - neight_average; // location relative to the current neightbour average 
+			const uint64_t start = __rdtsc();
 
-								const float velolicty_factor = item_static.velocity_bit ? VEL_FACTOR2 : VEL_FACTOR1;
-								const float conductivity_factor = static_cast<float>(item_static.conductivity) / 127.0f;
+			{
+				ScopedTimer t{ _profiler, _phase_stencil };
 
-								const float new_velocity = (current.data[offset].velocity - velolicty_factor * delta_x) * conductivity_factor * 0.99999f;
+				// the reductions are of current, which neither the kernels nor the PML correction change
+				const bool reduce = _reductions_every != 0 && _iteration % _reductions_every == 0;
 
-								next.data[offset].location = current.data[offset].location + new_velocity * LOC_FACTOR;
-								next.data[offset].velocity = new_velocity;
-							}
-						}
+				if (_multirate)
+				{
+					{
+						ThreadGrid::StatsScope s{ _grid };
+						StencilKernel::run_multirate(current, next, *_static, _grid, _multirate_split, _iteration % 2 == _multirate_parity);
 					}
+					if (reduce)
+						StencilKernel::reduce(current, *_static, _grid, _reductions);
+				}
+				else if (reduce && _kernel.run_reducing != nullptr)
+				{
+					ThreadGrid::StatsScope s{ _grid };
+					_kernel.run_reducing(current, next, *_static, _grid, _reductions);
+				}
+				else
+				{
+					{
+						ThreadGrid::StatsScope s{ _grid };
+						_kernel.run(current, next, *_static, _grid);
+					}
+					if (reduce)
+						StencilKernel::reduce(current, *_static, _grid, _reductions);
 				}
-				);
+
+				if (_pml)
+					_pml->apply(current, next, *_static, _grid);
+
+				if (reduce)
+					_reductions.iteration = _iteration;
+			}
 
 			const uint64_t end = __rdtsc();
 
 			if (_picture_exposing_until != 0)
 			{
+				ScopedTimer t{ _profiler, _phase_exposure };
 
-				for (int x = 0; x < TSrcPictureMedium::width(); ++x)
+				for (int x = 0; x < _src_picture.width(); ++x)
 				{
-					for (int y = 0; y < TSrcPictureMedium::height(); ++y)
+					for (int y = 0; y < _src_picture.height(); ++y)
 					{
-						for (int z = 0; z < TSrcPictureMedium::depth(); ++z)
+						for (int z = 0; z < _src_picture.depth(); ++z)
 						{
-							_src_picture.at(x, y, z) += std::powf(current.at(x + PIC_SRC_BASE, y, z).location, 2.0f); // energy is a power of 2 of displacement or speed 
+							_src_picture.at(x, y, z) += ::powf(current.at(x + PIC_SRC_BASE, y, z).location, 2.0f); // energy is a power of 2 of displacement or speed 
 						}
 					}
 				}
 
-				for (int x = 0; x < TPictureMedium::width(); ++x)
+				for (int x = 0; x < _picture.width(); ++x)
 				{
-					for (int y = 0; y < TPictureMedium::height(); ++y)
+					for (int y = 0; y < _picture.height(); ++y)
 					{
-						for (int z = 0; z < TPictureMedium::depth(); ++z)
+						for (int z = 0; z < _picture.depth(); ++z)
 						{
-							_picture.at(x, y, z) += std::powf(current.at(x + PIC_BASE, y, z).location, 2.0f); // energy is a power of 2 of displacement or speed 
+							_picture.at(x, y, z) += ::powf(current.at(x + PIC_BASE, y, z).location, 2.0f); // energy is a power of 2 of displacement or speed 
 						}
 					}
 				}
 
+				_convergence.add_frames(1);
+				if (_convergence.due() && _convergence.converged(_convergence.plane_sums(_picture)))
+				{
+					// the rest of the exposure would only repeat the same picture
+					_convergence.finish(_picture);
+					_convergence.finish(_src_picture);
+					_picture_exposing_until = _iteration;
+				}
+
 				if (_picture_exposing_until == _iteration)
 				{
 					_picture_exposing_until = 0;
-					save_pictures(_picture, _pictures_folder, PIC_BASE);
-					save_pictures(_src_picture, _pictures_folder, PIC_SRC_BASE);
+
+					if (!_pictures_folder.empty())
+					{
+						ScopedTimer ts{ _profiler, _phase_save_pictures };
+						save_pictures(_picture, _pictures_folder, PIC_BASE);
+						save_pictures(_src_picture, _pictures_folder, PIC_SRC_BASE);
+						_profiler.count(_counter_pictures);
+					}
 				}
 			}
 
 			elapsed_cpu_clocks += end - start;
 
 			_iteration++;
+			_profiler.count(_counter_iterations);
 			return true;
         }
 #pragma warning(pop)
 
-		uint64_t current_iteration() const noexcept
+		uint64_t current_iteration() const noexcept override
 		{
 			return _iteration;
 		}
 
+		// Per-phase latency histograms of iterate(): fill, stencil, exposure, save_pictures
+		Profiler& profiler() noexcept override
+		{
+			return _profiler;
+		}
+
+		MediumSize size() const noexcept override { return _size; }
+
 		const TMedium& get_data() const { return _mediums[_iteration % 2]; }
 
+		// The static medium, for the next world of the same size to share
+		scene_handle scene() const { return { _size, _boundary, &typeid(TMediumStatic), _static }; }
+
+		// Energy accumulated by the last (or the running) exposure, behind the lens and at the source
+		const TPictureMedium& exposure() const noexcept { return _picture; }
+		const TSrcPictureMedium& source_exposure() const noexcept { return _src_picture; }
 
-		const std::tuple<uint64_t, uint64_t> get_clocks_per_iter()
+		using IWorld::render_slice;
+
+		// Colour-maps the current state of the given z-slice into rgba (see SliceRenderer), runs on the world's thread grid,
+		// rgba must hold width() * height() pixels
+		void render_slice(uint32_t* rgba, int z) noexcept override
+		{
+			SliceRenderer::render(get_data(), z, rgba, _grid);
+		}
+
+
+		const std::tuple<uint64_t, uint64_t> get_clocks_per_iter() override
 		{
 			if (_iteration == 0)
 				return { 0, 0 };
 
 			const uint64_t clocks_per_iter{ elapsed_cpu_clocks / _iteration };
-			const uint64_t clocks_per_iter_per_voxel{ clocks_per_iter / (TMedium::depth() * TMedium::width() * TMedium::height()) };
+			const uint64_t clocks_per_iter_per_voxel{ clocks_per_iter / (static_cast<uint64_t>(_size.depth) * _size.width * _size.height) };
 
 			return { clocks_per_iter, clocks_per_iter_per_voxel };
 		}
 
-	private: 
-		void fill(TMedium& medium, int x_plane, bool inverse)
+	public:
+		// Writes the pattern (negated if inverse) into plane x_plane, centred in a scene of the given size.
+		// The medium may hold only part of the scene: its plane z is plane z_base + z of the scene.
+		template <typename TAnyMedium>
+		static void fill(TAnyMedium& medium, const TMediumPatternStatic& pattern, const MediumSize& scene, int z_base, int x_plane, bool inverse)
 		{
-			if (!inverse)
-			{
-				for (int z = 0; z < _pattern.depth(); ++z)
-				{
-					for (int y = 0; y < _pattern.height(); ++y)
-					{
-						auto& item = medium.at(x_plane, y + PATTERN_Y_OFFSET, z + PATTERN_Z_OFFSET);
-						item.location = _pattern.at(0, y, z);
-						item.velocity = 0.0f;
-					}
-				}
-			}
-			else
+			const int PATTERN_Y_OFFSET = (scene.height - PATTERN_SIDE) / 2;
+			const int PATTERN_Z_OFFSET = (scene.depth - PATTERN_SIDE) / 2;
+
+			const int z_from = std::max(0, z_base - PATTERN_Z_OFFSET);
+			const int z_to = std::min(pattern.depth(), z_base + medium.depth() - PATTERN_Z_OFFSET);
+
+			const float sign = inverse ? -1.0f : 1.0f;
+
+			for (int z = z_from; z < z_to; ++z)
 			{
-				for (int z = 0; z < _pattern.depth(); ++z)
+				for (int y = 0; y < pattern.height(); ++y)
 				{
-					for (int y = 0; y < _pattern.height(); ++y)
-					{
-						auto& item = medium.at(x_plane, y + PATTERN_Y_OFFSET, z + PATTERN_Z_OFFSET);
-						item.location = - _pattern.at(0, y, z);
-						item.velocity = 0.0f;
-					}
+					auto&& item = medium.at(x_plane, y + PATTERN_Y_OFFSET, z + PATTERN_Z_OFFSET - z_base); // a reference or a proxy
+					item.location = sign * pattern.at(0, y, z);
+					item.velocity = 0.0f;
 				}
 			}
 		}
 
+		// One png per picture plane, named after the scene x of the plane
 		template <typename TPicture>
-		void save_pictures(TPicture& pic, const std::string& folder, int idx_offset)
+		static void save_pictures(const TPicture& pic, const std::string& folder, int idx_offset)
 		{
 			auto logger = std::make_unique<PngLogger>(folder);
 
@@ -503,4 +744,69 @@ namespace waves
 			}
 		}
     };
+
+	inline constexpr MediumSize DEFAULT_MEDIUM_SIZE{ 432, 768, 768 };
+
+	using World = BasicWorld<Medium<DEFAULT_MEDIUM_SIZE.width, DEFAULT_MEDIUM_SIZE.height, DEFAULT_MEDIUM_SIZE.depth>>;
+
+	namespace detail
+	{
+		template <int W, int H, int D>
+		struct WorldSize
+		{
+			using TWorld = BasicWorld<Medium<W, H, D>>;
+			static constexpr MediumSize size{ W, H, D };
+		};
+
+		template <typename... TSizes>
+		struct WorldSizeList
+		{
+			template <typename TWorld>
+			static std::unique_ptr<IWorld> make_one(const MediumSize& size, int num_threads, const std::vector<int>& cpus, scene_handle* scene, boundary_kind boundary)
+			{
+				auto ret = std::make_unique<TWorld>(size, num_threads, cpus, scene != nullptr ? *scene : scene_handle{}, boundary);
+				if (scene != nullptr)
+					*scene = ret->scene();
+				return ret;
+			}
+
+			static std::unique_ptr<IWorld> make(const MediumSize& size, int num_threads, const std::vector<int>& cpus, scene_handle* scene, boundary_kind boundary)
+			{
+				std::unique_ptr<IWorld> ret;
+				((!ret && size == TSizes::size ? (ret = make_one<typename TSizes::TWorld>(size, num_threads, cpus, scene, boundary), true) : false), ...);
+				return ret;
+			}
+
+			static constexpr bool contains(const MediumSize& size) noexcept
+			{
+				return ((size == TSizes::size) || ...);
+			}
+		};
+	}
+
+	//
+	// The sizes with a compiled-in Medium, the stencil strides are constants there. Anything else runs
+	// on a RuntimeMedium - same results, somewhat slower. Every entry costs a full set of kernels in the binary.
+	//
+	using RegisteredWorldSizes = detail::WorldSizeList<
+		detail::WorldSize<304, 256, 256>,
+		detail::WorldSize<432, 256, 256>,
+		detail::WorldSize<432, 512, 512>,
+		detail::WorldSize<DEFAULT_MEDIUM_SIZE.width, DEFAULT_MEDIUM_SIZE.height, DEFAULT_MEDIUM_SIZE.depth>
+	>;
+
+	// nullptr if the scene doesn't fit, see BasicWorld::size_supported(). With scene, the world shares the static
+	// medium *scene holds if it was made for the same size and boundary, and puts its own there otherwise.
+	inline std::unique_ptr<IWorld> make_world(const MediumSize& size, int num_threads, const std::vector<int>& cpus = {}, scene_handle* scene = nullptr,
+		boundary_kind boundary = boundary_kind::sponge)
+	{
+		if (!BasicWorld<RuntimeMedium<>>::size_supported(size))
+			return nullptr;
+
+		auto ret = RegisteredWorldSizes::make(size, num_threads, cpus, scene, boundary);
+		if (!ret)
+			ret = detail::WorldSizeList<>::make_one<BasicWorld<RuntimeMedium<>>>(size, num_threads, cpus, scene, boundary);
+
+		return ret;
+	}
 }
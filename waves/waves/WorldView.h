@@ -9,6 +9,7 @@
 #include <GL/glu.h>			/* OpenGL utilities header file */
 
 #include "glText.h"
+#include "SliceTexture.h"
 
 #include "World.h"
 
@@ -21,9 +22,6 @@ namespace waves
 		int numActiveThreads;
 		bool showDetailedcontrols;
 		bool paused;
-		uint64_t clocks_per_iter{ 0 };
-		uint64_t clocks_per_iter_per_voxel{ 0 };
-		uint64_t iteration{ 0 };
 
 		WorldViewDetails(int nThr, bool p) 
 			: numActiveThreads{ nThr }
@@ -34,6 +32,21 @@ namespace waves
 		}
 	};
 
+	// What the simulation thread hands over to the UI: the colour-mapped mid slice plus stats
+	struct WorldViewSnapshot
+	{
+		std::vector<uint32_t> slice;
+		int width{ 0 };
+		int height{ 0 };
+
+		uint64_t clocks_per_iter{ 0 };
+		uint64_t clocks_per_iter_per_voxel{ 0 };
+		uint64_t iteration{ 0 };
+
+		// Profiler::print() output of the simulation and the controller, one line per phase
+		std::vector<std::string> profile;
+	};
+
     class WorldView
     {
 		static constexpr uint32_t LABELS_BACKGROUND = 0xff000000;
@@ -44,14 +57,12 @@ namespace waves
 
 		static constexpr double LOCATION_SCALE{ 512.0 / props::ViewPortWidth }; 		
 		
-		World& _world;
-
 		glText::Label _controlsLabel{ LABELS_BACKGROUND, CONTROLS_LABEL_FOREGROUND, "<?> - help" };
 
 		glText::Label _controlsLabelDetailed{
 			LABELS_BACKGROUND,
 			{
-				std::pair(RUGA_KOLORO, "<T> - toggle recording (dump png every 1024 frames)"),
+				std::pair(RUGA_KOLORO, "<T> - toggle recording (see --record-format)"),
 				std::pair(RUGA_KOLORO, "<?> - help ON/OFF, <SPACE> - (un)pause, <esc> - quit"),
 			}
 		};
@@ -59,11 +70,12 @@ namespace waves
 		glText::Label _iterAndCfgLabel{ LABELS_BACKGROUND, VERDA_KOLORO, "_TMP_" };
 
 		glText::Label _pausedLabel{ LABELS_BACKGROUND, RUGA_KOLORO, "<< PAUSED >>" };
+
+		SliceTexture _sliceTexture;
 		
     public:
 
-        WorldView(World& world)
-            : _world(world)
+        WorldView()
         {
             Random rnd = Random();
 		}
@@ -83,7 +95,7 @@ namespace waves
 			glPopMatrix();
 		}
 
-		void PrintStats(const WorldViewDetails& details) noexcept
+		void PrintStats(const WorldViewSnapshot& details) noexcept
 		{
 			glPushMatrix();
 
@@ -92,19 +104,18 @@ namespace waves
 			std::ostringstream rcfg;
 			rcfg << "iter:" << details.iteration << " perf: " << details.clocks_per_iter / 1000000 << "M clk/iter " << details.clocks_per_iter_per_voxel << " clk/iter/voxel ";
 
-			_iterAndCfgLabel.Update(
-				LABELS_BACKGROUND,
-				{ 
-//					std::pair(VERDA_KOLORO, ostr.str()),
-					std::pair(RUGA_KOLORO, rcfg.str()),
-				});
+			std::vector<std::pair<uint32_t, std::string>> lines{ std::pair(RUGA_KOLORO, rcfg.str()) };
+			for (const auto& line : details.profile)
+				lines.emplace_back(VERDA_KOLORO, line);
+
+			_iterAndCfgLabel.Update(LABELS_BACKGROUND, lines);
 			_iterAndCfgLabel.DrawAt(-1.0, 0.94);
 
 			glPopMatrix();
 		}
 
         void UpdateFrom(
-			World& world,
+			const WorldViewSnapshot& snapshot,
 			const WorldViewDetails& details, 
 			bool hideControlsAndStats
 		)  noexcept
@@ -162,62 +173,24 @@ namespace waves
 
 			//auto min_size = static_cast<float>(std::min(waves::props::ViewPortWidth, waves::props::ViewPortHeight));
 
-			const auto& medium = world.get_data();
-
-			for (int x = 0; x < medium.width(); ++x)
+			// the slice was colour-mapped in parallel by the simulation thread, here it is only uploaded and drawn as one textured quad
+			if (snapshot.width != 0 && snapshot.height != 0)
 			{
-				for (int y = 0; y < medium.height(); ++y)
-				{
-					auto& item = medium.at(x, y, medium.depth() / 2);
-
-					auto v = item.location;
-
-					bool empty = (item.location == 0) && (item.velocity == 0);
-
-					glPushMatrix();
-
-					auto loc_x{ (float)x * waves::props::ViewPortWidth / medium.width() };
-					auto loc_y{ (float)y * waves::props::ViewPortHeight / medium.height() };
-
-					glTranslatef(loc_x, loc_y, 0.0);
-
-					glBegin(GL_TRIANGLES);
-
-					float brightness_p = std::max(0.0f, std::min(1.0f, v / 1000.0f));
-					float brightness_n = std::max(0.0f, std::min(1.0f, -v / 1000.0f)) / 4.0f;
-
-					if (!empty)
-					{
-						glColor3f(brightness_p, std::max(0.0f, 3.0f * brightness_p - 2.0f), brightness_n);
-					}
-					else
-					{
-						glColor3f(0.5f, 0.5f, 0.0f);
-					}
-
-					int idx = 0;
-
-					const float sz_w = (float)waves::props::ViewPortWidth / medium.width();
-					const float sz_h = (float)waves::props::ViewPortHeight / medium.height();
-
-					glIndexi(++idx); glVertex2f(0.0f, 0.0f);
-					glIndexi(++idx); glVertex2f(sz_w, 0.0f);
-					glIndexi(++idx); glVertex2f(0.0f, sz_h);
-
-					glIndexi(++idx); glVertex2f(sz_w, sz_h);
-					glIndexi(++idx); glVertex2f(sz_w, 0.0f);
-					glIndexi(++idx); glVertex2f(0.0f, sz_h);
-
-					glEnd();
-
-					glPopMatrix();
-
-				}
+				_sliceTexture.Update(
+					snapshot.width,
+					snapshot.height,
+					[&](uint32_t* rgba) { ::memcpy(rgba, snapshot.slice.data(), snapshot.slice.size() * sizeof(uint32_t)); });
 			}
 
+			_sliceTexture.DrawAt(
+				0.0f,
+				0.0f,
+				static_cast<float>(waves::props::ViewPortWidth),
+				static_cast<float>(waves::props::ViewPortHeight));
+
             glPopMatrix();
 
-			PrintStats(details);
+			PrintStats(snapshot);
 
 		}
     };
@@ -0,0 +1,205 @@
+
+#include "stdafx.h"
+
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <stdint.h>
+#include <vector>
+#if !defined(WAVES_HEADLESS)
+#include <GL/gl.h>			/* OpenGL header file */
+#include <GL/glu.h>			/* OpenGL utilities header file */
+#endif
+
+#include "Y4mLogger.h"
+#include "Trace.h"
+
+Y4mLogger::Y4mLogger(const std::string& logFolder, Format format)
+	: _logFolder{ logFolder }
+	, _format{ format }
+	, _streamBuffer(WRITE_BUFFER_SIZE)
+	, _pixels(4)
+	, _planes(3)
+	, _prevFrame(1)
+	, _vpWidth{ 1 }
+	, _vpHeight{ 1 }
+{
+	std::error_code ec;
+	std::filesystem::create_directories(logFolder, ec);
+}
+
+
+Y4mLogger::~Y4mLogger()
+{
+	closeStream();
+}
+
+void Y4mLogger::onViewportResize(int width, int height)
+{
+	if (width == _vpWidth && height == _vpHeight)
+		return;
+
+	// Y4M can't change the frame size mid-stream, the next frame starts a new file
+	closeStream();
+
+	_vpWidth = width;
+	_vpHeight = height;
+	_pixels.resize(width * height * 4);
+	_planes.resize(width * height * 3);
+	_prevFrame.assign(width * height, 0);
+	_encoded.reserve(width * height * 2 + 16);
+}
+
+void Y4mLogger::onNewFrame()
+{
+#if !defined(WAVES_HEADLESS)
+	// Capture the actual pixels
+	glReadPixels(0, 0, _vpWidth, _vpHeight, GL_RGBA, GL_UNSIGNED_BYTE, &_pixels[0]);
+	recordFrame();
+#endif
+}
+
+void Y4mLogger::onRenderedFrame(const unsigned char* rgba, int width, int height)
+{
+	onViewportResize(width, height);
+	::memcpy(_pixels.data(), rgba, width * height * 4);
+	recordFrame();
+}
+
+void Y4mLogger::stop()
+{
+	closeStream();
+}
+
+void Y4mLogger::recordFrame()
+{
+	WAVES_TRACE_SCOPE(_format == Format::Y4m ? "y4m_encode" : "rle_encode");
+
+	if (_stream == nullptr)
+		openStream();
+
+	if (_stream == nullptr)
+		return;
+
+	if (_format == Format::Y4m)
+		writeY4mFrame();
+	else
+		writeDeltaRleFrame();
+}
+
+void Y4mLogger::openStream()
+{
+	std::ostringstream str;
+	str << "recording_" << std::setw(3) << std::setfill('0') << _nextSeq++ << (_format == Format::Y4m ? ".y4m" : ".wrle");
+
+	auto name = (std::filesystem::path(_logFolder) / str.str()).string();
+
+	_stream = fopen(name.c_str(), "wb");
+	if (_stream == nullptr)
+		return;
+
+	// a single large buffer, so the disk sees few big sequential writes
+	setvbuf(_stream, _streamBuffer.data(), _IOFBF, _streamBuffer.size());
+
+	if (_format == Format::Y4m)
+	{
+		fprintf(_stream, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", _vpWidth, _vpHeight);
+	}
+	else
+	{
+		const uint32_t hdr[3]{ 0x454c5257u /* "WRLE" */, static_cast<uint32_t>(_vpWidth), static_cast<uint32_t>(_vpHeight) };
+		fwrite(hdr, sizeof(hdr), 1, _stream);
+		std::fill(_prevFrame.begin(), _prevFrame.end(), 0);
+	}
+}
+
+void Y4mLogger::closeStream()
+{
+	if (_stream != nullptr)
+	{
+		fclose(_stream);
+		_stream = nullptr;
+	}
+}
+
+void Y4mLogger::writeY4mFrame()
+{
+	const int planeSize = _vpWidth * _vpHeight;
+
+	unsigned char* yPlane = &_planes[0];
+	unsigned char* uPlane = &_planes[planeSize];
+	unsigned char* vPlane = &_planes[2 * planeSize];
+
+	// GL rows are bottom-up, Y4M rows are top-down. BT.601 full range, fixed point
+	for (int row = 0; row < _vpHeight; ++row)
+	{
+		const unsigned char* src_row = &_pixels[row * _vpWidth * 4]; // src img is RGBA
+		const int dst_offs = (_vpHeight - row - 1) * _vpWidth;
+
+		for (int px = 0; px < _vpWidth; ++px)
+		{
+			const int r = src_row[4 * px + 0];
+			const int g = src_row[4 * px + 1];
+			const int b = src_row[4 * px + 2];
+
+			yPlane[dst_offs + px] = static_cast<unsigned char>((77 * r + 150 * g + 29 * b) >> 8);
+			uPlane[dst_offs + px] = static_cast<unsigned char>(((-43 * r - 85 * g + 128 * b) >> 8) + 128);
+			vPlane[dst_offs + px] = static_cast<unsigned char>(((128 * r - 107 * g - 21 * b) >> 8) + 128);
+		}
+	}
+
+	fwrite("FRAME\n", 6, 1, _stream);
+	fwrite(_planes.data(), _planes.size(), 1, _stream);
+}
+
+void Y4mLogger::writeDeltaRleFrame()
+{
+	_encoded.clear();
+	_encoded.push_back(0x4d415246u); // "FRAM"
+	_encoded.push_back(0); // payload size, patched below
+
+	int idx = 0;
+	const int total = _vpWidth * _vpHeight;
+
+	auto pixel_at = [&](int i)
+	{
+		// flip rows on the fly, so the stream is top-down like the png / y4m output
+		const int row = i / _vpWidth;
+		const int px = i % _vpWidth;
+		uint32_t value;
+		::memcpy(&value, &_pixels[((_vpHeight - row - 1) * _vpWidth + px) * 4], sizeof(value));
+		return value;
+	};
+
+	while (idx < total)
+	{
+		uint32_t zero_run = 0;
+		while (idx < total && pixel_at(idx) == _prevFrame[idx])
+		{
+			++zero_run;
+			++idx;
+		}
+
+		const size_t literal_count_pos = _encoded.size() + 1;
+		_encoded.push_back(zero_run);
+		_encoded.push_back(0);
+
+		uint32_t literal_count = 0;
+		while (idx < total)
+		{
+			const uint32_t value = pixel_at(idx);
+			if (value == _prevFrame[idx])
+				break;
+
+			_encoded.push_back(value ^ _prevFrame[idx]);
+			_prevFrame[idx] = value;
+			++literal_count;
+			++idx;
+		}
+
+		_encoded[literal_count_pos] = literal_count;
+	}
+
+	_encoded[1] = static_cast<uint32_t>((_encoded.size() - 2) * sizeof(uint32_t));
+	fwrite(_encoded.data(), _encoded.size() * sizeof(uint32_t), 1, _stream);
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include "IImageLogger.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+//
+// Appends every frame into a single stream file instead of creating one file per frame.
+//
+// Two stream flavours are supported:
+//  * plain Y4M (YUV4MPEG2, 4:4:4, full range) - playable / transcodable by ffmpeg, mpv, etc
+//  * delta-RLE ("WRLE") - each frame is XOR-ed with the previous one and the result is
+//    run-length encoded as runs of unchanged pixels followed by literal pixels.
+//
+// WRLE layout (all integers are little-endian uint32):
+//   "WRLE" width height
+//   per frame: "FRAM" payload_size [zero_run literal_count literal_pixels...]*
+// Decoding is prev ^= literal for every pixel, frames start from an all-zero image.
+//
+class Y4mLogger : public IImageLogger
+{
+public:
+	enum class Format
+	{
+		Y4m,
+		DeltaRle
+	};
+
+private:
+	static constexpr size_t WRITE_BUFFER_SIZE = 32 * 1024 * 1024;
+
+	std::string _logFolder;
+	Format _format;
+
+	FILE* _stream{ nullptr };
+	std::vector<char> _streamBuffer;
+
+	std::vector<unsigned char> _pixels;
+	std::vector<unsigned char> _planes;
+	std::vector<uint32_t> _prevFrame;
+	std::vector<uint32_t> _encoded;
+
+	int _vpWidth;
+	int _vpHeight;
+
+	uint64_t _nextSeq{ 0 };
+
+public:
+	Y4mLogger(const std::string& logFolder, Format format = Format::Y4m);
+
+	virtual ~Y4mLogger();
+
+	void onViewportResize(int widht, int height) override;
+	void onNewFrame() override;
+	void onRenderedFrame(const unsigned char* rgba, int width, int height) override;
+	void stop() override;
+
+	inline std::vector<unsigned char>& data()
+	{
+		return _pixels;
+	}
+
+	// Appends the frame currently held in data(), rows are bottom-up (GL order)
+	void recordFrame();
+
+private:
+	void openStream();
+	void closeStream();
+
+	void writeY4mFrame();
+	void writeDeltaRleFrame();
+};
@@ -0,0 +1,116 @@
+// bench.cpp : stencil benchmark suite, reports Gvoxel/s, effective GB/s and the fraction of STREAM bandwidth as JSON.
+//
+// Windows: waves_bench.vcxproj
+// Linux:   g++ -std=c++20 -O3 -mavx2 -mfma -DAVX2 -pthread bench.cpp -o waves_bench
+//
+
+#include "stdafx.h"
+
+#include <immintrin.h>
+#include <fstream>
+#include <iostream>
+
+#include "Benchmark.h"
+
+int main(int argc, char** argv)
+{
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+    using namespace waves::bench;
+
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        if (std::string{ argv[idx] } == "--list-sizes")
+        {
+            std::cout << registered_sizes() << std::endl;
+            return 0;
+        }
+        if (std::string{ argv[idx] } == "--list-kernels")
+        {
+            using TMedium = waves::Medium<64, 64, 64>;
+            using TMediumStatic = waves::Medium<64, 64, 64, waves::ItemStatic>;
+            for (const auto& v : kernel_variants<TMedium, TMediumStatic>())
+                std::cout << v.name << std::endl;
+            return 0;
+        }
+    }
+
+    bench_config cfg;
+    if (!cfg.parse_command_line(argc, argv))
+    {
+        std::cerr << bench_config::get_usage();
+        return 1;
+    }
+
+    if (cfg.boundaries)
+    {
+        ThreadGrid grid{ cfg.threads.front() };
+        const auto boundaries = run_boundaries(grid);
+
+        if (cfg.json_file.empty())
+        {
+            write_json(std::cout, boundaries, cfg.threads.front());
+        }
+        else
+        {
+            std::ofstream out{ cfg.json_file };
+            write_json(out, boundaries, cfg.threads.front());
+        }
+        return 0;
+    }
+
+    std::vector<bench_result> results;
+    std::vector<std::pair<int, double>> stream;
+
+    for (int threads : cfg.threads)
+    {
+        ThreadGrid grid{ threads };
+        if (cfg.perf_counters)
+            grid.EnablePerfCounters();
+
+        const double stream_gbs = stream_triad_gbytes_per_second(grid, cfg.stream_mb, cfg.repetitions);
+        stream.emplace_back(threads, stream_gbs);
+        std::cerr << "STREAM triad, " << threads << " threads: " << stream_gbs << " GB/s" << std::endl;
+
+        for (const auto& size : cfg.sizes)
+        {
+            for (float fill : cfg.fills)
+            {
+                for (auto layout : cfg.layouts)
+                {
+                    for (auto page_mode : cfg.page_modes)
+                    {
+                        waves::PageAllocator::set_mode(page_mode);
+
+                        bool ok = true;
+                        const bool registered = !cfg.runtime_size && layout == waves::MediumLayout::padding::padded && with_registered_size(size,
+                            [&](auto tag)
+                            {
+                                using TMedium = typename decltype(tag)::type;
+                                ok = run_one<TMedium>(cfg, size, layout, threads, fill, grid, results);
+                            });
+
+                        if (!registered)
+                            ok = run_one<waves::RuntimeMedium<>>(cfg, size, layout, threads, fill, grid, results);
+
+                        if (!ok)
+                            return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    if (cfg.json_file.empty())
+    {
+        write_json(std::cout, results, stream, cfg);
+    }
+    else
+    {
+        std::ofstream out{ cfg.json_file };
+        write_json(out, results, stream, cfg);
+    }
+
+    return 0;
+}
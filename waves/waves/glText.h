@@ -3,6 +3,8 @@
 #include <array>
 #include <stdint.h>
 #include <numeric>
+#include <string>
+#include <vector>
 
 namespace glText
 {
@@ -1012,7 +1014,15 @@ namespace glText
 			std::initializer_list<std::pair<uint32_t, std::string>> texts
 		) noexcept
 		{
-			size_t maxLen = std::reduce(texts.begin(), texts.end(),
+			Update(bgColor, std::vector<std::pair<uint32_t, std::string>>{ texts });
+		}
+
+		void Update(
+			uint32_t bgColor,
+			const std::vector<std::pair<uint32_t, std::string>>& texts
+		) noexcept
+		{
+			size_t maxLen = std::accumulate(texts.begin(), texts.end(),
 				static_cast<size_t>(0), // init 
 				[&](const size_t& mx, const std::pair<uint32_t, std::string> & s) { return mx > s.second.size() ? mx : s.second.size(); });
 
@@ -0,0 +1,83 @@
+// headless.cpp : batch front end, runs the simulation without any window or GL context.
+//
+// Windows: waves_headless.vcxproj
+// Linux:   g++ -std=c++20 -O3 -mavx2 -mfma -DAVX2 -DWAVES_HEADLESS -pthread
+//              headless.cpp PngLogger.cpp lodepng.cpp -o waves_headless
+//          add -DWAVES_TRACE for --trace support
+//          build with mpicxx and -DWAVES_MPI for --mpi, run under mpirun
+//
+
+#include "stdafx.h"
+
+#include <immintrin.h>
+#include <iostream>
+#include <memory>
+
+#include "RuntimeConfig.h"
+#include "HeadlessRunner.h"
+#include "SweepRunner.h"
+#include "Autotune.h"
+#include "Golden.h"
+
+int main(int argc, char** argv)
+{
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+    waves::runtime_config config;
+    if (!config.parse_command_line(argc, argv))
+    {
+        std::cerr << waves::runtime_config::get_headless_usage();
+        return 1;
+    }
+
+    if (!config.golden_write_file().empty())
+        return waves::golden::write_golden(config.golden_write_file(), config.samples_folder(), config.kernel(), config.threads());
+
+    if (!config.golden_check_file().empty())
+        return waves::golden::check_golden(config.golden_check_file(), config.samples_folder(), config.kernel(), config.threads());
+
+    // the trace is written by HeadlessRunner, the tuner and the sweep would drop it silently
+    if (!config.trace_file().empty() && (config.autotune() || !config.sweep_manifest().empty()))
+    {
+        std::cerr << "--trace isn't supported with --autotune or --sweep" << std::endl;
+        return 1;
+    }
+
+    if (config.autotune())
+    {
+        waves::Autotuner tuner{ config };
+        return tuner.Run();
+    }
+
+    if (const auto tuned = waves::apply_tuning_profile(config))
+    {
+        std::cout << "Tuning profile: kernel " << config.kernel() << ", " << config.threads() << " threads (tuned for "
+            << tuned->size.width << "x" << tuned->size.height << "x" << tuned->size.depth << ")" << std::endl;
+    }
+
+    if (!config.sweep_manifest().empty())
+    {
+        waves::SweepRunner sweep{ config };
+        return sweep.Run();
+    }
+
+    std::unique_ptr<waves::RankTransport> transport;
+    try
+    {
+        transport = waves::make_rank_transport(config.ranks(), config.mpi(), config.medium_size(), &argc, &argv);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Can't start the ranks: " << e.what() << std::endl;
+        return 1;
+    }
+
+    int ret;
+    {
+        waves::HeadlessRunner runner{ config, transport.get() };
+        ret = runner.Run();
+    }
+
+    return transport ? transport->finish(ret) : ret;
+}
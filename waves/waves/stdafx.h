@@ -5,6 +5,8 @@
 
 #pragma once
 
+#if defined(_WIN32)
+
 #include "targetver.h"
 
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
@@ -17,5 +19,13 @@
 #include <memory.h>
 #include <tchar.h>
 
+#else
+
+// C RunTime Header Files
+#include <stdlib.h>
+#include <string.h>
+
+#endif
+
 
 // reference additional headers your program requires here
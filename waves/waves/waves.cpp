@@ -10,6 +10,7 @@
 #include <string>
 
 #include "RuntimeConfig.h"
+#include "Autotune.h"
 #include "World.h"
 #include "WorldView.h"
 #include "MainController.h"
@@ -324,10 +325,12 @@ int APIENTRY wWinMain(_In_ HINSTANCE hCurrentInst, _In_opt_ HINSTANCE hPreviousI
     waves::runtime_config config;
     if (!config.parse_command_line(lpszCmdLine))
     {
-        MessageBox( NULL, L"Usage: \nwaves.exe [--scene <n>] [--auto-start]", L"Incorrect usage",  MB_OK | MB_ICONHAND);
+        MessageBox( NULL, config.get_usage(), L"Incorrect usage",  MB_OK | MB_ICONHAND);
         return 0;
     }
 
+    waves::apply_tuning_profile(config);
+
     controller = make_controller(config);
 
     controller->SetHWND(